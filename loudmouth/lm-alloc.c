@@ -0,0 +1,242 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2003 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:lm-alloc
+ * @Title: Allocation statistics
+ * @Short_description: How much memory messages, nodes and handlers use
+ *
+ * Messages, the nodes built with lm_message_node_add_child() and friends,
+ * and message handlers are allocated from per size slabs with per thread
+ * caches, so floods of short lived stanzas reuse memory instead of 
+ * fragmenting the heap. Nodes of received stanzas live in a per stanza
+ * arena and are not counted here. lm_alloc_get_stats() tells how many of
+ * each are alive.
+ *
+ * Embedders that account memory themselves can give a connection an
+ * #LmAllocator with lm_connection_set_allocator(), the memory of the 
+ * stanzas it receives and its output backlog then comes from there.
+ */
+
+#include <config.h>
+#include <string.h>
+
+#include "lm-internals.h"
+#include "lm-alloc.h"
+
+typedef struct {
+	gint n_live;
+	gint n_allocated;
+	gint bytes_live;
+} AllocCounters;
+
+/* Every thread counts in counters of its own, so allocating doesn't 
+ * make threads fight over a cache line. Only the thread owning them 
+ * changes them, lm_alloc_get_stats() adds them up, which may see a 
+ * count a little late but never a torn one. The counters of threads
+ * that are gone are added to alloc_retired. */
+typedef struct _ThreadCounters ThreadCounters;
+
+struct _ThreadCounters {
+	volatile AllocCounters  counters[LM_ALLOC_N_TYPES];
+	ThreadCounters         *next;
+	ThreadCounters         *prev;
+};
+
+G_LOCK_DEFINE_STATIC (alloc_stats);
+static ThreadCounters *alloc_threads;
+static AllocCounters   alloc_retired[LM_ALLOC_N_TYPES];
+static GStaticPrivate  alloc_private = G_STATIC_PRIVATE_INIT;
+
+static void
+alloc_thread_counters_free (gpointer data)
+{
+	ThreadCounters *thread = data;
+	guint           i;
+
+	G_LOCK (alloc_stats);
+
+	for (i = 0; i < LM_ALLOC_N_TYPES; i++) {
+		alloc_retired[i].n_live      += thread->counters[i].n_live;
+		alloc_retired[i].n_allocated += thread->counters[i].n_allocated;
+		alloc_retired[i].bytes_live  += thread->counters[i].bytes_live;
+	}
+
+	if (thread->prev) {
+		thread->prev->next = thread->next;
+	} else {
+		alloc_threads = thread->next;
+	}
+	if (thread->next) {
+		thread->next->prev = thread->prev;
+	}
+
+	G_UNLOCK (alloc_stats);
+
+	g_free (thread);
+}
+
+static inline volatile AllocCounters *
+alloc_get_counters (LmAllocType type)
+{
+	ThreadCounters *thread = g_static_private_get (&alloc_private);
+
+	if (G_UNLIKELY (!thread)) {
+		thread = g_new0 (ThreadCounters, 1);
+
+		G_LOCK (alloc_stats);
+		thread->next = alloc_threads;
+		if (alloc_threads) {
+			alloc_threads->prev = thread;
+		}
+		alloc_threads = thread;
+		G_UNLOCK (alloc_stats);
+
+		g_static_private_set (&alloc_private, thread, 
+				      alloc_thread_counters_free);
+	}
+
+	return &thread->counters[type];
+}
+
+/* Allocates @size zeroed bytes of @type from the slab allocator */
+gpointer
+_lm_alloc_new0 (LmAllocType type, gsize size)
+{
+	volatile AllocCounters *counters = alloc_get_counters (type);
+
+	counters->n_live++;
+	counters->n_allocated++;
+	counters->bytes_live += size;
+
+	return g_slice_alloc0 (size);
+}
+
+/* Frees @mem, which must have been allocated with the same @type and
+ * @size. Memory freed by another thread than the one allocating it 
+ * leaves the counts of both off, only their sum is right. */
+void
+_lm_alloc_free (LmAllocType type, gsize size, gpointer mem)
+{
+	volatile AllocCounters *counters;
+
+	if (!mem) {
+		return;
+	}
+
+	counters = alloc_get_counters (type);
+	counters->n_live--;
+	counters->bytes_live -= size;
+
+	g_slice_free1 (size, mem);
+}
+
+/**
+ * lm_alloc_get_stats:
+ * @type: the kind of objects to get the statistics of
+ * @stats: return location for the statistics
+ *
+ * Fills in @stats with the current allocation statistics of @type,
+ * counted over all connections and threads. Allocations made by other
+ * threads at the same time may not be counted yet.
+ **/
+void
+lm_alloc_get_stats (LmAllocType type, LmAllocStats *stats)
+{
+	ThreadCounters *thread;
+	AllocCounters   sum;
+
+	g_return_if_fail (type < LM_ALLOC_N_TYPES);
+	g_return_if_fail (stats != NULL);
+
+	G_LOCK (alloc_stats);
+
+	sum = alloc_retired[type];
+	for (thread = alloc_threads; thread; thread = thread->next) {
+		sum.n_live      += thread->counters[type].n_live;
+		sum.n_allocated += thread->counters[type].n_allocated;
+		sum.bytes_live  += thread->counters[type].bytes_live;
+	}
+
+	G_UNLOCK (alloc_stats);
+
+	stats->n_live      = sum.n_live;
+	stats->n_allocated = sum.n_allocated;
+	stats->bytes_live  = sum.bytes_live;
+}
+
+/* The functions below use @allocator, or GLib if it is %NULL. GLib 
+ * aborts when it runs out of memory, an allocator returns %NULL and the
+ * caller has to give up on what it was doing. */
+gpointer
+_lm_allocator_alloc (const LmAllocator *allocator, gsize size)
+{
+	if (!allocator) {
+		return g_malloc (size);
+	}
+
+	return allocator->alloc (size, allocator->context);
+}
+
+/* Returns %NULL and leaves @mem alone if @allocator failed */
+gpointer
+_lm_allocator_realloc (const LmAllocator *allocator,
+		       gpointer           mem,
+		       gsize              old_size,
+		       gsize              size)
+{
+	gpointer new_mem;
+
+	if (!allocator) {
+		return g_realloc (mem, size);
+	}
+
+	if (!mem) {
+		return _lm_allocator_alloc (allocator, size);
+	}
+
+	if (!allocator->realloc) {
+		new_mem = _lm_allocator_alloc (allocator, size);
+		if (G_UNLIKELY (!new_mem)) {
+			return NULL;
+		}
+
+		memcpy (new_mem, mem, MIN (old_size, size));
+		allocator->free (mem, old_size, allocator->context);
+
+		return new_mem;
+	}
+
+	return allocator->realloc (mem, old_size, size, allocator->context);
+}
+
+void
+_lm_allocator_free (const LmAllocator *allocator, gpointer mem, gsize size)
+{
+	if (!mem) {
+		return;
+	}
+
+	if (!allocator) {
+		g_free (mem);
+	} else {
+		allocator->free (mem, size, allocator->context);
+	}
+}
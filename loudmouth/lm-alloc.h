@@ -0,0 +1,98 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2003 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_ALLOC_H__
+#define __LM_ALLOC_H__
+
+#if !defined (LM_INSIDE_LOUDMOUTH_H) && !defined (LM_COMPILATION)
+#error "Only <loudmouth/loudmouth.h> can be included directly, this file may disappear or change contents."
+#endif
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * LmAllocType:
+ * @LM_ALLOC_MESSAGE: messages
+ * @LM_ALLOC_NODE: message nodes that are not part of a parsed stanza
+ * @LM_ALLOC_ATTRIBUTES: attribute arrays of those nodes
+ * @LM_ALLOC_HANDLER: message handlers and their registrations
+ * @LM_ALLOC_N_TYPES: the number of types
+ *
+ * The kinds of objects Loudmouth keeps allocation statistics for.
+ */
+typedef enum {
+	LM_ALLOC_MESSAGE,
+	LM_ALLOC_NODE,
+	LM_ALLOC_ATTRIBUTES,
+	LM_ALLOC_HANDLER,
+	LM_ALLOC_N_TYPES
+} LmAllocType;
+
+/**
+ * LmAllocStats:
+ * @n_live: number of blocks currently allocated
+ * @n_allocated: number of blocks allocated so far, wraps around
+ * @bytes_live: number of bytes currently allocated
+ *
+ * Allocation statistics of one #LmAllocType, see lm_alloc_get_stats().
+ * Memory taken from an #LmAllocator is accounted by the allocator and
+ * not counted here.
+ */
+typedef struct {
+	guint n_live;
+	guint n_allocated;
+	guint bytes_live;
+} LmAllocStats;
+
+/**
+ * LmAllocator:
+ * @alloc: returns @size bytes of memory, or %NULL if there is no more
+ * @realloc: resizes @mem from @old_size to @size bytes, or returns %NULL
+ * and leaves @mem as it is if there is no more memory. May be %NULL to 
+ * allocate, copy and free instead.
+ * @free: frees @mem, which was allocated with a size of @size bytes
+ * @context: passed to the functions
+ *
+ * Functions for allocating memory, see lm_connection_set_allocator().
+ * Running out of memory only fails the connection using the allocator:
+ * the stanza being received is dropped and the stream is closed with a
+ * stream error, other connections are not affected.
+ */
+typedef struct {
+	gpointer (* alloc)   (gsize     size,
+			      gpointer  context);
+	gpointer (* realloc) (gpointer  mem,
+			      gsize     old_size,
+			      gsize     size,
+			      gpointer  context);
+	void     (* free)    (gpointer  mem,
+			      gsize     size,
+			      gpointer  context);
+	gpointer   context;
+} LmAllocator;
+
+void lm_alloc_get_stats (LmAllocType   type,
+			 LmAllocStats *stats);
+
+G_END_DECLS
+
+#endif /* __LM_ALLOC_H__ */
@@ -0,0 +1,229 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "lm-internals.h"
+
+/* Size of the first block, big enough for most stanzas */
+#define ARENA_FIRST_BLOCK_SIZE 1024
+#define ARENA_MAX_BLOCK_SIZE   16384
+
+#define ARENA_ALIGN(size) (((size) + 7) & ~((gsize) 7))
+
+typedef struct ArenaBlock ArenaBlock;
+
+struct ArenaBlock {
+	ArenaBlock *next;
+	gsize       size;
+	gsize       used;
+	/* Keeps the data that follows 8 byte aligned */
+	gdouble     data[1];
+};
+
+#define ARENA_BLOCK_ALLOC_SIZE(size) (G_STRUCT_OFFSET (ArenaBlock, data) + (size))
+
+struct _LmArena {
+	ArenaBlock        *blocks;
+	gsize              next_block_size;
+	/* Where the blocks come from, %NULL for GLib */
+	const LmAllocator *allocator;
+	gint               ref_count;
+};
+
+static ArenaBlock *
+arena_block_new (LmArena *arena, gsize size)
+{
+	ArenaBlock *block;
+
+	block = _lm_allocator_alloc (arena->allocator, 
+				     ARENA_BLOCK_ALLOC_SIZE (size));
+	if (G_UNLIKELY (!block)) {
+		return NULL;
+	}
+
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+
+	return block;
+}
+
+static void
+arena_block_free (LmArena *arena, ArenaBlock *block)
+{
+	_lm_allocator_free (arena->allocator, block, 
+			    ARENA_BLOCK_ALLOC_SIZE (block->size));
+}
+
+LmArena *
+lm_arena_new (void)
+{
+	return lm_arena_new_with_allocator (NULL);
+}
+
+/* The blocks of the arena are taken from @allocator, which must stay
+ * valid until the arena is freed. Returns %NULL if @allocator fails, as
+ * do the functions allocating from the arena. */
+LmArena *
+lm_arena_new_with_allocator (const LmAllocator *allocator)
+{
+	LmArena *arena;
+
+	arena = g_slice_new (LmArena);
+	arena->allocator       = allocator;
+	arena->blocks          = arena_block_new (arena, ARENA_FIRST_BLOCK_SIZE);
+	if (G_UNLIKELY (!arena->blocks)) {
+		g_slice_free (LmArena, arena);
+		return NULL;
+	}
+
+	arena->next_block_size = ARENA_FIRST_BLOCK_SIZE * 2;
+	arena->ref_count       = 1;
+
+	return arena;
+}
+
+gpointer
+lm_arena_alloc (LmArena *arena, gsize size)
+{
+	ArenaBlock *block = arena->blocks;
+	gpointer    mem;
+
+	size = ARENA_ALIGN (size);
+
+	if (G_UNLIKELY (block->used + size > block->size)) {
+		gsize block_size = arena->next_block_size;
+
+		if (block_size < ARENA_MAX_BLOCK_SIZE) {
+			arena->next_block_size *= 2;
+		}
+
+		if (size > block_size) {
+			/* Big text, give it a block of its own */
+			block = arena_block_new (arena, size);
+			if (G_UNLIKELY (!block)) {
+				return NULL;
+			}
+
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+		} else {
+			block = arena_block_new (arena, block_size);
+			if (G_UNLIKELY (!block)) {
+				return NULL;
+			}
+
+			block->next = arena->blocks;
+			arena->blocks = block;
+		}
+	}
+
+	mem = ((gchar *) block->data) + block->used;
+	block->used += size;
+
+	return mem;
+}
+
+gchar *
+lm_arena_strndup (LmArena *arena, const gchar *str, gsize len)
+{
+	gchar *ret;
+
+	ret = lm_arena_alloc (arena, len + 1);
+	if (G_UNLIKELY (!ret)) {
+		return NULL;
+	}
+
+	memcpy (ret, str, len);
+	ret[len] = '\0';
+
+	return ret;
+}
+
+LmArena *
+lm_arena_ref (LmArena *arena)
+{
+	g_return_val_if_fail (arena != NULL, NULL);
+
+	arena->ref_count++;
+
+	return arena;
+}
+
+/* If @arena isn't referenced by anything but the caller, everything 
+ * allocated from it is released so that it can be used again. The
+ * newest block is kept. Returns whether the arena was recycled. */
+gboolean
+lm_arena_recycle (LmArena *arena)
+{
+	ArenaBlock *block;
+
+	g_return_val_if_fail (arena != NULL, FALSE);
+
+	if (arena->ref_count > 1) {
+		return FALSE;
+	}
+
+	for (block = arena->blocks->next; block;) {
+		ArenaBlock *next = block->next;
+
+		arena_block_free (arena, block);
+		block = next;
+	}
+
+	arena->blocks->next = NULL;
+	arena->blocks->used = 0;
+
+	return TRUE;
+}
+
+void
+lm_arena_unref (LmArena *arena)
+{
+	ArenaBlock *block;
+
+	g_return_if_fail (arena != NULL);
+
+	if (--arena->ref_count > 0) {
+		return;
+	}
+
+	for (block = arena->blocks; block;) {
+		ArenaBlock *next = block->next;
+
+		arena_block_free (arena, block);
+		block = next;
+	}
+
+	g_slice_free (LmArena, arena);
+}
+
+/* Memory that is freed separately but should be counted with the arena
+ * is taken from this too */
+const LmAllocator *
+lm_arena_get_allocator (LmArena *arena)
+{
+	g_return_val_if_fail (arena != NULL, NULL);
+
+	return arena->allocator;
+}
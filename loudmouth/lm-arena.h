@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_ARENA_H__
+#define __LM_ARENA_H__
+
+#include <glib.h>
+
+#include "lm-alloc.h"
+
+/* A bump allocator for memory that is released all at once, used for
+ * the nodes and strings of a parsed stanza. */
+typedef struct _LmArena LmArena;
+
+LmArena *   lm_arena_new      (void);
+LmArena *   lm_arena_new_with_allocator (const LmAllocator *allocator);
+gpointer    lm_arena_alloc    (LmArena     *arena,
+			       gsize        size);
+gchar *     lm_arena_strndup  (LmArena     *arena,
+			       const gchar *str,
+			       gsize        len);
+LmArena *   lm_arena_ref      (LmArena     *arena);
+void        lm_arena_unref    (LmArena     *arena);
+gboolean    lm_arena_recycle  (LmArena     *arena);
+const LmAllocator * lm_arena_get_allocator (LmArena *arena);
+
+#endif /* __LM_ARENA_H__ */
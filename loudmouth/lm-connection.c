@@ -90,7 +90,9 @@
 #include "lm-misc.h"
 #include "lm-ssl-internals.h"
 #include "lm-parser.h"
+#include "lm-reply-table.h"
 #include "lm-sha.h"
+#include "lm-timer-wheel.h"
 #include "lm-connection.h"
 #include "lm-utils.h"
 #include "lm-old-socket.h"
@@ -98,12 +100,33 @@
 
 #define IN_BUFFER_SIZE 1024
 #define SRV_LEN 8192
+/* Initial size of the send buffer and the size above which it isn't 
+ * kept for the next stanza */
+#define SEND_BUF_SIZE 1024
+#define SEND_BUF_MAX_SIZE 65536
+
+/* Resolution of reply timeouts, the wheel only ticks while some are
+ * pending */
+#define REPLY_TIMEOUT_TICK 100
 
 typedef struct {
 	LmHandlerPriority  priority;
 	LmMessageHandler  *handler;
 } HandlerData;
 
+/* A handler waiting for a reply, the value in id_handlers */
+typedef struct {
+	/* First so the wheel's timer gives back the whole */
+	LmTimer            timer;
+	LmConnection      *connection;
+	LmMessageHandler  *handler;
+
+	/* Only set with a timeout, for the error stanza made on expiry */
+	gchar             *id;
+	gchar             *to;
+	LmMessageType      type;
+} ReplyData;
+
 struct _LmConnection {
 	/* Parameters */
 	GMainContext *context;
@@ -120,7 +143,11 @@ struct _LmConnection {
 
 	gchar        *stream_id;
 
-	GHashTable   *id_handlers;
+	LmReplyTable *id_handlers;
+	/* Timeouts of id_handlers, created with the first one */
+	LmTimerWheel *reply_timers;
+	GTimer       *reply_clock;
+	GSource      *reply_timeout_source;
 	GSList       *handlers[LM_MESSAGE_TYPE_UNKNOWN];
 
 	/* XMPP1.0 stuff (SASL, resource binding, StartTLS) */
@@ -143,6 +170,15 @@ struct _LmConnection {
 
 	LmCallback   *disconnect_cb;
 
+	LmCallback   *filter_cb;
+	LmRawStanzaFunction raw_stanza_func;
+
+	/* Outgoing stanzas are serialized into this, kept between sends */
+	GString      *send_buf;
+
+	/* Memory of received stanzas and the output backlog, %NULL for GLib */
+	const LmAllocator *allocator;
+
 	LmMessageQueue *queue;
 
 	LmConnectionState state;
@@ -162,6 +198,8 @@ typedef enum {
 #define XMPP_NS_BIND "urn:ietf:params:xml:ns:xmpp-bind"
 #define XMPP_NS_SESSION "urn:ietf:params:xml:ns:xmpp-session"
 #define XMPP_NS_STARTTLS "urn:ietf:params:xml:ns:xmpp-tls"
+#define XMPP_NS_STREAMS "urn:ietf:params:xml:ns:xmpp-streams"
+#define XMPP_NS_STANZAS "urn:ietf:params:xml:ns:xmpp-stanzas"
 
 static void     connection_free              (LmConnection        *connection);
 static void     connection_handle_message    (LmConnection        *connection,
@@ -212,6 +250,7 @@ connection_signal_disconnect                 (LmConnection        *connection,
                                               LmDisconnectReason   reason);
 static void     connection_incoming_data     (LmOldSocket            *socket, 
                                               const gchar         *buf,
+                                              gsize                len,
                                               LmConnection        *connection);
 static void     connection_socket_closed_cb  (LmOldSocket            *socket,
                                               LmDisconnectReason   reason,
@@ -249,7 +288,8 @@ connection_free_handlers (LmConnection *connection)
 			HandlerData *hd = (HandlerData *) l->data;
 			
 			lm_message_handler_unref (hd->handler);
-			g_free (hd);
+			_lm_alloc_free (LM_ALLOC_HANDLER, sizeof (HandlerData),
+					hd);
 		}
 
 		g_slist_free (connection->handlers[i]);
@@ -275,7 +315,16 @@ connection_free (LmConnection *connection)
 
 	connection_free_handlers (connection);
 	
-	g_hash_table_destroy (connection->id_handlers);
+	/* Cancels the timers still pending */
+	lm_reply_table_free (connection->id_handlers);
+	if (connection->reply_timers) {
+		lm_timer_wheel_free (connection->reply_timers);
+		g_timer_destroy (connection->reply_clock);
+	}
+	if (connection->reply_timeout_source) {
+		g_source_destroy (connection->reply_timeout_source);
+	}
+
 	if (connection->state >= LM_CONNECTION_STATE_OPENING) {
 		connection_do_close (connection);
 	}
@@ -290,6 +339,14 @@ connection_free (LmConnection *connection)
 
 	lm_connection_set_disconnect_function (connection, NULL, NULL, NULL);
 
+	if (connection->filter_cb) {
+		_lm_utils_free_callback (connection->filter_cb);
+	}
+
+	if (connection->send_buf) {
+		g_string_free (connection->send_buf, TRUE);
+	}
+
 	if (connection->proxy) {
 		lm_proxy_unref (connection->proxy);
 	}
@@ -307,10 +364,130 @@ connection_free (LmConnection *connection)
         g_slice_free (LmConnection, connection);
 }
 
+static void
+connection_free_reply_data (ReplyData *rd)
+{
+	if (lm_timer_wheel_is_pending (&rd->timer)) {
+		lm_timer_wheel_cancel (rd->connection->reply_timers, 
+				       &rd->timer);
+	}
+
+	lm_message_handler_unref (rd->handler);
+	g_free (rd->id);
+	g_free (rd->to);
+
+	_lm_alloc_free (LM_ALLOC_HANDLER, sizeof (ReplyData), rd);
+}
+
+/* The error a reply that didn't come in time is answered with, as if
+ * the entity it was sent to had sent it */
+static LmMessage *
+connection_new_reply_timeout (ReplyData *rd)
+{
+	LmMessage     *m;
+	LmMessageNode *error;
+	LmMessageNode *condition;
+
+	m = lm_message_new_with_sub_type (NULL, rd->type, 
+					  LM_MESSAGE_SUB_TYPE_ERROR);
+	lm_message_node_set_attribute (m->node, "id", rd->id);
+	if (rd->to) {
+		lm_message_node_set_attribute (m->node, "from", rd->to);
+	}
+
+	error = lm_message_node_add_child_static (m->node, "error", NULL);
+	lm_message_node_set_attribute_static (error, "type", "wait");
+
+	condition = lm_message_node_add_child_static (error, 
+						      "remote-server-timeout",
+						      NULL);
+	lm_message_node_set_attribute_static (condition, "xmlns", 
+					      XMPP_NS_STANZAS);
+
+	return m;
+}
+
+static void
+connection_reply_timeout_cb (LmTimer *timer, gpointer user_data)
+{
+	LmConnection *connection = user_data;
+	ReplyData    *rd = (ReplyData *) timer;
+	LmMessage    *m;
+
+	lm_verbose ("Reply to %s timed out\n", rd->id);
+
+	lm_reply_table_steal (connection->id_handlers, rd->id);
+
+	m = connection_new_reply_timeout (rd);
+	_lm_message_handler_handle_message (rd->handler, connection, m);
+	lm_message_unref (m);
+
+	connection_free_reply_data (rd);
+}
+
+static guint64
+connection_get_reply_tick (LmConnection *connection)
+{
+	return (guint64) (g_timer_elapsed (connection->reply_clock, NULL) *
+			  1000 / REPLY_TIMEOUT_TICK);
+}
+
+static gboolean
+connection_reply_timeout_tick (LmConnection *connection)
+{
+	gboolean ret = TRUE;
+
+	lm_connection_ref (connection);
+
+	lm_timer_wheel_advance (connection->reply_timers,
+				connection_get_reply_tick (connection),
+				connection_reply_timeout_cb,
+				connection);
+
+	if (lm_timer_wheel_get_n_timers (connection->reply_timers) == 0) {
+		connection->reply_timeout_source = NULL;
+		ret = FALSE;
+	}
+
+	lm_connection_unref (connection);
+
+	return ret;
+}
+
+static void
+connection_add_reply_timeout (LmConnection *connection, 
+			      ReplyData    *rd,
+			      guint         timeout)
+{
+	guint64 ticks;
+
+	if (!connection->reply_timers) {
+		connection->reply_timers = lm_timer_wheel_new ();
+		connection->reply_clock = g_timer_new ();
+	}
+
+	/* Counted from now rather than from the last tick of the wheel, 
+	 * which is behind when it was idle. The extra tick makes up for 
+	 * the part of the current one that has already passed. */
+	ticks = connection_get_reply_tick (connection) - 
+		lm_timer_wheel_get_now (connection->reply_timers) +
+		(timeout + REPLY_TIMEOUT_TICK - 1) / REPLY_TIMEOUT_TICK + 1;
+
+	lm_timer_wheel_add (connection->reply_timers, &rd->timer, ticks);
+
+	if (!connection->reply_timeout_source) {
+		connection->reply_timeout_source =
+			lm_misc_add_timeout (connection->context,
+					     REPLY_TIMEOUT_TICK,
+					     (GSourceFunc) connection_reply_timeout_tick,
+					     connection);
+	}
+}
+
 static LmHandlerResult
 connection_run_message_handler (LmConnection *connection, LmMessage *m)
 {
-        LmMessageHandler *handler;
+        ReplyData        *rd;
         const gchar      *id;
         LmHandlerResult   result = LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 
@@ -319,13 +496,13 @@ connection_run_message_handler (LmConnection *connection, LmMessage *m)
                 return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
         }
 
-        handler = g_hash_table_lookup (connection->id_handlers, id);
-        if (handler) {
-                result = _lm_message_handler_handle_message (handler,
+        /* Taken out first so the handler may send with the same id */
+        rd = lm_reply_table_steal (connection->id_handlers, id);
+        if (rd) {
+                result = _lm_message_handler_handle_message (rd->handler,
                                                              connection,
                                                              m);
-                g_hash_table_remove (connection->id_handlers,
-                                     id);
+                connection_free_reply_data (rd);
         }
 
         return result;
@@ -374,6 +551,65 @@ out:
 	return;
 }
 
+static LmParserFilterResult
+connection_stanza_filter_cb (LmParser      *parser,
+			     const gchar   *name,
+			     const gchar   *xmlns,
+			     const gchar  **attribute_names,
+			     const gchar  **attribute_values,
+			     LmConnection  *connection)
+{
+	LmCallback     *cb = connection->filter_cb;
+	LmFilterResult  result;
+
+	/* The rest of the data read with a stanza that closed the 
+	 * connection is still parsed, it isn't wanted any more */
+	if (connection->state == LM_CONNECTION_STATE_CLOSED) {
+		return LM_PARSER_FILTER_DROP;
+	}
+
+	/* The stream level elements are needed by the connection itself */
+	if (!cb || 
+	    (strcmp (name, "message") != 0 && 
+	     strcmp (name, "presence") != 0 &&
+	     strcmp (name, "iq") != 0)) {
+		return LM_PARSER_FILTER_KEEP;
+	}
+
+	lm_connection_ref (connection);
+	result = (* ((LmFilterFunction) cb->func)) (connection, name, xmlns,
+						     attribute_names,
+						     attribute_values,
+						     cb->user_data);
+	lm_connection_unref (connection);
+	switch (result) {
+	case LM_FILTER_RESULT_DROP:
+		return LM_PARSER_FILTER_DROP;
+	case LM_FILTER_RESULT_RAW:
+		if (connection->raw_stanza_func) {
+			return LM_PARSER_FILTER_RAW;
+		}
+		return LM_PARSER_FILTER_DROP;
+	default:
+		return LM_PARSER_FILTER_KEEP;
+	}
+}
+
+static void
+connection_raw_stanza_cb (LmParser     *parser,
+			  const gchar  *stanza,
+			  gsize         len,
+			  LmConnection *connection)
+{
+	if (connection->raw_stanza_func && connection->filter_cb &&
+	    connection->state != LM_CONNECTION_STATE_CLOSED) {
+		lm_connection_ref (connection);
+		(* connection->raw_stanza_func) (connection, stanza, len,
+						 connection->filter_cb->user_data);
+		lm_connection_unref (connection);
+	}
+}
+
 static void
 connection_new_message_cb (LmParser     *parser,
 			   LmMessage    *m,
@@ -450,7 +686,7 @@ connection_log_send (LmConnection *connection,
 	g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "\nSEND:\n");
 	g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, 
 	       "-----------------------------------\n");
-	g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "%s\n", str);
+	g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "%.*s\n", len, str);
 	g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, 
 	       "-----------------------------------\n");
 }
@@ -496,6 +732,32 @@ connection_send (LmConnection  *connection,
 	return TRUE;
 }
 
+/* The send buffer is taken while in use in case sending is reentered */
+static GString *
+connection_take_send_buf (LmConnection *connection)
+{
+	GString *buf;
+
+	buf = connection->send_buf;
+	connection->send_buf = NULL;
+	if (!buf) {
+		buf = g_string_sized_new (SEND_BUF_SIZE);
+	}
+
+	return buf;
+}
+
+static void
+connection_release_send_buf (LmConnection *connection, GString *buf)
+{
+	if (connection->send_buf || buf->allocated_len > SEND_BUF_MAX_SIZE) {
+		g_string_free (buf, TRUE);
+	} else {
+		g_string_truncate (buf, 0);
+		connection->send_buf = buf;
+	}
+}
+
 static void
 connection_message_queue_cb (LmMessageQueue *queue, LmConnection *connection)
 {
@@ -530,6 +792,9 @@ connection_do_open (LmConnection *connection, GError **error)
 
 	lm_verbose ("Connecting to: %s:%d\n", connection->server, connection->port);
 
+	/* Drop whatever was left over from an earlier connection */
+	lm_parser_reset (connection->parser);
+
 	connection->socket = lm_old_socket_create (connection->context,
                                                    (IncomingDataFunc) connection_incoming_data,
                                                    (SocketClosedFunc) connection_socket_closed_cb,
@@ -608,10 +873,9 @@ connection_create_auth_req_msg (const gchar *username)
 	
 	m = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_IQ,
 					  LM_MESSAGE_SUB_TYPE_GET);
-	q_node = lm_message_node_add_child (m->node, "query", NULL);
-	lm_message_node_set_attributes (q_node,
-					"xmlns", "jabber:iq:auth",
-					NULL);
+	q_node = lm_message_node_add_child_static (m->node, "query", NULL);
+	lm_message_node_set_attribute_static (q_node, 
+					      "xmlns", "jabber:iq:auth");
 	lm_message_node_add_child (q_node, "username", username);
 
 	return m;
@@ -630,11 +894,11 @@ connection_create_auth_msg (LmConnection *connection,
 	auth_msg = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_IQ,
 						 LM_MESSAGE_SUB_TYPE_SET);
 	
-	q_node = lm_message_node_add_child (auth_msg->node, "query", NULL);
+	q_node = lm_message_node_add_child_static (auth_msg->node, 
+						   "query", NULL);
 	
-	lm_message_node_set_attributes (q_node,
-					"xmlns", "jabber:iq:auth", 
-					NULL);
+	lm_message_node_set_attribute_static (q_node, 
+					      "xmlns", "jabber:iq:auth");
 
 	lm_message_node_add_child (q_node, "username", username);
 	
@@ -775,6 +1039,8 @@ _lm_connection_starttls_cb (LmMessageHandler *handler,
 {
 	if (lm_old_socket_starttls (connection->socket)) {
 		connection->tls_started = TRUE;
+		/* The stream restarts on top of TLS */
+		lm_parser_reset (connection->parser);
 		connection_send_stream_header (connection);
 	} else {
 		connection_do_close (connection);
@@ -915,9 +1181,50 @@ connection_signal_disconnect (LmConnection       *connection,
 static void
 connection_incoming_data (LmOldSocket     *socket, 
 			  const gchar  *buf, 
+			  gsize         len,
 			  LmConnection *connection)
 {
-	lm_parser_parse (connection->parser, buf);
+	gboolean parsed;
+
+	/* The stanza filter is called while parsing and may close the 
+	 * connection or drop the last reference to it */
+	lm_connection_ref (connection);
+	parsed = lm_parser_parse_len (connection->parser, buf, len);
+
+	if (parsed || connection->socket != socket ||
+	    connection->state == LM_CONNECTION_STATE_CLOSED) {
+		lm_connection_unref (connection);
+		return;
+	}
+
+	if (lm_parser_hit_limit (connection->parser)) {
+		/* Only this connection gives up, see #LmAllocator */
+		lm_verbose ("Out of memory or stanza too large, closing stream\n");
+
+		connection_send (connection, 
+				 "<stream:error><resource-constraint xmlns='"
+				 XMPP_NS_STREAMS "'/></stream:error></stream:stream>",
+				 -1, NULL);
+
+		connection_do_close (connection);
+		connection_signal_disconnect (connection, 
+					      LM_DISCONNECT_REASON_ERROR);
+		goto out;
+	}
+
+	lm_verbose ("Received XML that isn't well formed, closing stream\n");
+
+	connection_send (connection, 
+			 "<stream:error><xml-not-well-formed xmlns='"
+			 XMPP_NS_STREAMS "'/></stream:error></stream:stream>",
+			 -1, NULL);
+
+	connection_do_close (connection);
+	connection_signal_disconnect (connection, 
+				      LM_DISCONNECT_REASON_INVALID_XML);
+
+out:
+	lm_connection_unref (connection);
 }
 
 static void
@@ -998,12 +1305,11 @@ connection_send_stream_header (LmConnection *connection)
 	}
 
 	m = lm_message_new (server_from_jid, LM_MESSAGE_TYPE_STREAM);
-	lm_message_node_set_attributes (m->node,
-					"xmlns:stream", 
-					"http://etherx.jabber.org/streams",
-					"xmlns", "jabber:client",
-					"version", "1.0",
-					NULL);
+	lm_message_node_set_attribute_static (m->node, "xmlns:stream", 
+					      "http://etherx.jabber.org/streams");
+	lm_message_node_set_attribute_static (m->node, 
+					      "xmlns", "jabber:client");
+	lm_message_node_set_attribute_static (m->node, "version", "1.0");
 	
 	g_free (server_from_jid);
 
@@ -1087,10 +1393,10 @@ connection_bind_reply (LmMessageHandler *handler,
 					  LM_MESSAGE_TYPE_IQ, 
 					  LM_MESSAGE_SUB_TYPE_SET);
 
-	session_node = lm_message_node_add_child (m->node, "session", NULL);
-	lm_message_node_set_attributes (session_node,
-					"xmlns", XMPP_NS_SESSION,
-					NULL);
+	session_node = lm_message_node_add_child_static (m->node, 
+							 "session", NULL);
+	lm_message_node_set_attribute_static (session_node,
+					      "xmlns", XMPP_NS_SESSION);
 
 	result = lm_connection_send (connection, m, NULL);
 	lm_message_unref (m);
@@ -1121,10 +1427,9 @@ connection_features_cb (LmMessageHandler *handler,
 
 			msg = lm_message_new (NULL, LM_MESSAGE_TYPE_STARTTLS);
 
-			lm_message_node_set_attributes (
+			lm_message_node_set_attribute_static (
 				msg->node,
-				"xmlns", XMPP_NS_STARTTLS,
-				NULL);
+				"xmlns", XMPP_NS_STARTTLS);
 
 			lm_connection_send (connection, msg, NULL);
 			lm_message_unref (msg);
@@ -1160,11 +1465,10 @@ connection_features_cb (LmMessageHandler *handler,
 							 LM_MESSAGE_TYPE_IQ, 
 							 LM_MESSAGE_SUB_TYPE_SET);
 
-		bind_node = lm_message_node_add_child (bind_msg->node, 
-						       "bind", NULL);
-		lm_message_node_set_attributes (bind_node,
-						"xmlns", XMPP_NS_BIND,
-						NULL);
+		bind_node = lm_message_node_add_child_static (bind_msg->node, 
+							      "bind", NULL);
+		lm_message_node_set_attribute_static (bind_node,
+						      "xmlns", XMPP_NS_BIND);
 
 		lm_message_node_add_child (bind_node, "resource",
 					   connection->resource);
@@ -1251,6 +1555,8 @@ lm_connection_new (const gchar *server)
 	connection->ssl               = NULL;
 	connection->proxy             = NULL;
 	connection->disconnect_cb     = NULL;
+	connection->filter_cb         = NULL;
+	connection->send_buf          = NULL;
 	connection->queue             = lm_message_queue_new ((LmMessageQueueCallback) connection_message_queue_cb, 
 							      connection);
 	connection->cancel_open       = FALSE;
@@ -1261,10 +1567,7 @@ lm_connection_new (const gchar *server)
 	connection->use_sasl          = FALSE;
 	connection->tls_started       = FALSE;
 	
-	connection->id_handlers = g_hash_table_new_full (g_str_hash, 
-							 g_str_equal,
-							 g_free, 
-							 (GDestroyNotify) lm_message_handler_unref);
+	connection->id_handlers = lm_reply_table_new ((GDestroyNotify) connection_free_reply_data);
 	connection->ref_count         = 1;
 	
 	for (i = 0; i < LM_MESSAGE_TYPE_UNKNOWN; ++i) {
@@ -1458,6 +1761,8 @@ connection_sasl_auth_finished (LmSASL *sasl,
 		return;
 	}
 
+	/* The stream restarts after successful authentication */
+	lm_parser_reset (connection->parser);
 	connection_send_stream_header (connection);
 }
 
@@ -1659,6 +1964,169 @@ lm_connection_set_keep_alive_rate (LmConnection *connection, guint rate)
 	}
 }
 
+/**
+ * lm_connection_get_lazy_parsing:
+ * @connection: an #LmConnection
+ *
+ * Checks if lazy parsing is enabled, see lm_connection_set_lazy_parsing().
+ *
+ * Return value: %TRUE if incoming stanzas are parsed lazily
+ **/
+gboolean
+lm_connection_get_lazy_parsing (LmConnection *connection)
+{
+	g_return_val_if_fail (connection != NULL, FALSE);
+
+	return lm_parser_get_lazy (connection->parser);
+}
+
+/**
+ * lm_connection_set_lazy_parsing:
+ * @connection: an #LmConnection
+ * @lazy: whether to parse incoming stanzas lazily
+ *
+ * With lazy parsing only the top level element of incoming stanzas and
+ * its attributes are built when they are received. The child nodes are 
+ * built the first time they are asked for with 
+ * lm_message_node_get_child(), lm_message_node_find_child() or
+ * lm_message_node_get_children(), which saves most of the work for 
+ * stanzas that are handled by their type and attributes alone.
+ * 
+ * Handlers must not read the children field of the root node directly 
+ * when lazy parsing is enabled.
+ **/
+void
+lm_connection_set_lazy_parsing (LmConnection *connection, gboolean lazy)
+{
+	g_return_if_fail (connection != NULL);
+
+	lm_parser_set_lazy (connection->parser, lazy);
+}
+
+/**
+ * lm_connection_get_allocator:
+ * @connection: an #LmConnection
+ *
+ * Fetches the allocator set with lm_connection_set_allocator().
+ *
+ * Return value: the allocator of @connection, or %NULL if it uses GLib
+ **/
+const LmAllocator *
+lm_connection_get_allocator (LmConnection *connection)
+{
+	g_return_val_if_fail (connection != NULL, NULL);
+
+	return connection->allocator;
+}
+
+/**
+ * lm_connection_set_allocator:
+ * @connection: an #LmConnection
+ * @allocator: the allocator to use, or %NULL to use GLib
+ *
+ * Makes @connection allocate the memory that grows with what it 
+ * receives and sends from @allocator: the nodes and strings of incoming
+ * stanzas, the messages made from them and the output that couldn't be
+ * written to the socket yet. Everything a connection of a tenant holds
+ * can then be accounted to the tenant, or taken from an arena that is
+ * dropped with the session.
+ *
+ * When @allocator runs out of memory, e.g. at the limit of the tenant,
+ * the stanza being received is dropped and @connection is closed with a
+ * resource-constraint stream error and %LM_DISCONNECT_REASON_ERROR. 
+ * Output that can't be buffered shuts the connection down as well.
+ *
+ * @allocator is not copied, it and its context must stay valid until 
+ * all messages received on @connection have been freed. The allocator
+ * can only be changed while @connection is closed.
+ **/
+void
+lm_connection_set_allocator (LmConnection      *connection,
+			     const LmAllocator *allocator)
+{
+	g_return_if_fail (connection != NULL);
+	g_return_if_fail (allocator == NULL || 
+			  (allocator->alloc != NULL && allocator->free != NULL));
+	g_return_if_fail (connection->state == LM_CONNECTION_STATE_CLOSED);
+
+	connection->allocator = allocator;
+	lm_parser_set_allocator (connection->parser, allocator);
+}
+
+/**
+ * lm_connection_get_keep_raw_stanzas:
+ * @connection: an #LmConnection
+ *
+ * Checks if the bytes of incoming stanzas are kept, see 
+ * lm_connection_set_keep_raw_stanzas().
+ *
+ * Return value: %TRUE if incoming stanzas are kept as received
+ **/
+gboolean
+lm_connection_get_keep_raw_stanzas (LmConnection *connection)
+{
+	g_return_val_if_fail (connection != NULL, FALSE);
+
+	return lm_parser_get_keep_raw (connection->parser);
+}
+
+/**
+ * lm_connection_set_keep_raw_stanzas:
+ * @connection: an #LmConnection
+ * @keep_raw: whether to keep incoming stanzas as received
+ *
+ * Keeps the bytes of each incoming stanza along with the message built
+ * from it, they are fetched with lm_message_get_raw_stanza(). Relays and
+ * bridges can pass them on with lm_connection_send_raw_stanza() without
+ * serializing the message again. Together with 
+ * lm_connection_set_lazy_parsing() only the top level element of the 
+ * stanza is built.
+ **/
+void
+lm_connection_set_keep_raw_stanzas (LmConnection *connection, 
+				    gboolean      keep_raw)
+{
+	g_return_if_fail (connection != NULL);
+
+	lm_parser_set_keep_raw (connection->parser, keep_raw);
+}
+
+/**
+ * lm_connection_get_max_stanza_size:
+ * @connection: an #LmConnection
+ *
+ * Gets the size limit of incoming stanzas, see 
+ * lm_connection_set_max_stanza_size().
+ *
+ * Return value: the largest stanza accepted in bytes, 0 for no limit
+ **/
+gsize
+lm_connection_get_max_stanza_size (LmConnection *connection)
+{
+	g_return_val_if_fail (connection != NULL, 0);
+
+	return lm_parser_get_max_stanza_size (connection->parser);
+}
+
+/**
+ * lm_connection_set_max_stanza_size:
+ * @connection: an #LmConnection
+ * @size: the largest stanza to accept in bytes, 0 for no limit
+ *
+ * Bounds the memory a peer can make @connection hold for a single 
+ * stanza. A stanza larger than @size, or a tag or comment that grows
+ * past it without ending, closes @connection with a resource-constraint
+ * stream error like an allocator running out of memory does, see 
+ * lm_connection_set_allocator(). There is no limit by default.
+ **/
+void
+lm_connection_set_max_stanza_size (LmConnection *connection, gsize size)
+{
+	g_return_if_fail (connection != NULL);
+
+	lm_parser_set_max_stanza_size (connection->parser, size);
+}
+
 /**
  * lm_connection_is_open:
  * @connection: #LmConnection to check if it is open.
@@ -1920,20 +2388,123 @@ lm_connection_send (LmConnection  *connection,
 		    LmMessage     *message, 
 		    GError       **error)
 {
-	gchar    *xml_str;
-	gchar    *ch;
+	GString  *buf;
 	gboolean  result;
 	
 	g_return_val_if_fail (connection != NULL, FALSE);
 	g_return_val_if_fail (message != NULL, FALSE);
 
-	xml_str = lm_message_node_to_string (message->node);
-	if ((ch = strstr (xml_str, "</stream:stream>"))) {
-		*ch = '\0';
-	}
+	buf = connection_take_send_buf (connection);
+
+	/* The stream element stays open until the connection is closed */
+	_lm_message_node_write (message->node, buf,
+				lm_message_get_type (message) == LM_MESSAGE_TYPE_STREAM);
 	
-	result = connection_send (connection, xml_str, -1, error);
-	g_free (xml_str);
+	result = connection_send (connection, buf->str, buf->len, error);
+
+	connection_release_send_buf (connection, buf);
+
+	return result;
+}
+
+/**
+ * lm_connection_send_template:
+ * @connection: #LmConnection to send the stanza over.
+ * @tmpl: #LmStanzaTemplate to send.
+ * @values: the values of the slots of @tmpl.
+ * @error: location to store error, or %NULL
+ * 
+ * Asynchronous call to send the stanza of @tmpl with @values in its 
+ * slots, see lm_stanza_template_add_slot(). No message is built for it.
+ * 
+ * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
+ **/
+gboolean
+lm_connection_send_template (LmConnection      *connection,
+			     LmStanzaTemplate  *tmpl,
+			     const gchar      **values,
+			     GError           **error)
+{
+	GString  *buf;
+	gboolean  result;
+
+	g_return_val_if_fail (connection != NULL, FALSE);
+	g_return_val_if_fail (tmpl != NULL, FALSE);
+
+	buf = connection_take_send_buf (connection);
+
+	_lm_stanza_template_write (tmpl, buf, values);
+
+	result = connection_send (connection, buf->str, buf->len, error);
+
+	connection_release_send_buf (connection, buf);
+
+	return result;
+}
+
+/**
+ * lm_connection_send_raw_stanza:
+ * @connection: #LmConnection to send the stanza over.
+ * @stanza: a complete stanza, usually from lm_message_get_raw_stanza().
+ * @len: length of @stanza, or -1 if it is nul-terminated.
+ * @names: %NULL-terminated names of attributes of the top level element
+ * to rewrite, or %NULL.
+ * @values: the new values of the attributes in @names, a %NULL value 
+ * removes the attribute.
+ * @error: location to store error, or %NULL
+ * 
+ * Asynchronous call to send a stanza as it is, apart from the attributes
+ * in @names, which are set to @values or added if the stanza doesn't 
+ * have them. Only the start tag of the top level element is looked at,
+ * the rest of @stanza is sent unchanged, so it must be well-formed.
+ *
+ * <informalexample><programlisting>
+ * const gchar *names[] = { "to", "from", NULL };
+ * const gchar *values[] = { "user@example.com", NULL };
+ *
+ * raw = lm_message_get_raw_stanza (m, &amp;len);
+ * lm_connection_send_raw_stanza (connection, raw, len, names, values, NULL);
+ * </programlisting></informalexample>
+ * 
+ * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
+ **/
+gboolean
+lm_connection_send_raw_stanza (LmConnection  *connection,
+			       const gchar   *stanza,
+			       gssize         len,
+			       const gchar  **names,
+			       const gchar  **values,
+			       GError       **error)
+{
+	GString  *buf;
+	gboolean  result;
+
+	g_return_val_if_fail (connection != NULL, FALSE);
+	g_return_val_if_fail (stanza != NULL, FALSE);
+	g_return_val_if_fail (names == NULL || values != NULL, FALSE);
+
+	if (len < 0) {
+		len = strlen (stanza);
+	}
+
+	if (!names || !names[0]) {
+		return connection_send (connection, stanza, len, error);
+	}
+
+	buf = connection_take_send_buf (connection);
+
+	if (_lm_message_node_rewrite_raw (buf, stanza, len, names, values)) {
+		result = connection_send (connection, buf->str, buf->len, 
+					  error);
+	} else {
+		g_set_error (error,
+			     LM_ERROR,
+			     LM_ERROR_INVALID_STANZA,
+			     "Malformed start tag in stanza");
+		result = FALSE;
+	}
+
+	connection_release_send_buf (connection, buf);
 
 	return result;
 }
@@ -1955,22 +2526,63 @@ lm_connection_send_with_reply (LmConnection      *connection,
 			       LmMessageHandler  *handler,
 			       GError           **error)
 {
-	gchar *id;
+	return lm_connection_send_with_reply_full (connection, message,
+						   handler, 0, error);
+}
+
+/**
+ * lm_connection_send_with_reply_full:
+ * @connection: #LmConnection used to send message.
+ * @message: #LmMessage to send.
+ * @handler: #LmMessageHandler that will be used when a reply to @message arrives
+ * @timeout: milliseconds to wait for the reply, or 0 to wait forever
+ * @error: location to store error, or %NULL
+ * 
+ * Like lm_connection_send_with_reply() but gives up on the reply after
+ * @timeout milliseconds. @handler is then called with an error stanza 
+ * from the recipient of @message, with a type="wait" error holding a
+ * &lt;remote-server-timeout/&gt; condition, and a reply arriving later
+ * is handled like any other message. Timeouts are rounded up to a tenth
+ * of a second.
+ * 
+ * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
+ **/
+gboolean 
+lm_connection_send_with_reply_full (LmConnection      *connection,
+				    LmMessage         *message,
+				    LmMessageHandler  *handler,
+				    guint              timeout,
+				    GError           **error)
+{
+	ReplyData   *rd;
+	const gchar *id;
+	gchar        buf[LM_ID_SIZE];
 	
 	g_return_val_if_fail (connection != NULL, FALSE);
 	g_return_val_if_fail (message != NULL, FALSE);
 	g_return_val_if_fail (handler != NULL, FALSE);
 
-	if (lm_message_node_get_attribute (message->node, "id")) {
-		id = g_strdup (lm_message_node_get_attribute (message->node, 
-							      "id"));
-	} else {
-		id = _lm_utils_generate_id ();
-		lm_message_node_set_attributes (message->node, "id", id, NULL);
+	id = lm_message_node_get_attribute (message->node, "id");
+	if (!id) {
+		id = _lm_utils_generate_id (buf);
+		lm_message_node_set_attribute (message->node, "id", id);
+	}
+
+	rd = _lm_alloc_new0 (LM_ALLOC_HANDLER, sizeof (ReplyData));
+	rd->connection = connection;
+	rd->handler = lm_message_handler_ref (handler);
+
+	/* Replaces the one waiting for the same id, if any */
+	lm_reply_table_insert (connection->id_handlers, id, rd);
+
+	if (timeout > 0) {
+		rd->id = g_strdup (id);
+		rd->to = g_strdup (lm_message_node_get_attribute (message->node,
+								  "to"));
+		rd->type = lm_message_get_type (message);
+
+		connection_add_reply_timeout (connection, rd, timeout);
 	}
-	
-	g_hash_table_insert (connection->id_handlers, 
-			     id, lm_message_handler_ref (handler));
 	
 	return lm_connection_send (connection, message, error);
 }
@@ -1991,6 +2603,7 @@ lm_connection_send_with_reply_and_block (LmConnection  *connection,
 					 GError       **error)
 {
 	gchar     *id;
+	gchar      buf[LM_ID_SIZE];
 	LmMessage *reply = NULL;
 
 	g_return_val_if_fail (connection != NULL, NULL);
@@ -2009,7 +2622,7 @@ lm_connection_send_with_reply_and_block (LmConnection  *connection,
 		id = g_strdup (lm_message_node_get_attribute (message->node, 
 							      "id"));
 	} else {
-		id = _lm_utils_generate_id ();
+		id = g_strdup (_lm_utils_generate_id (buf));
 		lm_message_node_set_attributes (message->node, "id", id, NULL);
 	}
 
@@ -2070,7 +2683,7 @@ lm_connection_register_message_handler  (LmConnection       *connection,
 	g_return_if_fail (handler != NULL);
 	g_return_if_fail (type != LM_MESSAGE_TYPE_UNKNOWN);
 
-	hd = g_new0 (HandlerData, 1);
+	hd = _lm_alloc_new0 (LM_ALLOC_HANDLER, sizeof (HandlerData));
 	hd->priority = priority;
 	hd->handler  = lm_message_handler_ref (handler);
 
@@ -2106,7 +2719,8 @@ lm_connection_unregister_message_handler (LmConnection      *connection,
 			connection->handlers[type] = g_slist_remove_link (connection->handlers[type], l);
 			g_slist_free (l);
 			lm_message_handler_unref (hd->handler);
-			g_free (hd);
+			_lm_alloc_free (LM_ALLOC_HANDLER, sizeof (HandlerData),
+					hd);
 			break;
 		}
 	}
@@ -2142,6 +2756,62 @@ lm_connection_set_disconnect_function (LmConnection         *connection,
 	}
 }
 
+/**
+ * lm_connection_set_stanza_filter:
+ * @connection: an #LmConnection
+ * @function: function deciding what to do with incoming stanzas, or %NULL
+ * @raw_function: function receiving the stanzas kept as raw bytes, or %NULL
+ * @user_data: user data passed to @function and @raw_function
+ * @notify: function that will be called with @user_data when @user_data needs to be freed. Pass %NULL if it shouldn't be freed.
+ * 
+ * Sets a filter that is called as soon as the start tag of an incoming 
+ * message, presence or iq stanza has been received, before anything is 
+ * built for it. Stanzas that @function drops are never handed to any 
+ * message handler and cost almost nothing to receive. Stanzas it wants 
+ * raw are passed to @raw_function exactly as they were received, as 
+ * soon as they are complete, possibly before earlier stanzas have been
+ * handled. The stanzas passed to @raw_function are only valid during 
+ * the call.
+ * 
+ * Both functions are called from within the parsing of the received
+ * data. They may close the connection, after which they aren't called 
+ * for the rest of that data, but must not call 
+ * lm_connection_set_stanza_filter(), as that frees @user_data while they
+ * are using it. Change the filter from an idle callback instead.
+ * 
+ * Pass %NULL as @function to remove the filter.
+ **/
+void
+lm_connection_set_stanza_filter (LmConnection        *connection,
+				 LmFilterFunction     function,
+				 LmRawStanzaFunction  raw_function,
+				 gpointer             user_data,
+				 GDestroyNotify       notify)
+{
+	g_return_if_fail (connection != NULL);
+
+	if (connection->filter_cb) {
+		_lm_utils_free_callback (connection->filter_cb);
+		connection->filter_cb = NULL;
+	}
+
+	connection->raw_stanza_func = NULL;
+
+	if (function) {
+		connection->filter_cb = _lm_utils_new_callback (function,
+								user_data,
+								notify);
+		connection->raw_stanza_func = raw_function;
+
+		lm_parser_set_filter (connection->parser,
+				      (LmParserFilterFunction) connection_stanza_filter_cb,
+				      (LmParserRawFunction) connection_raw_stanza_cb,
+				      connection);
+	} else {
+		lm_parser_set_filter (connection->parser, NULL, NULL, NULL);
+	}
+}
+
 /**
  * lm_connection_send_raw:
  * @connection: Connection used to send
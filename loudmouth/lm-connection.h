@@ -25,9 +25,11 @@
 #error "Only <loudmouth/loudmouth.h> can be included directly, this file may disappear or change contents."
 #endif
 
+#include <loudmouth/lm-alloc.h>
 #include <loudmouth/lm-message.h>
 #include <loudmouth/lm-proxy.h>
 #include <loudmouth/lm-ssl.h>
+#include <loudmouth/lm-stanza-template.h>
 
 G_BEGIN_DECLS
 
@@ -144,6 +146,57 @@ typedef void          (* LmDisconnectFunction) (LmConnection       *connection,
 						LmDisconnectReason  reason,
 						gpointer            user_data);
 
+/**
+ * LmFilterResult:
+ * @LM_FILTER_RESULT_KEEP: Build the stanza and pass it to the message handlers.
+ * @LM_FILTER_RESULT_DROP: Ignore the stanza.
+ * @LM_FILTER_RESULT_RAW: Pass the stanza as received to the #LmRawStanzaFunction.
+ * 
+ * The return values for an #LmFilterFunction.
+ */
+typedef enum {
+	LM_FILTER_RESULT_KEEP,
+	LM_FILTER_RESULT_DROP,
+	LM_FILTER_RESULT_RAW
+} LmFilterResult;
+
+/**
+ * LmFilterFunction:
+ * @connection: an #LmConnection
+ * @name: the name of the stanza element, "message", "presence" or "iq"
+ * @xmlns: the namespace of the stanza element, or %NULL if not set
+ * @attribute_names: %NULL terminated array of attribute names
+ * @attribute_values: %NULL terminated array of the attribute values
+ * @user_data: User data passed when function being called.
+ * 
+ * Callback deciding what to do with a stanza from its start tag, see
+ * lm_connection_set_stanza_filter(). The strings are only valid during
+ * the call.
+ * 
+ * Returns: what to do with the stanza
+ */
+typedef LmFilterResult (* LmFilterFunction)    (LmConnection       *connection,
+						const gchar        *name,
+						const gchar        *xmlns,
+						const gchar       **attribute_names,
+						const gchar       **attribute_values,
+						gpointer            user_data);
+
+/**
+ * LmRawStanzaFunction:
+ * @connection: an #LmConnection
+ * @stanza: the stanza as received, not nul terminated
+ * @len: length of @stanza in bytes
+ * @user_data: User data passed when function being called.
+ * 
+ * Callback receiving the stanzas an #LmFilterFunction wanted raw. 
+ * @stanza is only valid during the call.
+ */
+typedef void          (* LmRawStanzaFunction)  (LmConnection       *connection,
+						const gchar        *stanza,
+						gsize               len,
+						gpointer            user_data);
+
 LmConnection *lm_connection_new               (const gchar        *server);
 LmConnection *lm_connection_new_with_context  (const gchar        *server,
 					       GMainContext       *context);
@@ -176,6 +229,18 @@ lm_connection_authenticate_and_block          (LmConnection       *connection,
 guint         lm_connection_get_keep_alive_rate (LmConnection     *connection);
 void        lm_connection_set_keep_alive_rate (LmConnection       *connection,
 					       guint               rate);
+gboolean      lm_connection_get_lazy_parsing  (LmConnection       *connection);
+void          lm_connection_set_lazy_parsing  (LmConnection       *connection,
+					       gboolean            lazy);
+const LmAllocator * lm_connection_get_allocator (LmConnection     *connection);
+void          lm_connection_set_allocator     (LmConnection       *connection,
+					       const LmAllocator  *allocator);
+gboolean      lm_connection_get_keep_raw_stanzas (LmConnection    *connection);
+void          lm_connection_set_keep_raw_stanzas (LmConnection    *connection,
+					       gboolean            keep_raw);
+gsize         lm_connection_get_max_stanza_size (LmConnection     *connection);
+void          lm_connection_set_max_stanza_size (LmConnection     *connection,
+					       gsize               size);
 
 gboolean      lm_connection_is_open           (LmConnection       *connection);
 gboolean      lm_connection_is_authenticated  (LmConnection       *connection);
@@ -205,6 +270,11 @@ gboolean      lm_connection_send_with_reply   (LmConnection       *connection,
 					       LmMessage          *message,
 					       LmMessageHandler   *handler,
 					       GError            **error);
+gboolean      lm_connection_send_with_reply_full (LmConnection    *connection,
+					       LmMessage          *message,
+					       LmMessageHandler   *handler,
+					       guint               timeout,
+					       GError            **error);
 LmMessage *   
 lm_connection_send_with_reply_and_block       (LmConnection       *connection,
 					       LmMessage          *message,
@@ -223,10 +293,26 @@ lm_connection_set_disconnect_function         (LmConnection       *connection,
 					       LmDisconnectFunction function,
 					       gpointer             user_data,
 					       GDestroyNotify       notify);
+void
+lm_connection_set_stanza_filter               (LmConnection       *connection,
+					       LmFilterFunction    function,
+					       LmRawStanzaFunction raw_function,
+					       gpointer            user_data,
+					       GDestroyNotify      notify);
 					       
 gboolean      lm_connection_send_raw          (LmConnection       *connection,
 					       const gchar        *str,
 					       GError            **error);
+gboolean      lm_connection_send_raw_stanza   (LmConnection       *connection,
+					       const gchar        *stanza,
+					       gssize              len,
+					       const gchar       **names,
+					       const gchar       **values,
+					       GError            **error);
+gboolean      lm_connection_send_template     (LmConnection       *connection,
+					       LmStanzaTemplate   *tmpl,
+					       const gchar       **values,
+					       GError            **error);
 LmConnectionState lm_connection_get_state     (LmConnection       *connection);
 gchar *       lm_connection_get_local_host    (LmConnection       *connection);
 LmConnection* lm_connection_ref               (LmConnection       *connection);
@@ -42,13 +42,17 @@ G_BEGIN_DECLS
  * @LM_ERROR_CONNECTION_OPEN: Connection is already open when trying to open it again.
  * @LM_ERROR_AUTH_FAILED: Authentication failed while opening connection
  * @LM_ERROR_CONNECTION_FAILED:  * 
+ * @LM_ERROR_INVALID_PATH: The expression passed to lm_node_path_new() couldn't be parsed
+ * @LM_ERROR_INVALID_STANZA: The stanza passed to lm_connection_send_raw_stanza() has a malformed start tag
  * Describes the problem of the error.
  */
 typedef enum {
         LM_ERROR_CONNECTION_NOT_OPEN,
         LM_ERROR_CONNECTION_OPEN,
         LM_ERROR_AUTH_FAILED,
-	LM_ERROR_CONNECTION_FAILED
+	LM_ERROR_CONNECTION_FAILED,
+	LM_ERROR_INVALID_PATH,
+	LM_ERROR_INVALID_STANZA
 } LmError;
 
 GQuark lm_error_quark (void) G_GNUC_CONST;
@@ -0,0 +1,305 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "lm-intern.h"
+
+/* The table is never resized or shrunk so that lookups can be done 
+ * without taking the lock. Entries are never freed either, so only 
+ * strings known in advance and names the application asks for are 
+ * added. Received names are only looked up, a peer can't fill the table
+ * for every other connection. Once it is half full nothing more is 
+ * interned and callers keep their own copies. */
+#define INTERN_TABLE_SIZE   4096
+#define INTERN_MAX_ENTRIES  (INTERN_TABLE_SIZE / 2)
+#define INTERN_MAX_LENGTH   64
+
+typedef struct {
+	guint id;
+	guint hash;
+	gsize len;
+	gchar str[1];
+} InternString;
+
+/* Indexed by LmInternId */
+static const gchar *well_known[LM_INTERN_LAST_STATIC] = {
+	NULL,
+
+	"message",
+	"presence",
+	"iq",
+	"stream:stream",
+	"stream:error",
+	"stream:features",
+	"auth",
+	"challenge",
+	"response",
+	"success",
+	"failure",
+	"proceed",
+	"starttls",
+
+	"normal",
+	"chat",
+	"groupchat",
+	"headline",
+	"unavailable",
+	"probe",
+	"subscribe",
+	"unsubscribe",
+	"subscribed",
+	"unsubscribed",
+	"get",
+	"set",
+	"result",
+	"error",
+
+	"id",
+	"to",
+	"from",
+	"type",
+	"xmlns",
+	"xml:lang",
+	"jid",
+	"name",
+	"node",
+	"role",
+	"affiliation",
+	"nick",
+	"ask",
+	"code",
+	"mechanism",
+
+	"body",
+	"subject",
+	"thread",
+	"show",
+	"status",
+	"priority",
+	"query",
+	"item",
+	"group",
+	"x",
+	"pubsub",
+	"items",
+	"event",
+	"delay",
+	"c",
+	"bind",
+	"session",
+	"mechanisms",
+	"away",
+	"xa",
+	"dnd",
+	"both",
+	"none",
+
+	"jabber:client",
+	"urn:ietf:params:xml:ns:xmpp-streams",
+	"jabber:iq:roster",
+	"jabber:iq:auth",
+	"jabber:iq:version",
+	"http://jabber.org/protocol/disco#info",
+	"http://jabber.org/protocol/disco#items",
+	"http://jabber.org/protocol/muc",
+	"http://jabber.org/protocol/muc#user",
+	"http://jabber.org/protocol/pubsub",
+	"http://jabber.org/protocol/pubsub#event",
+	"urn:xmpp:delay",
+	"http://jabber.org/protocol/caps",
+	"http://jabber.org/protocol/chatstates",
+	"urn:ietf:params:xml:ns:xmpp-sasl",
+	"urn:ietf:params:xml:ns:xmpp-tls",
+	"urn:ietf:params:xml:ns:xmpp-bind",
+	"urn:ietf:params:xml:ns:xmpp-session"
+};
+
+static InternString *intern_table[INTERN_TABLE_SIZE];
+static guint         intern_n_entries;
+static guint         intern_next_id = LM_INTERN_LAST_STATIC;
+
+G_LOCK_DEFINE_STATIC (intern);
+
+static guint
+intern_hash (const gchar *str, gsize len)
+{
+	const guchar *p = (const guchar *) str;
+	guint         hash = 5381;
+
+	while (len--) {
+		hash = (hash << 5) + hash + *p++;
+	}
+
+	return hash;
+}
+
+/* Returns the entry for @str or %NULL, in which case @slot is set to
+ * where it would be inserted */
+static InternString *
+intern_find (const gchar *str, gsize len, guint hash, guint *slot)
+{
+	guint i = hash & (INTERN_TABLE_SIZE - 1);
+
+	while (TRUE) {
+		InternString *entry;
+
+		entry = g_atomic_pointer_get ((gpointer *) &intern_table[i]);
+		if (!entry) {
+			if (slot) {
+				*slot = i;
+			}
+			return NULL;
+		}
+
+		if (entry->hash == hash && entry->len == len &&
+		    memcmp (entry->str, str, len) == 0) {
+			return entry;
+		}
+
+		i = (i + 1) & (INTERN_TABLE_SIZE - 1);
+	}
+}
+
+/* Must be called with the lock held */
+static InternString *
+intern_insert (const gchar *str, gsize len, guint id)
+{
+	InternString *entry;
+	guint         hash;
+	guint         slot;
+
+	hash = intern_hash (str, len);
+	entry = intern_find (str, len, hash, &slot);
+	if (entry) {
+		return entry;
+	}
+
+	if (intern_n_entries >= INTERN_MAX_ENTRIES) {
+		return NULL;
+	}
+
+	entry = g_malloc (G_STRUCT_OFFSET (InternString, str) + len + 1);
+	entry->id = id;
+	entry->hash = hash;
+	entry->len = len;
+	memcpy (entry->str, str, len);
+	entry->str[len] = '\0';
+
+	intern_n_entries++;
+
+	/* Only publish the entry when it is fully set up, readers don't 
+	 * take the lock */
+	g_atomic_pointer_set ((gpointer *) &intern_table[slot], entry);
+
+	return entry;
+}
+
+static void
+intern_init (void)
+{
+	static gsize initialized = 0;
+
+	if (g_once_init_enter (&initialized)) {
+		guint id;
+
+		G_LOCK (intern);
+		for (id = LM_INTERN_NONE + 1; id < LM_INTERN_LAST_STATIC; id++) {
+			intern_insert (well_known[id], strlen (well_known[id]), id);
+		}
+		G_UNLOCK (intern);
+
+		g_once_init_leave (&initialized, 1);
+	}
+}
+
+/* Returns the interned copy of @str, adding it to the table if needed, 
+ * or %NULL if @str is too long or the table is full */
+const gchar *
+lm_intern_string (const gchar *str, gssize len)
+{
+	InternString *entry;
+
+	g_return_val_if_fail (str != NULL, NULL);
+
+	intern_init ();
+
+	if (len < 0) {
+		len = strlen (str);
+	}
+
+	if (len > INTERN_MAX_LENGTH) {
+		return NULL;
+	}
+
+	entry = intern_find (str, len, intern_hash (str, len), NULL);
+	if (entry) {
+		return entry->str;
+	}
+
+	G_LOCK (intern);
+	entry = intern_insert (str, len, intern_next_id);
+	if (entry && entry->id == intern_next_id) {
+		intern_next_id++;
+	}
+	G_UNLOCK (intern);
+
+	return entry ? entry->str : NULL;
+}
+
+/* Like lm_intern_string() but never adds anything to the table */
+const gchar *
+lm_intern_lookup (const gchar *str, gssize len)
+{
+	InternString *entry;
+
+	g_return_val_if_fail (str != NULL, NULL);
+
+	intern_init ();
+
+	if (len < 0) {
+		len = strlen (str);
+	}
+
+	if (len > INTERN_MAX_LENGTH) {
+		return NULL;
+	}
+
+	entry = intern_find (str, len, intern_hash (str, len), NULL);
+
+	return entry ? entry->str : NULL;
+}
+
+/* @interned must come from lm_intern_string() or lm_intern_lookup(), 
+ * strings known in advance have one of the #LmInternId ids */
+guint
+lm_intern_get_id (const gchar *interned)
+{
+	const InternString *entry;
+
+	g_return_val_if_fail (interned != NULL, LM_INTERN_NONE);
+
+	entry = (const InternString *) 
+		(interned - G_STRUCT_OFFSET (InternString, str));
+
+	return entry->id;
+}
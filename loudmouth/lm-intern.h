@@ -0,0 +1,136 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_INTERN_H__
+#define __LM_INTERN_H__
+
+#include <glib.h>
+
+/* Process wide table of element names, attribute keys and common values.
+ * Interned strings are never freed and there is only one copy of each, 
+ * so they can be compared by pointer. */
+
+typedef enum {
+	LM_INTERN_NONE = 0,
+
+	/* Stanza names, in the same order as LmMessageType */
+	LM_INTERN_MESSAGE,
+	LM_INTERN_PRESENCE,
+	LM_INTERN_IQ,
+	LM_INTERN_STREAM,
+	LM_INTERN_STREAM_ERROR,
+	LM_INTERN_STREAM_FEATURES,
+	LM_INTERN_AUTH,
+	LM_INTERN_CHALLENGE,
+	LM_INTERN_RESPONSE,
+	LM_INTERN_SUCCESS,
+	LM_INTERN_FAILURE,
+	LM_INTERN_PROCEED,
+	LM_INTERN_STARTTLS,
+
+	/* Sub types, in the same order as LmMessageSubType */
+	LM_INTERN_NORMAL,
+	LM_INTERN_CHAT,
+	LM_INTERN_GROUPCHAT,
+	LM_INTERN_HEADLINE,
+	LM_INTERN_UNAVAILABLE,
+	LM_INTERN_PROBE,
+	LM_INTERN_SUBSCRIBE,
+	LM_INTERN_UNSUBSCRIBE,
+	LM_INTERN_SUBSCRIBED,
+	LM_INTERN_UNSUBSCRIBED,
+	LM_INTERN_GET,
+	LM_INTERN_SET,
+	LM_INTERN_RESULT,
+	LM_INTERN_ERROR,
+
+	/* Attribute keys */
+	LM_INTERN_ID,
+	LM_INTERN_TO,
+	LM_INTERN_FROM,
+	LM_INTERN_TYPE,
+	LM_INTERN_XMLNS,
+	LM_INTERN_XML_LANG,
+	LM_INTERN_JID,
+	LM_INTERN_NAME,
+	LM_INTERN_NODE,
+	LM_INTERN_ROLE,
+	LM_INTERN_AFFILIATION,
+	LM_INTERN_NICK,
+	LM_INTERN_ASK,
+	LM_INTERN_CODE,
+	LM_INTERN_MECHANISM,
+
+	/* Common child elements and values */
+	LM_INTERN_BODY,
+	LM_INTERN_SUBJECT,
+	LM_INTERN_THREAD,
+	LM_INTERN_SHOW,
+	LM_INTERN_STATUS,
+	LM_INTERN_PRIORITY,
+	LM_INTERN_QUERY,
+	LM_INTERN_ITEM,
+	LM_INTERN_GROUP,
+	LM_INTERN_X,
+	LM_INTERN_PUBSUB,
+	LM_INTERN_ITEMS,
+	LM_INTERN_EVENT,
+	LM_INTERN_DELAY,
+	LM_INTERN_C,
+	LM_INTERN_BIND,
+	LM_INTERN_SESSION,
+	LM_INTERN_MECHANISMS,
+	LM_INTERN_AWAY,
+	LM_INTERN_XA,
+	LM_INTERN_DND,
+	LM_INTERN_BOTH,
+	LM_INTERN_NONE_VALUE,
+
+	/* Namespaces */
+	LM_INTERN_NS_CLIENT,
+	LM_INTERN_NS_STREAMS,
+	LM_INTERN_NS_ROSTER,
+	LM_INTERN_NS_AUTH,
+	LM_INTERN_NS_VERSION,
+	LM_INTERN_NS_DISCO_INFO,
+	LM_INTERN_NS_DISCO_ITEMS,
+	LM_INTERN_NS_MUC,
+	LM_INTERN_NS_MUC_USER,
+	LM_INTERN_NS_PUBSUB,
+	LM_INTERN_NS_PUBSUB_EVENT,
+	LM_INTERN_NS_DELAY,
+	LM_INTERN_NS_CAPS,
+	LM_INTERN_NS_CHATSTATES,
+	LM_INTERN_NS_SASL,
+	LM_INTERN_NS_TLS,
+	LM_INTERN_NS_BIND,
+	LM_INTERN_NS_SESSION,
+
+	/* Strings interned at runtime get ids from here on */
+	LM_INTERN_LAST_STATIC
+} LmInternId;
+
+const gchar * lm_intern_string   (const gchar *str,
+				  gssize       len);
+const gchar * lm_intern_lookup   (const gchar *str,
+				  gssize       len);
+guint         lm_intern_get_id   (const gchar *interned);
+
+#endif /* __LM_INTERN_H__ */
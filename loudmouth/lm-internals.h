@@ -27,12 +27,17 @@
 
 #include <sys/types.h>
 
+#include "lm-alloc.h"
+#include "lm-arena.h"
 #include "lm-connection.h"
+#include "lm-intern.h"
 #include "lm-message.h"
 #include "lm-message-handler.h"
 #include "lm-message-node.h"
+#include "lm-stanza-template.h"
 #include "lm-sock.h"
 #include "lm-old-socket.h"
+#include "lm-parser.h"
 
 #define LM_MIN_PORT 1
 #define LM_MAX_PORT 65536
@@ -43,6 +48,12 @@ typedef int LmOldSocketT;
 typedef SOCKET LmOldSocketT;
 #endif /* G_OS_WIN32 */
 
+/* See _lm_message_node_write_full() */
+typedef gboolean (* LmMessageNodeWriteFunc) (LmMessageNode *node,
+                                             const gchar   *key,
+                                             GString       *out,
+                                             gpointer       user_data);
+
 typedef struct {
 	gpointer       func;
 	gpointer       user_data;
@@ -74,17 +85,85 @@ LmCallback *     _lm_utils_new_callback       (gpointer               func,
                                                GDestroyNotify         notify);
 void             _lm_utils_free_callback      (LmCallback            *cb);
 
-gchar *          _lm_utils_generate_id        (void);
+gpointer         _lm_alloc_new0               (LmAllocType            type,
+                                               gsize                  size);
+void             _lm_alloc_free               (LmAllocType            type,
+                                               gsize                  size,
+                                               gpointer               mem);
+gpointer         _lm_allocator_alloc          (const LmAllocator     *allocator,
+                                               gsize                  size);
+gpointer         _lm_allocator_realloc        (const LmAllocator     *allocator,
+                                               gpointer               mem,
+                                               gsize                  old_size,
+                                               gsize                  size);
+void             _lm_allocator_free           (const LmAllocator     *allocator,
+                                               gpointer               mem,
+                                               gsize                  size);
+/* Size of the buffer _lm_utils_generate_id() writes to */
+#define LM_ID_SIZE 11
+
+gchar *          _lm_utils_generate_id        (gchar                  buf[LM_ID_SIZE]);
+gboolean         _lm_utils_parse_id           (const gchar           *str,
+                                               guint32               *id);
 gchar *          
 _lm_utils_hostname_to_punycode                (const gchar           *hostname);
+LmMessageType    _lm_message_type_from_string (const gchar           *type_str);
 const gchar *    _lm_message_type_to_string   (LmMessageType          type);
 const gchar * 
 _lm_message_sub_type_to_string                (LmMessageSubType       type);
-LmMessage *      _lm_message_new_from_node    (LmMessageNode         *node);
+LmMessage *      _lm_message_new_from_node    (const LmAllocator     *allocator,
+                                               LmMessageNode         *node);
+void             _lm_message_set_raw_stanza   (LmMessage             *message,
+                                               const gchar           *str,
+                                               gsize                  len);
 void            
 _lm_message_node_add_child_node               (LmMessageNode         *node,
                                                LmMessageNode         *child);
 LmMessageNode *  _lm_message_node_new         (const gchar           *name);
+LmMessageNode *  _lm_message_node_new_static  (const gchar           *name);
+LmMessageNode *
+_lm_message_node_clone_shallow                (LmMessageNode         *node);
+LmMessageNode *  _lm_message_node_new_len     (LmArena               *arena,
+                                               const gchar           *name,
+                                               gsize                  len);
+void
+_lm_message_node_set_borrowed_value           (LmMessageNode         *node,
+                                               gchar                 *value);
+gboolean
+_lm_message_node_add_borrowed_attribute       (LmMessageNode         *node,
+                                               const gchar           *key,
+                                               gsize                  key_len,
+                                               gchar                 *value);
+void             _lm_message_node_write       (LmMessageNode         *node,
+                                               GString               *out,
+                                               gboolean               start_tag_only);
+void
+_lm_message_node_write_full                   (LmMessageNode         *node,
+                                               GString               *out,
+                                               LmMessageNodeWriteFunc func,
+                                               gpointer               user_data);
+void
+_lm_message_node_append_escaped               (GString               *out,
+                                               const gchar           *str);
+gboolean
+_lm_message_node_rewrite_raw                  (GString               *out,
+                                               const gchar           *str,
+                                               gsize                  len,
+                                               const gchar          **names,
+                                               const gchar          **values);
+void             _lm_stanza_template_write    (LmStanzaTemplate      *tmpl,
+                                               GString               *out,
+                                               const gchar          **values);
+gboolean         _lm_message_node_name_equal  (LmMessageNode         *node,
+                                               const gchar           *name,
+                                               const gchar           *interned);
+const gchar *
+_lm_message_node_lookup_attribute             (LmMessageNode         *node,
+                                               const gchar           *key,
+                                               const gchar           *interned);
+void             _lm_parser_build_children    (LmMessageNode         *node,
+                                               const gchar           *content);
+gsize            _lm_parser_get_n_copied      (LmParser              *parser);
 void             _lm_debug_init               (void);
 gboolean         _lm_proxy_connect_cb         (GIOChannel            *source,
                                                GIOCondition           condition,
@@ -82,7 +82,8 @@ lm_message_handler_new (LmHandleMessageFunction function,
 
 	g_return_val_if_fail (function != NULL, NULL);
         
-        handler = g_new0 (LmMessageHandler, 1);
+        handler = _lm_alloc_new0 (LM_ALLOC_HANDLER, 
+                                  sizeof (LmMessageHandler));
         
         if (handler == NULL) {
                 return NULL;
@@ -161,7 +162,8 @@ lm_message_handler_unref (LmMessageHandler *handler)
                 if (handler->notify) {
                         (* handler->notify) (handler->user_data);
                 }
-                g_free (handler);
+                _lm_alloc_free (LM_ALLOC_HANDLER, sizeof (LmMessageHandler),
+                                handler);
         }
 }
 
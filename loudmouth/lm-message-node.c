@@ -29,45 +29,251 @@
 
 #include "lm-internals.h"
 #include "lm-message-node.h"
+#include "lm-scan.h"
 
-typedef struct {
+typedef struct _LmMessageNodeAttribute KeyValuePair;
+
+struct _LmMessageNodeAttribute {
         gchar *key;
         gchar *value;
-} KeyValuePair;
+        guint  flags;
+};
+
+typedef struct _LmMessageNodeWire LmMessageNodeWire;
+
+struct _LmMessageNodeWire {
+        gsize len;
+        gchar str[1];
+};
+
+/* Attributes are kept in an array that starts out with room for a few 
+ * and doubles when full, so the size follows from the number of them.
+ * The array of a node with an arena is allocated from the arena. */
+#define ATTRIBUTES_MIN_SIZE 4
+#define ATTRIBUTES_MAX      G_MAXUINT16
+
+/* Strings marked as borrowed aren't owned by the node, they live in the
+ * arena of the node, in the intern table or are static and must not be
+ * freed separately. Static ones, which includes interned ones, outlive 
+ * every node so copies of the node can borrow them too. Interned names
+ * can be compared by pointer. Children 
+ * marked as shared are also children of a clone of the node or the node
+ * it was cloned from. Written nodes have been serialized since they 
+ * last changed. */
+enum {
+        NODE_NAME_BORROWED   = 1 << 0,
+        NODE_VALUE_BORROWED  = 1 << 1,
+        NODE_NAME_INTERNED   = 1 << 2,
+        NODE_CHILDREN_SHARED = 1 << 3,
+        NODE_WRITTEN         = 1 << 4,
+        NODE_NAME_STATIC     = 1 << 5,
+        NODE_VALUE_STATIC    = 1 << 6
+};
+
+enum {
+        ATTR_KEY_BORROWED   = 1 << 0,
+        ATTR_VALUE_BORROWED = 1 << 1,
+        ATTR_KEY_INTERNED   = 1 << 2,
+        ATTR_KEY_STATIC     = 1 << 3,
+        ATTR_VALUE_STATIC   = 1 << 4
+};
+
+#define NODE_NAME_FLAGS  (NODE_NAME_BORROWED | NODE_NAME_INTERNED | \
+                          NODE_NAME_STATIC)
+#define NODE_VALUE_FLAGS (NODE_VALUE_BORROWED | NODE_VALUE_STATIC)
+#define ATTR_KEY_FLAGS   (ATTR_KEY_BORROWED | ATTR_KEY_INTERNED | \
+                          ATTR_KEY_STATIC)
+#define ATTR_VALUE_FLAGS (ATTR_VALUE_BORROWED | ATTR_VALUE_STATIC)
 
 static void            message_node_free            (LmMessageNode    *node);
+static void            message_node_free_one        (LmMessageNode    *node);
+static void            message_node_build_children  (LmMessageNode    *node);
+static void            message_node_own_children    (LmMessageNode    *node);
+static void            message_node_invalidate_wire (LmMessageNode    *node);
+static void            message_node_free_wire       (LmMessageNode    *node);
 static LmMessageNode * message_node_last_child      (LmMessageNode    *node);
+static KeyValuePair *  message_node_lookup_attribute (LmMessageNode   *node,
+                                                      const gchar     *key,
+                                                      const gchar     *interned);
+static KeyValuePair *  message_node_append_attribute (LmMessageNode   *node);
+static LmMessageNode * message_node_find_child      (LmMessageNode    *node,
+                                                     const gchar      *name,
+                                                     const gchar      *interned);
 
+/* An interned string is only equal to the interned copy of @name, 
+ * @interned is that copy or %NULL if @name isn't in the table */
+#define MESSAGE_NODE_STR_EQUAL(str, is_interned, name, interned) \
+        ((is_interned) ? (str) == (interned) : strcmp ((str), (name)) == 0)
+
+/* Size in bytes of the attribute array of a node with @n attributes */
+static gsize
+message_node_attributes_size (guint n)
+{
+        guint size = ATTRIBUTES_MIN_SIZE;
+
+        while (size < n) {
+                size *= 2;
+        }
+
+        return size * sizeof (KeyValuePair);
+}
+
+/* Frees @node and the children only it referenced, without recursing. 
+ * The parent field of a node that is being freed isn't needed any more 
+ * and links the nodes still to be freed instead. Shared children that 
+ * outlive their parent have it cleared. */
 static void
 message_node_free (LmMessageNode *node)
 {
-        LmMessageNode *l;
-        GSList        *list;
-        
+        LmMessageNode *pending;
+
         g_return_if_fail (node != NULL);
 
-	for (l = node->children; l;) {
-		LmMessageNode *next = l->next;
+        node->parent = NULL;
+        for (pending = node; pending;) {
+                LmMessageNode *l;
+                LmMessageNode *next;
+
+                node = pending;
+                pending = node->parent;
 
-		lm_message_node_unref (l);
-		l = next;
+                for (l = node->children; l; l = next) {
+                        next = l->next;
+
+                        l->ref_count--;
+                        if (l->ref_count == 0) {
+                                l->parent = pending;
+                                pending = l;
+                        } else if (l->parent == node) {
+                                l->parent = NULL;
+                        }
+                }
+
+                l = node->children_owner;
+                if (l) {
+                        l->ref_count--;
+                        if (l->ref_count == 0) {
+                                l->parent = pending;
+                                pending = l;
+                        }
+                }
+
+                message_node_free_one (node);
+        }
+}
+
+/* Frees what @node itself holds, its children are taken care of by
+ * message_node_free() */
+static void
+message_node_free_one (LmMessageNode *node)
+{
+        LmArena *arena;
+        guint    i;
+
+        if (!(node->flags & NODE_NAME_BORROWED)) {
+                g_free (node->name);
         }
 
-        g_free (node->name);
-        g_free (node->value);
+        if (!(node->flags & NODE_VALUE_BORROWED)) {
+                g_free (node->value);
+        }
         
-        for (list = node->attributes; list; list = list->next) {
-                KeyValuePair *kvp = (KeyValuePair *) list->data;
+        for (i = 0; i < node->n_attributes; i++) {
+                KeyValuePair *kvp = &node->attributes[i];
                 
-                g_free (kvp->key);
-                g_free (kvp->value);
-                g_free (kvp);
+                if (!(kvp->flags & ATTR_KEY_BORROWED)) {
+                        g_free (kvp->key);
+                }
+
+                if (!(kvp->flags & ATTR_VALUE_BORROWED)) {
+                        g_free (kvp->value);
+                }
         }
         
-        g_slist_free (node->attributes);
-        g_free (node);
+        arena = node->arena;
+        if (!arena && node->attributes) {
+                _lm_alloc_free (LM_ALLOC_ATTRIBUTES,
+                                message_node_attributes_size (node->n_attributes),
+                                node->attributes);
+        }
+
+        message_node_free_wire (node);
+
+        if (arena) {
+                /* The node memory itself belongs to the arena */
+                lm_arena_unref (arena);
+        } else {
+                _lm_alloc_free (LM_ALLOC_NODE, sizeof (LmMessageNode), node);
+        }
 }
 
+/* Returns the attribute @key of @node, or %NULL. The lookup stops at the 
+ * first match since keys are unique. */
+static KeyValuePair *
+message_node_lookup_attribute (LmMessageNode *node,
+                               const gchar   *key,
+                               const gchar   *interned)
+{
+        KeyValuePair *kvp = node->attributes;
+        KeyValuePair *end = kvp + node->n_attributes;
+
+        for (; kvp < end; kvp++) {
+                if (MESSAGE_NODE_STR_EQUAL (kvp->key, 
+                                            kvp->flags & ATTR_KEY_INTERNED,
+                                            key, interned)) {
+                        return kvp;
+                }
+        }
+
+        return NULL;
+}
+
+/* Adds an empty attribute at the end of the array, growing it if full.
+ * Returns %NULL if the array has to grow and the arena of @node can't 
+ * give it the memory. */
+static KeyValuePair *
+message_node_append_attribute (LmMessageNode *node)
+{
+        guint n = node->n_attributes;
+
+        if (n == 0 || (n >= ATTRIBUTES_MIN_SIZE && (n & (n - 1)) == 0)) {
+                KeyValuePair *attributes;
+                guint         size;
+
+                size = MAX (n * 2, ATTRIBUTES_MIN_SIZE);
+
+                if (node->arena) {
+                        attributes = lm_arena_alloc (node->arena, 
+                                                     size * sizeof (KeyValuePair));
+                        if (G_UNLIKELY (!attributes)) {
+                                return NULL;
+                        }
+                } else {
+                        attributes = _lm_alloc_new0 (LM_ALLOC_ATTRIBUTES,
+                                                     size * sizeof (KeyValuePair));
+                }
+
+                if (n > 0) {
+                        memcpy (attributes, node->attributes,
+                                n * sizeof (KeyValuePair));
+                        if (!node->arena) {
+                                _lm_alloc_free (LM_ALLOC_ATTRIBUTES,
+                                                n * sizeof (KeyValuePair),
+                                                node->attributes);
+                        }
+                }
+
+                node->attributes = attributes;
+        }
+
+        node->n_attributes++;
+
+        return &node->attributes[n];
+}
+
+/* The last child is remembered so that appending doesn't walk all the 
+ * siblings. Children are never unlinked, see the #LmMessageNode docs, 
+ * so it stays valid as long as @node does. */
 static LmMessageNode *
 message_node_last_child (LmMessageNode *node)
 {
@@ -75,30 +281,114 @@ message_node_last_child (LmMessageNode *node)
         
         g_return_val_if_fail (node != NULL, NULL);
 
-        if (!node->children) {
+        l = node->last_child;
+        if (!l) {
+                l = node->children;
+        }
+
+        if (!l) {
                 return NULL;
         }
-                
-        l = node->children;
 
         while (l->next) {
                 l = l->next;
         }
 
+        node->last_child = l;
+
         return l;
 }
 
-LmMessageNode *
-_lm_message_node_new (const gchar *name)
+/* Builds the children of a lazily parsed node */
+static void
+message_node_build_children (LmMessageNode *node)
+{
+        gchar *content;
+
+        if (G_LIKELY (!node->unparsed)) {
+                return;
+        }
+
+        /* Cleared first, the parser adds the children with
+         * _lm_message_node_add_child_node() */
+        content = node->unparsed;
+        node->unparsed = NULL;
+
+        _lm_parser_build_children (node, content);
+}
+
+/* Gives @node children of its own in place of the ones it shares. Only 
+ * the direct children are copied, they share theirs in turn. */
+static void
+message_node_unshare_children (LmMessageNode *node)
+{
+        LmMessageNode *l;
+        LmMessageNode *next;
+
+        l = node->children;
+        node->children = NULL;
+        node->last_child = NULL;
+        node->flags &= ~NODE_CHILDREN_SHARED;
+
+        for (; l; l = next) {
+                LmMessageNode *copy;
+
+                next = l->next;
+
+                copy = _lm_message_node_clone_shallow (l);
+                _lm_message_node_add_child_node (node, copy);
+                lm_message_node_unref (copy);
+
+                lm_message_node_unref (l);
+        }
+
+        if (node->children_owner) {
+                lm_message_node_unref (node->children_owner);
+                node->children_owner = NULL;
+        }
+}
+
+/* Called before handing out children that may be changed */
+static void
+message_node_own_children (LmMessageNode *node)
+{
+        message_node_build_children (node);
+
+        if (node->flags & NODE_CHILDREN_SHARED) {
+                message_node_unshare_children (node);
+        }
+}
+
+/* Drops the serialized form kept for @node and the nodes above it. A 
+ * node that was never written has no written nodes above it either, so
+ * the walk stops there instead of going up to the root every time a 
+ * deep tree is built. */
+static void
+message_node_invalidate_wire (LmMessageNode *node)
+{
+        for (; node; node = node->parent) {
+                if (!(node->flags & NODE_WRITTEN) && !node->wire) {
+                        break;
+                }
+
+                node->flags &= ~NODE_WRITTEN;
+
+                message_node_free_wire (node);
+        }
+}
+
+static LmMessageNode *
+message_node_new_take (gchar *name)
 {
         LmMessageNode *node;
 
-        node = g_new0 (LmMessageNode, 1);
+        node = _lm_alloc_new0 (LM_ALLOC_NODE, sizeof (LmMessageNode));
         
-        node->name       = g_strdup (name);
+        node->name       = name;
         node->value      = NULL;
 	node->raw_mode   = FALSE;
         node->attributes = NULL;
+        node->n_attributes = 0;
         node->next       = NULL;
         node->prev       = NULL;
         node->parent     = NULL;
@@ -108,6 +398,186 @@ _lm_message_node_new (const gchar *name)
 
         return node;
 }
+
+LmMessageNode *
+_lm_message_node_new (const gchar *name)
+{
+        LmMessageNode *node;
+        const gchar   *interned;
+
+        interned = lm_intern_lookup (name, -1);
+        if (!interned) {
+                return message_node_new_take (g_strdup (name));
+        }
+
+        node = message_node_new_take ((gchar *) interned);
+        node->flags = NODE_NAME_FLAGS;
+
+        return node;
+}
+
+/* Like _lm_message_node_new() but @name is static and only referenced */
+LmMessageNode *
+_lm_message_node_new_static (const gchar *name)
+{
+        LmMessageNode *node;
+        const gchar   *interned;
+
+        interned = lm_intern_lookup (name, -1);
+        if (!interned) {
+                node = message_node_new_take ((gchar *) name);
+                node->flags = NODE_NAME_BORROWED | NODE_NAME_STATIC;
+                return node;
+        }
+
+        node = message_node_new_take ((gchar *) interned);
+        node->flags = NODE_NAME_FLAGS;
+
+        return node;
+}
+
+/* Used by the parser, @name doesn't need to be nul terminated. If @arena
+ * is set the node and all strings the parser hands to it are allocated 
+ * from it and the arena is kept alive as long as the node is. Returns 
+ * %NULL if the arena runs out of memory. */
+LmMessageNode *
+_lm_message_node_new_len (LmArena *arena, const gchar *name, gsize len)
+{
+        LmMessageNode *node;
+        const gchar   *interned;
+
+        /* Only looked up, names a peer makes up never enter the table */
+        interned = lm_intern_lookup (name, len);
+
+        if (!arena) {
+                if (!interned) {
+                        return message_node_new_take (g_strndup (name, len));
+                }
+
+                node = message_node_new_take ((gchar *) interned);
+        } else {
+                gchar *name_copy = NULL;
+
+                if (!interned) {
+                        name_copy = lm_arena_strndup (arena, name, len);
+                        if (G_UNLIKELY (!name_copy)) {
+                                return NULL;
+                        }
+                }
+
+                node = lm_arena_alloc (arena, sizeof (LmMessageNode));
+                if (G_UNLIKELY (!node)) {
+                        return NULL;
+                }
+                memset (node, 0, sizeof (LmMessageNode));
+
+                node->arena     = lm_arena_ref (arena);
+                node->ref_count = 1;
+
+                if (!interned) {
+                        node->name  = name_copy;
+                        node->flags = NODE_NAME_BORROWED;
+                        return node;
+                }
+
+                node->name = (gchar *) interned;
+        }
+
+        node->flags = NODE_NAME_FLAGS;
+
+        return node;
+}
+
+/* Sets a value that lives at least as long as the node, from its arena */
+void
+_lm_message_node_set_borrowed_value (LmMessageNode *node, gchar *value)
+{
+        g_return_if_fail (node != NULL);
+
+        if (!(node->flags & NODE_VALUE_BORROWED)) {
+                g_free (node->value);
+        }
+
+        node->value = value;
+        node->flags &= ~NODE_VALUE_FLAGS;
+        node->flags |= NODE_VALUE_BORROWED;
+}
+
+/* Like lm_message_node_set_attribute() but @value is borrowed from the 
+ * arena of @node, which also holds the attribute itself. @key doesn't 
+ * need to be nul terminated. Keys and values already in the intern 
+ * table are shared with it, nothing a peer sends is added to it. 
+ * Returns %FALSE if the arena runs out of memory. */
+gboolean
+_lm_message_node_add_borrowed_attribute (LmMessageNode *node,
+                                         const gchar   *key,
+                                         gsize          key_len,
+                                         gchar         *value)
+{
+        KeyValuePair *kvp;
+        const gchar  *interned_key;
+        const gchar  *interned_value;
+        gchar        *key_copy = NULL;
+        const gchar  *key_str;
+        guint         flags = ATTR_KEY_BORROWED | ATTR_VALUE_BORROWED;
+
+        g_return_val_if_fail (node != NULL, FALSE);
+
+        interned_key = lm_intern_lookup (key, key_len);
+        if (interned_key) {
+                flags |= ATTR_KEY_INTERNED | ATTR_KEY_STATIC;
+        } else if (node->arena) {
+                key_copy = lm_arena_strndup (node->arena, key, key_len);
+                if (G_UNLIKELY (!key_copy)) {
+                        return FALSE;
+                }
+        } else {
+                key_copy = g_strndup (key, key_len);
+                flags &= ~ATTR_KEY_BORROWED;
+        }
+        key_str = interned_key ? interned_key : key_copy;
+
+        interned_value = lm_intern_lookup (value, -1);
+        if (interned_value) {
+                value = (gchar *) interned_value;
+                flags |= ATTR_VALUE_STATIC;
+        }
+
+        kvp = message_node_lookup_attribute (node, key_str, interned_key);
+        if (kvp) {
+                if (!(kvp->flags & ATTR_VALUE_BORROWED)) {
+                        g_free (kvp->value);
+                }
+                kvp->value = value;
+                kvp->flags &= ~ATTR_VALUE_FLAGS;
+                kvp->flags |= flags & ATTR_VALUE_FLAGS;
+
+                if (!(flags & ATTR_KEY_BORROWED)) {
+                        g_free (key_copy);
+                }
+                return TRUE;
+        }
+
+        if (node->n_attributes == ATTRIBUTES_MAX) {
+                g_warning ("Too many attributes on node %s", node->name);
+                if (!(flags & ATTR_KEY_BORROWED)) {
+                        g_free (key_copy);
+                }
+                return TRUE;
+        }
+
+        kvp = message_node_append_attribute (node);
+        if (G_UNLIKELY (!kvp)) {
+                return FALSE;
+        }
+
+        kvp->key = (gchar *) key_str;
+        kvp->value = value;
+        kvp->flags = flags;
+
+        return TRUE;
+}
+
 void
 _lm_message_node_add_child_node (LmMessageNode *node, LmMessageNode *child)
 {
@@ -115,6 +585,9 @@ _lm_message_node_add_child_node (LmMessageNode *node, LmMessageNode *child)
 	
         g_return_if_fail (node != NULL);
 
+        message_node_own_children (node);
+        message_node_invalidate_wire (node);
+
         prev = message_node_last_child (node);
 	lm_message_node_ref (child);
 
@@ -126,6 +599,86 @@ _lm_message_node_add_child_node (LmMessageNode *node, LmMessageNode *child)
         }
         
         child->parent = node;
+        node->last_child = child;
+}
+
+/* Returns a copy of @node that shares its children with @node, see 
+ * lm_message_clone_shallow() */
+LmMessageNode *
+_lm_message_node_clone_shallow (LmMessageNode *node)
+{
+        LmMessageNode *clone;
+        LmMessageNode *l;
+        guint          i;
+
+        g_return_val_if_fail (node != NULL, NULL);
+
+        message_node_build_children (node);
+
+        /* Static strings are shared, the rest may live in the arena of
+         * @node and are copied */
+        if (node->flags & NODE_NAME_STATIC) {
+                clone = message_node_new_take (node->name);
+                clone->flags = node->flags & NODE_NAME_FLAGS;
+        } else {
+                clone = message_node_new_take (g_strdup (node->name));
+        }
+
+        if (node->flags & NODE_VALUE_STATIC) {
+                clone->value = node->value;
+                clone->flags |= node->flags & NODE_VALUE_FLAGS;
+        } else {
+                clone->value = g_strdup (node->value);
+        }
+        clone->raw_mode = node->raw_mode;
+
+        if (node->n_attributes > 0) {
+                /* Keep the size the array would have grown to */
+                clone->attributes = 
+                        _lm_alloc_new0 (LM_ALLOC_ATTRIBUTES, 
+                                        message_node_attributes_size (node->n_attributes));
+                clone->n_attributes = node->n_attributes;
+
+                for (i = 0; i < node->n_attributes; i++) {
+                        KeyValuePair *kvp = &node->attributes[i];
+                        KeyValuePair *copy = &clone->attributes[i];
+
+                        if (kvp->flags & ATTR_KEY_STATIC) {
+                                copy->key = kvp->key;
+                                copy->flags = kvp->flags & ATTR_KEY_FLAGS;
+                        } else {
+                                copy->key = g_strdup (kvp->key);
+                                copy->flags = 0;
+                        }
+
+                        if (kvp->flags & ATTR_VALUE_STATIC) {
+                                copy->value = kvp->value;
+                                copy->flags |= kvp->flags & ATTR_VALUE_FLAGS;
+                        } else {
+                                copy->value = g_strdup (kvp->value);
+                        }
+                }
+        }
+
+        if (node->children) {
+                for (l = node->children; l; l = l->next) {
+                        lm_message_node_ref (l);
+                }
+
+                clone->children = node->children;
+                clone->last_child = node->last_child;
+
+                /* @node may share them itself */
+                if (node->children->parent) {
+                        clone->children_owner = 
+                                lm_message_node_ref (node->children->parent);
+                }
+
+                node->flags |= NODE_CHILDREN_SHARED;
+                clone->flags |= NODE_CHILDREN_SHARED;
+        }
+
+        return clone;
 }
 
 /**
@@ -144,6 +697,28 @@ lm_message_node_get_value (LmMessageNode *node)
 	return node->value;
 }
 
+static void
+message_node_set_value (LmMessageNode *node, 
+                        const gchar   *value, 
+                        gboolean       is_static)
+{
+        message_node_invalidate_wire (node);
+       
+        if (!(node->flags & NODE_VALUE_BORROWED)) {
+                g_free (node->value);
+        }
+        node->flags &= ~NODE_VALUE_FLAGS;
+	
+        if (!value) {
+                node->value = NULL;
+        } else if (is_static) {
+                node->value = (gchar *) value;
+                node->flags |= NODE_VALUE_FLAGS;
+        } else {
+                node->value = g_strdup (value);
+        }
+}
+
 /**
  * lm_message_node_set_value:
  * @node: an #LmMessageNode
@@ -155,15 +730,25 @@ void
 lm_message_node_set_value (LmMessageNode *node, const gchar *value)
 {
         g_return_if_fail (node != NULL);
-       
-        g_free (node->value);
-	
-        if (!value) {
-                node->value = NULL;
-                return;
-        }
 
-        node->value = g_strdup (value);
+        message_node_set_value (node, value, FALSE);
+}
+
+/**
+ * lm_message_node_set_value_static:
+ * @node: an #LmMessageNode
+ * @value: the new value, a string that is never freed or changed
+ * 
+ * Like lm_message_node_set_value() but @value isn't copied, only 
+ * referenced, so it must stay valid for as long as the program runs.
+ * Meant for string literals.
+ **/
+void
+lm_message_node_set_value_static (LmMessageNode *node, const gchar *value)
+{
+        g_return_if_fail (node != NULL);
+
+        message_node_set_value (node, value, TRUE);
 }
 
 /**
@@ -188,7 +773,40 @@ lm_message_node_add_child (LmMessageNode *node,
 
 	child = _lm_message_node_new (name);
 
-	lm_message_node_set_value (child, value);
+	message_node_set_value (child, value, FALSE);
+	_lm_message_node_add_child_node (node, child);
+	lm_message_node_unref (child);
+
+	return child;
+}
+
+/**
+ * lm_message_node_add_child_static:
+ * @node: an #LmMessageNode
+ * @name: the name of the new child, a string that is never freed
+ * @value: value of the new child, a string that is never freed or %NULL
+ * 
+ * Like lm_message_node_add_child() but @name and @value aren't copied,
+ * only referenced, so they must stay valid for as long as the program 
+ * runs. Meant for string literals, a child with dynamic text is added
+ * with a static name by setting its value afterwards with 
+ * lm_message_node_set_value().
+ * 
+ * Return value: the newly created child
+ **/
+LmMessageNode *
+lm_message_node_add_child_static (LmMessageNode *node, 
+				  const gchar   *name, 
+				  const gchar   *value)
+{
+	LmMessageNode *child;
+	
+        g_return_val_if_fail (node != NULL, NULL);
+        g_return_val_if_fail (name != NULL, NULL);
+
+	child = _lm_message_node_new_static (name);
+
+	message_node_set_value (child, value, TRUE);
 	_lm_message_node_add_child_node (node, child);
 	lm_message_node_unref (child);
 
@@ -227,6 +845,62 @@ lm_message_node_set_attributes  (LmMessageNode *node,
 	va_end (args);
 }
 
+static void
+message_node_set_attribute (LmMessageNode *node,
+			    const gchar   *name,
+			    const gchar   *value,
+			    gboolean       is_static)
+{
+	KeyValuePair *kvp;
+	const gchar  *interned_key;
+	const gchar  *interned_value;
+
+	message_node_invalidate_wire (node);
+
+	interned_key = lm_intern_lookup (name, -1);
+
+	kvp = message_node_lookup_attribute (node, name, interned_key);
+	if (kvp) {
+		if (!(kvp->flags & ATTR_VALUE_BORROWED)) {
+			g_free (kvp->value);
+		}
+	} else {
+		g_return_if_fail (node->n_attributes < ATTRIBUTES_MAX);
+
+		kvp = message_node_append_attribute (node);
+		if (G_UNLIKELY (!kvp)) {
+			g_warning ("Out of memory for attribute %s on node %s",
+				   name, node->name);
+			return;
+		}
+
+		if (interned_key) {
+			kvp->key = (gchar *) interned_key;
+			kvp->flags = ATTR_KEY_FLAGS;
+		} else if (is_static) {
+			kvp->key = (gchar *) name;
+			kvp->flags = ATTR_KEY_BORROWED | ATTR_KEY_STATIC;
+		} else {
+			kvp->key = g_strdup (name);
+			kvp->flags = 0;
+		}
+	}
+
+	kvp->flags &= ~ATTR_VALUE_FLAGS;
+
+	/* Common values are shared instead of copied */
+	interned_value = lm_intern_lookup (value, -1);
+	if (interned_value) {
+		kvp->value = (gchar *) interned_value;
+		kvp->flags |= ATTR_VALUE_FLAGS;
+	} else if (is_static) {
+		kvp->value = (gchar *) value;
+		kvp->flags |= ATTR_VALUE_FLAGS;
+	} else {
+		kvp->value = g_strdup (value);
+	}
+}
+
 /**
  * lm_message_node_set_attribute:
  * @node: an #LmMessageNode
@@ -240,33 +914,33 @@ lm_message_node_set_attribute (LmMessageNode *node,
 			       const gchar   *name,
 			       const gchar   *value)
 {
-	gboolean  found = FALSE; 
-	GSList   *l;
-
         g_return_if_fail (node != NULL);
         g_return_if_fail (name != NULL);
         g_return_if_fail (value != NULL);
 
-	for (l = node->attributes; l; l = l->next) {
-		KeyValuePair *kvp = (KeyValuePair *) l->data;
-                
-		if (strcmp (kvp->key, name) == 0) {
-			g_free (kvp->value);
-			kvp->value = g_strdup (value);
-			found = TRUE;
-			break;
-		}
-	}
-	
-	if (!found) {
-		KeyValuePair *kvp;
-	
-		kvp = g_new0 (KeyValuePair, 1);                
-		kvp->key = g_strdup (name);
-		kvp->value = g_strdup (value);
-		
-		node->attributes = g_slist_prepend (node->attributes, kvp);
-	}
+	message_node_set_attribute (node, name, value, FALSE);
+}
+
+/**
+ * lm_message_node_set_attribute_static:
+ * @node: an #LmMessageNode
+ * @name: name of attribute, a string that is never freed
+ * @value: value of attribute, a string that is never freed or changed
+ * 
+ * Like lm_message_node_set_attribute() but @name and @value aren't 
+ * copied, only referenced, so they must stay valid for as long as the
+ * program runs. Meant for string literals such as namespaces.
+ **/
+void
+lm_message_node_set_attribute_static (LmMessageNode *node,
+				      const gchar   *name,
+				      const gchar   *value)
+{
+        g_return_if_fail (node != NULL);
+        g_return_if_fail (name != NULL);
+        g_return_if_fail (value != NULL);
+
+	message_node_set_attribute (node, name, value, TRUE);
 }
 
 /**
@@ -281,21 +955,39 @@ lm_message_node_set_attribute (LmMessageNode *node,
 const gchar *
 lm_message_node_get_attribute (LmMessageNode *node, const gchar *name)
 {
-        GSList      *l;
-        const gchar *ret_val = NULL;
+        KeyValuePair *kvp;
 
         g_return_val_if_fail (node != NULL, NULL);
         g_return_val_if_fail (name != NULL, NULL);
 
-        for (l = node->attributes; l; l = l->next) {
-                KeyValuePair *kvp = (KeyValuePair *) l->data;
-                
-                if (strcmp (kvp->key, name) == 0) {
-                        ret_val = kvp->value;
-                }
-        }
-        
-        return ret_val;
+        kvp = message_node_lookup_attribute (node, name, 
+                                             lm_intern_lookup (name, -1));
+
+        return kvp ? kvp->value : NULL;
+}
+
+/* Lookups for callers that have looked up the interned copies of @name
+ * and @key in advance, @interned is that copy or %NULL */
+gboolean
+_lm_message_node_name_equal (LmMessageNode *node,
+                             const gchar   *name,
+                             const gchar   *interned)
+{
+        return MESSAGE_NODE_STR_EQUAL (node->name, 
+                                       node->flags & NODE_NAME_INTERNED,
+                                       name, interned);
+}
+
+const gchar *
+_lm_message_node_lookup_attribute (LmMessageNode *node,
+                                   const gchar   *key,
+                                   const gchar   *interned)
+{
+        KeyValuePair *kvp;
+
+        kvp = message_node_lookup_attribute (node, key, interned);
+
+        return kvp ? kvp->value : NULL;
 }
 
 /**
@@ -312,12 +1004,19 @@ LmMessageNode *
 lm_message_node_get_child (LmMessageNode *node, const gchar *child_name)
 {
 	LmMessageNode *l;
+	const gchar   *interned;
 
         g_return_val_if_fail (node != NULL, NULL);
         g_return_val_if_fail (child_name != NULL, NULL);
 
+	interned = lm_intern_lookup (child_name, -1);
+
+	message_node_own_children (node);
+
 	for (l = node->children; l; l = l->next) {
-		if (strcmp (l->name, child_name) == 0) {
+		if (MESSAGE_NODE_STR_EQUAL (l->name, 
+					    l->flags & NODE_NAME_INTERNED,
+					    child_name, interned)) {
 			return l;
 		}
 	}
@@ -339,25 +1038,144 @@ LmMessageNode *
 lm_message_node_find_child (LmMessageNode *node,
 			    const gchar   *child_name)
 {
-        LmMessageNode *l;
-        LmMessageNode *ret_val = NULL;
-
         g_return_val_if_fail (node != NULL, NULL);
         g_return_val_if_fail (child_name != NULL, NULL);
 
-        for (l = node->children; l; l = l->next) {
-                if (strcmp (l->name, child_name) == 0) {
-                        return l;
+        return message_node_find_child (node, child_name,
+                                        lm_intern_lookup (child_name, -1));
+}
+
+/**
+ * lm_message_node_get_children:
+ * @node: an #LmMessageNode
+ * 
+ * Fetches the first child of @node, the others can be reached through
+ * the next field of the children. If @node was parsed lazily its 
+ * children are built first.
+ * 
+ * Return value: the first child or %NULL if @node has no children
+ **/
+LmMessageNode *
+lm_message_node_get_children (LmMessageNode *node)
+{
+        g_return_val_if_fail (node != NULL, NULL);
+
+        message_node_own_children (node);
+
+        return node->children;
+}
+
+/* A child being looked at and where it is among its siblings */
+typedef struct {
+        LmMessageNode *node;
+        guint          index;
+} FindFrame;
+
+/* Enough for all but unusually deep stanzas, deeper ones go to the heap */
+#define FIND_FRAMES_PREALLOC 64
+
+/* Follows the child positions in @frames down from @node, owning the 
+ * children of every node on the way. The nodes off the path stay 
+ * shared. */
+static LmMessageNode *
+message_node_own_path (LmMessageNode   *node,
+                       const FindFrame *frames,
+                       guint            n_frames)
+{
+        guint i;
+
+        for (i = 0; i < n_frames; i++) {
+                LmMessageNode *l;
+                guint          j;
+
+                message_node_own_children (node);
+
+                l = node->children;
+                for (j = 0; j < frames[i].index; j++) {
+                        l = l->next;
+                }
+                node = l;
+        }
+
+        return node;
+}
+
+/* Walks the tree below @node in document order without changing it, 
+ * with a stack instead of the parent pointers since shared children 
+ * point to only one of the nodes sharing them. Only the path to the 
+ * result is owned, it may be changed by the caller. */
+static LmMessageNode *
+message_node_find_child (LmMessageNode *node,
+                         const gchar   *name,
+                         const gchar   *interned)
+{
+        FindFrame      prealloc[FIND_FRAMES_PREALLOC];
+        FindFrame     *frames = prealloc;
+        guint          n_frames = 0;
+        guint          max_frames = FIND_FRAMES_PREALLOC;
+        LmMessageNode *found = NULL;
+
+        message_node_build_children (node);
+
+        if (node->children) {
+                frames[0].node = node->children;
+                frames[0].index = 0;
+                n_frames = 1;
+        }
+
+        while (n_frames > 0) {
+                FindFrame     *frame = &frames[n_frames - 1];
+                LmMessageNode *l = frame->node;
+
+                if (!l) {
+                        /* Done with these siblings, on to the next one
+                         * of their parent */
+                        if (--n_frames > 0) {
+                                frame = &frames[n_frames - 1];
+                                frame->node = frame->node->next;
+                                frame->index++;
+                        }
+                        continue;
+                }
+
+                if (MESSAGE_NODE_STR_EQUAL (l->name, 
+                                            l->flags & NODE_NAME_INTERNED,
+                                            name, interned)) {
+                        found = message_node_own_path (node, frames, 
+                                                       n_frames);
+                        break;
                 }
+
+                message_node_build_children (l);
+
                 if (l->children) {
-                        ret_val = lm_message_node_find_child (l, child_name);
-                        if (ret_val) {
-                                return ret_val;
+                        if (n_frames == max_frames) {
+                                max_frames *= 2;
+                                if (frames == prealloc) {
+                                        frames = g_new (FindFrame, max_frames);
+                                        memcpy (frames, prealloc, 
+                                                sizeof (prealloc));
+                                } else {
+                                        frames = g_renew (FindFrame, frames, 
+                                                          max_frames);
+                                }
                         }
+
+                        frames[n_frames].node = l->children;
+                        frames[n_frames].index = 0;
+                        n_frames++;
+                        continue;
                 }
+
+                frame->node = l->next;
+                frame->index++;
         }
 
-        return NULL;
+        if (frames != prealloc) {
+                g_free (frames);
+        }
+
+        return found;
 }
 
 /**
@@ -388,6 +1206,8 @@ lm_message_node_set_raw_mode (LmMessageNode *node, gboolean raw_mode)
 {
 	g_return_if_fail (node != NULL);
 
+	message_node_invalidate_wire (node);
+
 	node->raw_mode = raw_mode;	
 }
 
@@ -431,6 +1251,492 @@ lm_message_node_unref (LmMessageNode *node)
 	}
 }
 
+/* Strings shorter than this are walked byte by byte, the vectorized
+ * scan only pays off for longer ones */
+#define ESCAPE_SCAN_MIN 32
+
+/* Appends @str with the characters that are special in XML escaped. 
+ * Clean runs, usually the whole string, are copied as they are. Control
+ * characters, C1 ones included, are written as character references 
+ * like g_markup_escape_text() does. */
+static void
+message_node_append_escaped (GString *out, const gchar *str)
+{
+	const gchar *p = str;
+	const gchar *end = NULL;
+
+	while (*p) {
+		const gchar *q = p;
+
+		while (*q && q - p < ESCAPE_SCAN_MIN && 
+		       lm_scan_is_clean ((guchar) *q)) {
+			q++;
+		}
+
+		if (q - p == ESCAPE_SCAN_MIN) {
+			if (!end) {
+				end = q + strlen (q);
+			}
+			q += lm_scan_clean (q, end - q);
+		}
+
+		g_string_append_len (out, p, q - p);
+		p = q;
+
+		if (*p == '\0') {
+			break;
+		}
+
+		switch ((guchar) *p) {
+		case 0xc2:
+			/* U+0080 to U+009F but NEL, which is a line break */
+			if ((guchar) p[1] >= 0x80 && (guchar) p[1] <= 0x9f && 
+			    (guchar) p[1] != 0x85) {
+				p++;
+				g_string_append_printf (out, "&#x%x;", 
+							(guchar) *p);
+			} else {
+				g_string_append_c (out, *p);
+			}
+			break;
+		case '&':
+			g_string_append (out, "&amp;");
+			break;
+		case '<':
+			g_string_append (out, "&lt;");
+			break;
+		case '>':
+			g_string_append (out, "&gt;");
+			break;
+		case '"':
+			g_string_append (out, "&quot;");
+			break;
+		case '\'':
+			g_string_append (out, "&apos;");
+			break;
+		default:
+			g_string_append_printf (out, "&#x%x;", (guchar) *p);
+			break;
+		}
+		p++;
+	}
+}
+
+static void
+message_node_write_value (LmMessageNode         *node,
+			  const gchar           *key,
+			  const gchar           *value,
+			  GString               *out,
+			  LmMessageNodeWriteFunc func,
+			  gpointer               user_data)
+{
+	if (func && (* func) (node, key, out, user_data)) {
+		return;
+	}
+
+	if (node->raw_mode) {
+		g_string_append (out, value);
+	} else {
+		message_node_append_escaped (out, value);
+	}
+}
+
+static void
+message_node_write_start_tag (LmMessageNode         *node, 
+			      GString               *out, 
+			      LmMessageNodeWriteFunc func,
+			      gpointer               user_data)
+{
+	guint i;
+
+	g_string_append_c (out, '<');
+	g_string_append (out, node->name);
+
+	for (i = 0; i < node->n_attributes; i++) {
+		KeyValuePair *kvp = &node->attributes[i];
+
+		g_string_append_c (out, ' ');
+		g_string_append (out, kvp->key);
+		g_string_append (out, "=\"");
+		message_node_write_value (node, kvp->key, kvp->value, out, 
+					  func, user_data);
+		g_string_append_c (out, '"');
+	}
+}
+
+static void
+message_node_write_end_tag (LmMessageNode *node, GString *out)
+{
+	g_string_append (out, "</");
+	g_string_append (out, node->name);
+	g_string_append_c (out, '>');
+}
+
+/* Larger serialized forms aren't kept, writing them again costs 
+ * little next to sending them */
+#define WIRE_KEEP_MAX 16384
+
+/* The serialized form comes from the allocator of the stanza the node
+ * was parsed from, if any */
+static const LmAllocator *
+message_node_wire_allocator (LmMessageNode *node)
+{
+	return node->arena ? lm_arena_get_allocator (node->arena) : NULL;
+}
+
+/* Keeps what @node serialized to, from @start to the end of @out. 
+ * Nothing is kept if the allocator fails, it is only a cache. */
+static void
+message_node_keep_wire (LmMessageNode *node, GString *out, gsize start)
+{
+	gsize len = out->len - start;
+
+	if (len > WIRE_KEEP_MAX) {
+		return;
+	}
+
+	node->wire = _lm_allocator_alloc (message_node_wire_allocator (node),
+					  G_STRUCT_OFFSET (LmMessageNodeWire, 
+							   str) + len);
+	if (G_UNLIKELY (!node->wire)) {
+		return;
+	}
+
+	node->wire->len = len;
+	memcpy (node->wire->str, out->str + start, len);
+}
+
+static void
+message_node_free_wire (LmMessageNode *node)
+{
+	if (!node->wire) {
+		return;
+	}
+
+	_lm_allocator_free (message_node_wire_allocator (node), node->wire,
+			    G_STRUCT_OFFSET (LmMessageNodeWire, str) + 
+			    node->wire->len);
+	node->wire = NULL;
+}
+
+/* Only two kinds of nodes keep what they serialize to for the next 
+ * time: children shared with a clone, written once for every copy, and
+ * the node a write started from and its children, when written again 
+ * without having changed. The children are what is left when only the
+ * attributes of the root change between writes. Nodes further down are
+ * only marked as written, so that message_node_invalidate_wire() finds
+ * the way up from them, which keeps a tree from holding more than two
+ * copies of itself no matter how deep it is. */
+static gboolean
+message_node_should_keep_wire (LmMessageNode *node, 
+			       gboolean       is_top,
+			       gboolean       shared)
+{
+	gboolean written = node->flags & NODE_WRITTEN;
+
+	node->flags |= NODE_WRITTEN;
+
+	/* Changes to shared children are only seen by the node they 
+	 * point back to as parent, others can't keep anything */
+	if (node->children && node->children->parent != node) {
+		return FALSE;
+	}
+
+	return shared || (is_top && written);
+}
+
+/* An element that is open while its children are written */
+typedef struct {
+	LmMessageNode *node;
+	/* Where it starts in the output, if it is to be kept */
+	gsize          start;
+	gboolean       keep;
+} WriteFrame;
+
+/* Enough for all but unusually deep stanzas, deeper ones go to the heap */
+#define WRITE_FRAMES_PREALLOC 64
+
+/* Appends @root and everything below it to @out. The tree is walked 
+ * with a stack of open elements instead of recursion, so the depth of
+ * a stanza doesn't matter for the C stack. The parent pointers can't be
+ * used for going back up since shared children point to only one of 
+ * the nodes sharing them. With @func set nothing kept is used, every
+ * node goes through it. */
+static void
+message_node_write_tree (LmMessageNode         *root,
+			 GString               *out,
+			 LmMessageNodeWriteFunc func,
+			 gpointer               user_data)
+{
+	WriteFrame     prealloc[WRITE_FRAMES_PREALLOC];
+	WriteFrame    *frames = prealloc;
+	guint          n_frames = 0;
+	guint          max_frames = WRITE_FRAMES_PREALLOC;
+	LmMessageNode *node = root;
+	gboolean       shared = FALSE;
+
+	while (TRUE) {
+		gboolean keep = FALSE;
+		gsize    start = out->len;
+
+		if (!node->name) {
+			/* Nothing to write */
+		} else if (!func && node->wire) {
+			g_string_append_len (out, node->wire->str, 
+					     node->wire->len);
+		} else {
+			if (!func) {
+				keep = message_node_should_keep_wire (node, 
+								      n_frames <= 1,
+								      shared);
+			}
+
+			message_node_write_start_tag (node, out, 
+						      func, user_data);
+			message_node_build_children (node);
+
+			if (!node->value && !node->children) {
+				g_string_append (out, "/>");
+			} else {
+				g_string_append_c (out, '>');
+
+				if (node->value) {
+					message_node_write_value (node, NULL, 
+								  node->value,
+								  out, func, 
+								  user_data);
+				}
+
+				if (node->children) {
+					if (n_frames == max_frames) {
+						max_frames *= 2;
+						if (frames == prealloc) {
+							frames = g_new (WriteFrame, max_frames);
+							memcpy (frames, prealloc, 
+								sizeof (prealloc));
+						} else {
+							frames = g_renew (WriteFrame, frames, 
+									  max_frames);
+						}
+					}
+
+					frames[n_frames].node = node;
+					frames[n_frames].start = start;
+					frames[n_frames].keep = keep;
+					n_frames++;
+
+					shared = node->flags & NODE_CHILDREN_SHARED;
+					node = node->children;
+					continue;
+				}
+
+				message_node_write_end_tag (node, out);
+			}
+
+			if (keep) {
+				message_node_keep_wire (node, out, start);
+			}
+		}
+
+		/* On to the next sibling, closing the elements that are 
+		 * done on the way. The siblings of @root aren't written. */
+		while (n_frames > 0 && !node->next) {
+			WriteFrame *frame = &frames[--n_frames];
+
+			node = frame->node;
+			message_node_write_end_tag (node, out);
+
+			if (frame->keep) {
+				message_node_keep_wire (node, out, frame->start);
+			}
+		}
+
+		if (n_frames == 0) {
+			break;
+		}
+
+		shared = frames[n_frames - 1].node->flags & NODE_CHILDREN_SHARED;
+		node = node->next;
+	}
+
+	if (frames != prealloc) {
+		g_free (frames);
+	}
+}
+
+/* Appends @node and everything below it to @out, without whitespace 
+ * between the elements. With @start_tag_only set only the start tag is
+ * written, which is what a stream header needs. */
+void
+_lm_message_node_write (LmMessageNode *node, 
+			GString       *out, 
+			gboolean       start_tag_only)
+{
+	g_return_if_fail (node != NULL);
+	g_return_if_fail (out != NULL);
+
+	if (!start_tag_only) {
+		message_node_write_tree (node, out, NULL, NULL);
+	} else if (node->name) {
+		message_node_write_start_tag (node, out, NULL, NULL);
+		g_string_append_c (out, '>');
+	}
+}
+
+/* Like _lm_message_node_write() but @func gets to write the attribute 
+ * values and texts first, with @key %NULL for texts. It returns %TRUE 
+ * for the ones it wrote. */
+void
+_lm_message_node_write_full (LmMessageNode         *node, 
+			     GString               *out, 
+			     LmMessageNodeWriteFunc func,
+			     gpointer               user_data)
+{
+	g_return_if_fail (node != NULL);
+	g_return_if_fail (out != NULL);
+
+	message_node_write_tree (node, out, func, user_data);
+}
+
+/* Appends @str to @out escaped for use in text or attribute values */
+void
+_lm_message_node_append_escaped (GString *out, const gchar *str)
+{
+	message_node_append_escaped (out, str);
+}
+
+static gboolean
+message_node_is_space (gchar c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static void
+message_node_append_raw_attribute (GString     *out, 
+				   const gchar *key, 
+				   const gchar *value)
+{
+	g_string_append_c (out, ' ');
+	g_string_append (out, key);
+	g_string_append (out, "=\"");
+	message_node_append_escaped (out, value);
+	g_string_append_c (out, '"');
+}
+
+/* Appends the received stanza @str to @out with the attributes @names of
+ * its root set to @values, a %NULL value removes the attribute. Only the
+ * start tag of the root is looked at, everything else is copied as it 
+ * is. Returns %FALSE if the start tag is malformed. */
+gboolean
+_lm_message_node_rewrite_raw (GString      *out,
+			      const gchar  *str,
+			      gsize         len,
+			      const gchar **names,
+			      const gchar **values)
+{
+	const gchar *end = str + len;
+	const gchar *p;
+	guint32      done = 0;
+	guint        n_names = 0;
+	guint        i;
+
+	if (names) {
+		while (names[n_names]) {
+			n_names++;
+		}
+	}
+	g_return_val_if_fail (n_names <= 32, FALSE);
+
+	if (len < 3 || str[0] != '<') {
+		return FALSE;
+	}
+
+	/* The element name */
+	p = str + 1;
+	while (p < end && !message_node_is_space (*p) && 
+	       *p != '/' && *p != '>') {
+		p++;
+	}
+
+	g_string_append_len (out, str, p - str);
+
+	while (TRUE) {
+		const gchar *attr = p;
+		const gchar *key;
+		const gchar *value_end;
+		gsize        key_len;
+
+		while (p < end && message_node_is_space (*p)) {
+			p++;
+		}
+
+		if (p == end) {
+			return FALSE;
+		}
+
+		if (*p == '/' || *p == '>') {
+			break;
+		}
+
+		key = p;
+		while (p < end && *p != '=' && !message_node_is_space (*p)) {
+			p++;
+		}
+		key_len = p - key;
+
+		while (p < end && message_node_is_space (*p)) {
+			p++;
+		}
+		if (p == end || *p != '=') {
+			return FALSE;
+		}
+		p++;
+		while (p < end && message_node_is_space (*p)) {
+			p++;
+		}
+		if (p == end || (*p != '"' && *p != '\'')) {
+			return FALSE;
+		}
+
+		value_end = memchr (p + 1, *p, end - p - 1);
+		if (!value_end) {
+			return FALSE;
+		}
+		p = value_end + 1;
+
+		for (i = 0; i < n_names; i++) {
+			if (strncmp (names[i], key, key_len) == 0 &&
+			    names[i][key_len] == '\0') {
+				break;
+			}
+		}
+
+		if (i == n_names) {
+			/* Not rewritten, copied with the space before it */
+			g_string_append_len (out, attr, p - attr);
+		} else if (!(done & ((guint32) 1 << i))) {
+			done |= (guint32) 1 << i;
+			if (values[i]) {
+				message_node_append_raw_attribute (out, 
+								   names[i],
+								   values[i]);
+			}
+		}
+	}
+
+	/* Attributes the stanza didn't have */
+	for (i = 0; i < n_names; i++) {
+		if (values[i] && !(done & ((guint32) 1 << i))) {
+			message_node_append_raw_attribute (out, names[i], 
+							   values[i]);
+		}
+	}
+
+	g_string_append_len (out, p, end - p);
+
+	return TRUE;
+}
+
 /**
  * lm_message_node_to_string:
  * @node: an #LmMessageNode
@@ -438,64 +1744,22 @@ lm_message_node_unref (LmMessageNode *node)
  * Returns an XML string representing the node. This is what is sent over the
  * wire. This is used internally Loudmouth and is external for debugging 
  * purposes.
+ *
+ * A node that is serialized again without having been changed with the
+ * setters keeps the result, later ones copy it instead of escaping and
+ * formatting the node again.
  * 
  * Return value: an XML string representation of @node
  **/
 gchar *
 lm_message_node_to_string (LmMessageNode *node)
 {
-	GString       *ret;
-	GSList        *l;
-	LmMessageNode *child;
+	GString *ret;
 
 	g_return_val_if_fail (node != NULL, NULL);
 	
-	if (node->name == NULL) {
-		return g_strdup ("");
-	}
-	
-	ret = g_string_new ("<");
-	g_string_append (ret, node->name);
-	
-	for (l = node->attributes; l; l = l->next) {
-		KeyValuePair *kvp = (KeyValuePair *) l->data;
-
-		if (node->raw_mode == FALSE) {
-			gchar *escaped;
-
-			escaped = g_markup_escape_text (kvp->value, -1);
-			g_string_append_printf (ret, " %s=\"%s\"", 
-						kvp->key, escaped);
-			g_free (escaped);
-		} else {
-			g_string_append_printf (ret, " %s=\"%s\"", 
-						kvp->key, kvp->value);
-		}
-		
-	}
-	
-	g_string_append_c (ret, '>');
-	
-	if (node->value) {
-		gchar *tmp;
-
-		if (node->raw_mode == FALSE) {
-			tmp = g_markup_escape_text (node->value, -1);
-			g_string_append (ret,  tmp);
-			g_free (tmp);
-		} else {
-			g_string_append (ret, node->value);
-		}
-	} 
-
-	for (child = node->children; child; child = child->next) {
-		gchar *child_str = lm_message_node_to_string (child);
-		g_string_append_c (ret, ' ');
-		g_string_append (ret, child_str);
-		g_free (child_str);
-	}
-
-	g_string_append_printf (ret, "</%s>\n", node->name);
+	ret = g_string_new (NULL);
+	_lm_message_node_write (node, ret, FALSE);
 	
 	return g_string_free (ret, FALSE);
 }
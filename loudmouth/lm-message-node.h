@@ -40,6 +40,20 @@ G_BEGIN_DECLS
  * @children: pointing to first child
  * 
  * A struct representing a node in a message. 
+ *
+ * The root node of a message received on a connection with lazy parsing
+ * enabled doesn't have its children built until they are asked for, use
+ * lm_message_node_get_children() instead of reading @children directly.
+ *
+ * The sibling and children pointers are for reading only, children are
+ * added with lm_message_node_add_child() and must not be unlinked or 
+ * relinked by hand.
+ *
+ * The nodes below the root of a message made with 
+ * lm_message_clone_shallow() are shared with the message it was copied
+ * from, and their @parent is the node they were first added to. Go 
+ * through lm_message_node_get_children() rather than @children to reach
+ * them, which gives the node children of its own first.
  */
 typedef struct _LmMessageNode LmMessageNode;
 
@@ -54,28 +68,51 @@ struct _LmMessageNode {
         LmMessageNode     *children;
 
 	/* < private > */
-	GSList     *attributes;
-	gint        ref_count;
+	/* Ordered to leave no padding, the fields used when building 
+	 * and walking the tree come first */
+	LmMessageNode     *last_child;
+	/* What the shared children are children of, kept alive so that 
+	 * their parent pointer stays valid */
+	LmMessageNode     *children_owner;
+	/* In the order they were set */
+	struct _LmMessageNodeAttribute *attributes;
+	struct _LmArena   *arena;
+	/* Content not parsed yet, see lm_parser_set_lazy() */
+	gchar             *unparsed;
+	/* Kept serialized form of the node */
+	struct _LmMessageNodeWire *wire;
+	gint               ref_count;
+	guint16            flags;
+	guint16            n_attributes;
 };
 
 const gchar *  lm_message_node_get_value      (LmMessageNode *node);
 void           lm_message_node_set_value      (LmMessageNode *node,
 					       const gchar   *value);
+void           lm_message_node_set_value_static (LmMessageNode *node,
+					       const gchar   *value);
 LmMessageNode *lm_message_node_add_child      (LmMessageNode *node,
 					       const gchar   *name,
 					       const gchar   *value);
+LmMessageNode *lm_message_node_add_child_static (LmMessageNode *node,
+					       const gchar   *name,
+					       const gchar   *value);
 void           lm_message_node_set_attributes (LmMessageNode *node,
 					       const gchar   *name,
 					       ...);
 void           lm_message_node_set_attribute  (LmMessageNode *node,
 					       const gchar   *name,
 					       const gchar   *value);
+void           lm_message_node_set_attribute_static (LmMessageNode *node,
+					       const gchar   *name,
+					       const gchar   *value);
 const gchar *  lm_message_node_get_attribute  (LmMessageNode *node,
 					       const gchar   *name);
 LmMessageNode *lm_message_node_get_child      (LmMessageNode *node,
 					       const gchar   *child_name);
 LmMessageNode *lm_message_node_find_child     (LmMessageNode *node,
 					       const gchar   *child_name);
+LmMessageNode *lm_message_node_get_children   (LmMessageNode *node);
 gboolean       lm_message_node_get_raw_mode   (LmMessageNode *node);
 void           lm_message_node_set_raw_mode   (LmMessageNode *node,
 					       gboolean       raw_mode);
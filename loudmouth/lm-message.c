@@ -43,8 +43,8 @@ static struct TypeNames
 	{ LM_MESSAGE_TYPE_PRESENCE,        "presence"        },
 	{ LM_MESSAGE_TYPE_IQ,              "iq"              },
 	{ LM_MESSAGE_TYPE_STREAM,          "stream:stream"   },
-	{ LM_MESSAGE_TYPE_STREAM_FEATURES, "stream:features" },
 	{ LM_MESSAGE_TYPE_STREAM_ERROR,    "stream:error"    },
+	{ LM_MESSAGE_TYPE_STREAM_FEATURES, "stream:features" },
 	{ LM_MESSAGE_TYPE_AUTH,            "auth"            },
 	{ LM_MESSAGE_TYPE_CHALLENGE,       "challenge"       },
 	{ LM_MESSAGE_TYPE_RESPONSE,        "response"        },
@@ -79,27 +79,70 @@ static struct SubTypeNames
 struct LmMessagePriv {
 	LmMessageType    type;
 	LmMessageSubType sub_type;
+	/* The stanza as received, in the arena of the root node */
+	const gchar     *raw_stanza;
+	gsize            raw_stanza_len;
+	/* Where the message comes from, %NULL for the slab allocator */
+	const LmAllocator *allocator;
 	gint             ref_count;
 };
 
-static LmMessageType
-message_type_from_string (const gchar *type_str)
+/* The message and its private part are one allocation */
+typedef struct {
+	LmMessage     message;
+	LmMessagePriv priv;
+} MessageBlock;
+
+static LmMessage *
+message_new (const LmAllocator *allocator,
+	     LmMessageType      type, 
+	     LmMessageSubType   sub_type)
 {
-        gint i;
+	MessageBlock *block;
+
+	if (allocator) {
+		block = _lm_allocator_alloc (allocator, sizeof (MessageBlock));
+		if (G_UNLIKELY (!block)) {
+			return NULL;
+		}
+
+		memset (block, 0, sizeof (MessageBlock));
+	} else {
+		block = _lm_alloc_new0 (LM_ALLOC_MESSAGE, sizeof (MessageBlock));
+	}
+	block->message.priv = &block->priv;
+
+	block->priv.allocator = allocator;
+
+	block->priv.ref_count = 1;
+	block->priv.type      = type;
+	block->priv.sub_type  = sub_type;
+
+	return &block->message;
+}
+
+LmMessageType
+_lm_message_type_from_string (const gchar *type_str)
+{
+        const gchar *interned;
+        guint        id;
 
         if (!type_str) {
                 return LM_MESSAGE_TYPE_UNKNOWN;
         }
 
-        for (i = LM_MESSAGE_TYPE_MESSAGE;
-	     i < LM_MESSAGE_TYPE_UNKNOWN;
-	     ++i) {
-                if (strcmp (type_str, type_names[i].name) == 0) {
-                        return type_names[i].type;
-                }
+        /* The stanza names are interned in LmMessageType order */
+        interned = lm_intern_lookup (type_str, -1);
+        if (!interned) {
+                return LM_MESSAGE_TYPE_UNKNOWN;
         }
 
-        return LM_MESSAGE_TYPE_UNKNOWN;
+        id = lm_intern_get_id (interned);
+        if (id < LM_INTERN_MESSAGE || id > LM_INTERN_STARTTLS) {
+                return LM_MESSAGE_TYPE_UNKNOWN;
+        }
+
+        return LM_MESSAGE_TYPE_MESSAGE + (id - LM_INTERN_MESSAGE);
 }
 
 
@@ -117,12 +160,25 @@ _lm_message_type_to_string (LmMessageType type)
 static LmMessageSubType
 message_sub_type_from_string (const gchar *type_str)
 {
-        gint i;
+        const gchar *interned;
+        gint         i;
 
         if (!type_str) {
                 return LM_MESSAGE_SUB_TYPE_NOT_SET;
         }
 
+        /* The sub types are interned in LmMessageSubType order */
+        interned = lm_intern_lookup (type_str, -1);
+        if (interned) {
+                guint id = lm_intern_get_id (interned);
+
+                if (id >= LM_INTERN_NORMAL && id <= LM_INTERN_ERROR) {
+                        return LM_MESSAGE_SUB_TYPE_NORMAL + 
+                                (id - LM_INTERN_NORMAL);
+                }
+        }
+
+        /* Types in another case are accepted as well */
         for (i = LM_MESSAGE_SUB_TYPE_NORMAL;
 	     i <= LM_MESSAGE_SUB_TYPE_ERROR;
 	     ++i) {
@@ -171,15 +227,17 @@ message_sub_type_when_unset (LmMessageType type) {
 	return sub_type;
 }
 
+/* Returns %NULL if @node isn't a known stanza or if @allocator fails */
 LmMessage *
-_lm_message_new_from_node (LmMessageNode *node)
+_lm_message_new_from_node (const LmAllocator *allocator, 
+			   LmMessageNode     *node)
 {
 	LmMessage        *m;
 	LmMessageType     type;
 	LmMessageSubType  sub_type;
 	const gchar      *sub_type_str;
 	
-	type = message_type_from_string (node->name);
+	type = _lm_message_type_from_string (node->name);
 
 	if (type == LM_MESSAGE_TYPE_UNKNOWN) {
 		return NULL;
@@ -192,18 +250,26 @@ _lm_message_new_from_node (LmMessageNode *node)
 		sub_type = message_sub_type_when_unset (type);
 	}
 
-	m = g_new0 (LmMessage, 1);
-	m->priv = g_new0 (LmMessagePriv, 1);
-	
-	PRIV(m)->ref_count = 1;
-	PRIV(m)->type = type;
-	PRIV(m)->sub_type = sub_type;
-	
+	m = message_new (allocator, type, sub_type);
+	if (G_UNLIKELY (!m)) {
+		return NULL;
+	}
+
 	m->node = lm_message_node_ref (node);
 	
 	return m;
 }
 
+/* @str is owned by the root node of @message and kept alive by it */
+void
+_lm_message_set_raw_stanza (LmMessage   *message,
+			    const gchar *str,
+			    gsize        len)
+{
+	PRIV(message)->raw_stanza = str;
+	PRIV(message)->raw_stanza_len = len;
+}
+
 /**
  * lm_message_new:
  * @to: receipient jid
@@ -220,27 +286,21 @@ LmMessage *
 lm_message_new (const gchar *to, LmMessageType type)
 {
 	LmMessage *m;
-	gchar     *id;
+	gchar      id[LM_ID_SIZE];
 
-	m       = g_new0 (LmMessage, 1);
-	m->priv = g_new0 (LmMessagePriv, 1);
-
-	PRIV(m)->ref_count = 1;
-	PRIV(m)->type      = type;
-	PRIV(m)->sub_type  = message_sub_type_when_unset (type);
+	m = message_new (NULL, type, message_sub_type_when_unset (type));
 	
-	m->node = _lm_message_node_new (_lm_message_type_to_string (type));
+	m->node = _lm_message_node_new_static (_lm_message_type_to_string (type));
 
-	id = _lm_utils_generate_id ();
-	lm_message_node_set_attribute (m->node, "id", id);
-	g_free (id);
+	lm_message_node_set_attribute (m->node, "id", 
+				       _lm_utils_generate_id (id));
 	
 	if (to) {
 		lm_message_node_set_attribute (m->node, "to", to);
 	}
 
 	if (type == LM_MESSAGE_TYPE_IQ) {
-		lm_message_node_set_attribute (m->node, "type", "get");
+		lm_message_node_set_attribute_static (m->node, "type", "get");
 	}
 	
 	return m;
@@ -270,8 +330,8 @@ lm_message_new_with_sub_type (const gchar      *to,
 	type_str = _lm_message_sub_type_to_string (sub_type);
 
 	if (type_str) {
-		lm_message_node_set_attributes (m->node,
-						"type", type_str, NULL);
+		lm_message_node_set_attribute_static (m->node, 
+						      "type", type_str);
 		PRIV(m)->sub_type = sub_type;
 	}
 
@@ -326,6 +386,65 @@ lm_message_get_node (LmMessage *message)
 	return message->node;
 }
 
+/**
+ * lm_message_get_raw_stanza:
+ * @message: an #LmMessage
+ * @len: return location for the length of the stanza, or %NULL
+ * 
+ * Retrieves the bytes @message was parsed from, exactly as they were 
+ * received. They are only kept for messages received on a connection 
+ * with lm_connection_set_keep_raw_stanzas() set, and can be sent on as
+ * they are with lm_connection_send_raw_stanza(). Changing the nodes of
+ * @message doesn't change them.
+ * 
+ * Return value: the received stanza, or %NULL if it wasn't kept. It is
+ * owned by @message.
+ **/
+const gchar *
+lm_message_get_raw_stanza (LmMessage *message, gsize *len)
+{
+	g_return_val_if_fail (message != NULL, NULL);
+
+	if (len) {
+		*len = PRIV(message)->raw_stanza_len;
+	}
+
+	return PRIV(message)->raw_stanza;
+}
+
+/**
+ * lm_message_clone_shallow:
+ * @message: an #LmMessage
+ * 
+ * Creates a copy of @message for sending the same stanza to many 
+ * recipients. Only the root node is copied, all nodes below it are 
+ * shared between @message and the copy until they are asked for with
+ * lm_message_node_get_child(), lm_message_node_find_child(), 
+ * lm_message_node_get_children() or lm_message_node_add_child(), which
+ * copy the nodes on the way to what they return. A search that finds 
+ * nothing copies nothing. Shared nodes are serialized once and that is
+ * reused for each copy, so changing the attributes of the root node is
+ * cheap.
+ *
+ * Nodes fetched from @message before it was copied are shared, changes
+ * made through them show in both messages. The same goes for nodes
+ * reached through the children field of the copy, see #LmMessageNode.
+ * 
+ * Return value: a newly created #LmMessage
+ **/
+LmMessage *
+lm_message_clone_shallow (LmMessage *message)
+{
+	LmMessage *m;
+
+	g_return_val_if_fail (message != NULL, NULL);
+
+	m = message_new (NULL, PRIV(message)->type, PRIV(message)->sub_type);
+	m->node = _lm_message_node_clone_shallow (message->node);
+
+	return m;
+}
+
 /**
  * lm_message_ref:
  * @message: an #LmMessage
@@ -359,8 +478,15 @@ lm_message_unref (LmMessage *message)
 	PRIV(message)->ref_count--;
 	
 	if (PRIV(message)->ref_count == 0) {
+		const LmAllocator *allocator = PRIV(message)->allocator;
+
 		lm_message_node_unref (message->node);
-		g_free (message->priv);
-		g_free (message);
+		if (allocator) {
+			_lm_allocator_free (allocator, message, 
+					    sizeof (MessageBlock));
+		} else {
+			_lm_alloc_free (LM_ALLOC_MESSAGE, sizeof (MessageBlock),
+					message);
+		}
 	}
 }
@@ -112,6 +112,9 @@ LmMessage *      lm_message_new_with_sub_type (const gchar      *to,
 LmMessageType    lm_message_get_type          (LmMessage        *message);
 LmMessageSubType lm_message_get_sub_type      (LmMessage        *message);
 LmMessageNode *  lm_message_get_node          (LmMessage        *message);
+const gchar *    lm_message_get_raw_stanza    (LmMessage        *message,
+					       gsize            *len);
+LmMessage *      lm_message_clone_shallow     (LmMessage        *message);
 LmMessage *      lm_message_ref               (LmMessage        *message);
 void             lm_message_unref             (LmMessage        *message);
 
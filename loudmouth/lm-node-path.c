@@ -0,0 +1,520 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2003 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:lm-node-path
+ * @Title: LmNodePath
+ * @Short_description: Compiled queries on message nodes
+ *
+ * An #LmNodePath selects nodes below an #LmMessageNode with a small
+ * subset of XPath. The expression is compiled once with
+ * lm_node_path_new() and can then be run against any number of nodes
+ * without allocating memory.
+ *
+ * A path is a list of steps separated by '/', each step selects the
+ * children of the nodes matched by the previous one. A step is an
+ * element name or '*' for any element, followed by any number of
+ * predicates: [@key] requires the attribute to be set and
+ * [@key='value'] requires it to have that value. The path can end with
+ * @key to select that attribute of the matched nodes. For example
+ * <literal>query[@xmlns='jabber:iq:roster']/item/@jid</literal> run
+ * against an iq stanza gives the jid of each roster item.
+ */
+
+#include <config.h>
+#include <string.h>
+
+#include "lm-internals.h"
+#include "lm-error.h"
+#include "lm-node-path.h"
+
+typedef struct {
+	gchar       *key;
+	const gchar *interned_key;
+	/* %NULL if the attribute only has to be set */
+	gchar       *value;
+} NodePathPredicate;
+
+typedef struct {
+	/* %NULL for any element */
+	gchar       *name;
+	const gchar *interned_name;
+	guint        first_predicate;
+	guint        n_predicates;
+} NodePathStep;
+
+struct _LmNodePath {
+	NodePathStep      *steps;
+	guint              n_steps;
+	NodePathPredicate *predicates;
+	guint              n_predicates;
+	/* Selected attribute or %NULL to select the nodes */
+	gchar             *attribute;
+	const gchar       *interned_attribute;
+
+	gint               ref_count;
+};
+
+static void
+node_path_free (LmNodePath *path)
+{
+	guint i;
+
+	for (i = 0; i < path->n_steps; i++) {
+		g_free (path->steps[i].name);
+	}
+
+	for (i = 0; i < path->n_predicates; i++) {
+		g_free (path->predicates[i].key);
+		g_free (path->predicates[i].value);
+	}
+
+	g_free (path->steps);
+	g_free (path->predicates);
+	g_free (path->attribute);
+	g_free (path);
+}
+
+static gboolean
+node_path_is_name_char (gchar c)
+{
+	return c != '\0' && strchr ("/[]@='\"* \t\r\n", c) == NULL;
+}
+
+/* Returns a copy of the name at *@p and moves past it, or %NULL if
+ * there is no name there. Names are interned so that matching can
+ * compare them by pointer. */
+static gchar *
+node_path_parse_name (const gchar **p, const gchar **interned)
+{
+	const gchar *start = *p;
+	gchar       *name;
+
+	while (node_path_is_name_char (**p)) {
+		(*p)++;
+	}
+
+	if (*p == start) {
+		return NULL;
+	}
+
+	name = g_strndup (start, *p - start);
+	*interned = lm_intern_string (name, -1);
+
+	return name;
+}
+
+static gboolean
+node_path_parse_predicate (const gchar      **p,
+			   NodePathPredicate *pred,
+			   const gchar      **error_msg)
+{
+	const gchar *end;
+	gchar        quote;
+
+	if (**p != '@') {
+		*error_msg = "expected '@' in predicate";
+		return FALSE;
+	}
+	(*p)++;
+
+	pred->key = node_path_parse_name (p, &pred->interned_key);
+	if (!pred->key) {
+		*error_msg = "expected attribute name";
+		return FALSE;
+	}
+
+	if (**p == '=') {
+		(*p)++;
+
+		quote = **p;
+		if (quote != '\'' && quote != '"') {
+			*error_msg = "expected quoted value";
+			return FALSE;
+		}
+		(*p)++;
+
+		end = strchr (*p, quote);
+		if (!end) {
+			*error_msg = "unterminated value";
+			return FALSE;
+		}
+
+		pred->value = g_strndup (*p, end - *p);
+		*p = end + 1;
+	}
+
+	if (**p != ']') {
+		*error_msg = "expected ']'";
+		return FALSE;
+	}
+	(*p)++;
+
+	return TRUE;
+}
+
+/**
+ * lm_node_path_new:
+ * @path: the path expression
+ * @error: location to store error, or %NULL
+ *
+ * Compiles @path, see the description above for the syntax.
+ *
+ * Return value: a newly created #LmNodePath or %NULL if @path isn't
+ * valid
+ **/
+LmNodePath *
+lm_node_path_new (const gchar *path, GError **error)
+{
+	LmNodePath  *node_path;
+	GArray      *steps;
+	GArray      *predicates;
+	const gchar *p = path;
+	const gchar *error_msg = NULL;
+
+	g_return_val_if_fail (path != NULL, NULL);
+
+	node_path = g_new0 (LmNodePath, 1);
+	node_path->ref_count = 1;
+
+	steps = g_array_new (FALSE, TRUE, sizeof (NodePathStep));
+	predicates = g_array_new (FALSE, TRUE, sizeof (NodePathPredicate));
+
+	while (TRUE) {
+		NodePathStep step = { NULL, NULL, 0, 0 };
+
+		if (*p == '@') {
+			p++;
+			node_path->attribute =
+				node_path_parse_name (&p,
+						      &node_path->interned_attribute);
+			if (!node_path->attribute) {
+				error_msg = "expected attribute name";
+			} else if (*p != '\0') {
+				error_msg = "attribute must be last";
+			}
+			break;
+		}
+
+		if (*p == '*') {
+			p++;
+		} else {
+			step.name = node_path_parse_name (&p, &step.interned_name);
+			if (!step.name) {
+				error_msg = "expected element name";
+				break;
+			}
+		}
+
+		step.first_predicate = predicates->len;
+		g_array_append_val (steps, step);
+
+		while (*p == '[') {
+			NodePathPredicate pred = { NULL, NULL, NULL };
+
+			p++;
+			if (!node_path_parse_predicate (&p, &pred, &error_msg)) {
+				g_free (pred.key);
+				g_free (pred.value);
+				break;
+			}
+
+			g_array_append_val (predicates, pred);
+			g_array_index (steps, NodePathStep,
+				       steps->len - 1).n_predicates++;
+		}
+
+		if (error_msg || *p == '\0') {
+			break;
+		}
+
+		if (*p != '/') {
+			error_msg = "expected '/'";
+			break;
+		}
+		p++;
+	}
+
+	node_path->n_steps = steps->len;
+	node_path->steps = (NodePathStep *) g_array_free (steps, FALSE);
+	node_path->n_predicates = predicates->len;
+	node_path->predicates =
+		(NodePathPredicate *) g_array_free (predicates, FALSE);
+
+	if (error_msg) {
+		g_set_error (error, LM_ERROR, LM_ERROR_INVALID_PATH,
+			     "Invalid path '%s' at offset %d: %s",
+			     path, (gint) (p - path), error_msg);
+		node_path_free (node_path);
+		return NULL;
+	}
+
+	return node_path;
+}
+
+/**
+ * lm_node_path_ref:
+ * @path: an #LmNodePath
+ *
+ * Adds a reference to @path.
+ *
+ * Return value: the node path
+ **/
+LmNodePath *
+lm_node_path_ref (LmNodePath *path)
+{
+	g_return_val_if_fail (path != NULL, NULL);
+
+	path->ref_count++;
+
+	return path;
+}
+
+/**
+ * lm_node_path_unref:
+ * @path: an #LmNodePath
+ *
+ * Removes a reference from @path. When no more references are present
+ * the node path is freed.
+ **/
+void
+lm_node_path_unref (LmNodePath *path)
+{
+	g_return_if_fail (path != NULL);
+
+	path->ref_count--;
+
+	if (path->ref_count == 0) {
+		node_path_free (path);
+	}
+}
+
+static gboolean
+node_path_step_matches (LmNodePath         *path,
+			const NodePathStep *step,
+			LmMessageNode      *node)
+{
+	const NodePathPredicate *pred;
+	const NodePathPredicate *end;
+
+	if (step->name &&
+	    !_lm_message_node_name_equal (node, step->name,
+					  step->interned_name)) {
+		return FALSE;
+	}
+
+	pred = path->predicates + step->first_predicate;
+	end = pred + step->n_predicates;
+
+	for (; pred < end; pred++) {
+		const gchar *value;
+
+		value = _lm_message_node_lookup_attribute (node, pred->key,
+							   pred->interned_key);
+		if (!value) {
+			return FALSE;
+		}
+
+		if (pred->value && strcmp (value, pred->value) != 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Nodes matching all the steps only count if they have the selected
+ * attribute */
+static gboolean
+node_path_accept (LmNodePath *path, LmMessageNode *node, const gchar **value)
+{
+	const gchar *str;
+
+	if (path->attribute) {
+		str = _lm_message_node_lookup_attribute (node,
+							 path->attribute,
+							 path->interned_attribute);
+		if (!str) {
+			return FALSE;
+		}
+	} else {
+		str = node->value;
+	}
+
+	if (value) {
+		*value = str;
+	}
+
+	return TRUE;
+}
+
+/**
+ * lm_node_path_iter_init:
+ * @iter: an uninitialized #LmNodePathIter
+ * @path: an #LmNodePath
+ * @node: the node to run @path against
+ *
+ * Sets up @iter to go through the nodes below @node that match @path
+ * with lm_node_path_iter_next(). Neither @path nor the tree of @node
+ * may change while @iter is in use.
+ **/
+void
+lm_node_path_iter_init (LmNodePathIter *iter,
+			LmNodePath     *path,
+			LmMessageNode  *node)
+{
+	g_return_if_fail (iter != NULL);
+	g_return_if_fail (path != NULL);
+	g_return_if_fail (node != NULL);
+
+	iter->path = path;
+	iter->root = node;
+	iter->node = NULL;
+	iter->done = FALSE;
+}
+
+/**
+ * lm_node_path_iter_next:
+ * @iter: an #LmNodePathIter
+ * @value: location to store the value of the match, or %NULL
+ *
+ * Moves @iter to the next match in document order. @value is set to
+ * the selected attribute if the path ends with one, otherwise to the
+ * value of the matched node.
+ *
+ * Return value: the matched node or %NULL if there are no more matches
+ **/
+LmMessageNode *
+lm_node_path_iter_next (LmNodePathIter *iter, const gchar **value)
+{
+	LmNodePath    *path;
+	LmMessageNode *parent;
+	LmMessageNode *l;
+	guint          depth;
+
+	g_return_val_if_fail (iter != NULL, NULL);
+
+	if (iter->done) {
+		return NULL;
+	}
+
+	path = iter->path;
+
+	if (path->n_steps == 0) {
+		iter->done = TRUE;
+		return node_path_accept (path, iter->root, value) ?
+			iter->root : NULL;
+	}
+
+	/* Matches are always at the last step, the nodes matched by the
+	 * earlier steps are found again through the parent pointers so
+	 * the iterator needs no stack */
+	if (iter->node) {
+		parent = iter->node->parent;
+		l = iter->node->next;
+		depth = path->n_steps - 1;
+	} else {
+		parent = iter->root;
+		l = lm_message_node_get_children (parent);
+		depth = 0;
+	}
+
+	while (TRUE) {
+		if (!l) {
+			if (depth == 0) {
+				break;
+			}
+
+			l = parent->next;
+			parent = parent->parent;
+			depth--;
+			continue;
+		}
+
+		if (node_path_step_matches (path, &path->steps[depth], l)) {
+			if (depth + 1 < path->n_steps) {
+				parent = l;
+				l = lm_message_node_get_children (l);
+				depth++;
+				continue;
+			}
+
+			if (node_path_accept (path, l, value)) {
+				iter->node = l;
+				return l;
+			}
+		}
+
+		l = l->next;
+	}
+
+	iter->node = NULL;
+	iter->done = TRUE;
+
+	return NULL;
+}
+
+/**
+ * lm_node_path_find:
+ * @path: an #LmNodePath
+ * @node: the node to run @path against
+ *
+ * Finds the first node below @node that matches @path.
+ *
+ * Return value: the matched node or %NULL if there is none
+ **/
+LmMessageNode *
+lm_node_path_find (LmNodePath *path, LmMessageNode *node)
+{
+	LmNodePathIter iter;
+
+	g_return_val_if_fail (path != NULL, NULL);
+	g_return_val_if_fail (node != NULL, NULL);
+
+	lm_node_path_iter_init (&iter, path, node);
+
+	return lm_node_path_iter_next (&iter, NULL);
+}
+
+/**
+ * lm_node_path_get_value:
+ * @path: an #LmNodePath
+ * @node: the node to run @path against
+ *
+ * Fetches the value of the first match of @path below @node, see
+ * lm_node_path_iter_next().
+ *
+ * Return value: the value or %NULL if there is no match or it has no
+ * value
+ **/
+const gchar *
+lm_node_path_get_value (LmNodePath *path, LmMessageNode *node)
+{
+	LmNodePathIter  iter;
+	const gchar    *value = NULL;
+
+	g_return_val_if_fail (path != NULL, NULL);
+	g_return_val_if_fail (node != NULL, NULL);
+
+	lm_node_path_iter_init (&iter, path, node);
+	lm_node_path_iter_next (&iter, &value);
+
+	return value;
+}
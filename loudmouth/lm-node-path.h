@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2003 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_NODE_PATH_H__
+#define __LM_NODE_PATH_H__
+
+#if !defined (LM_INSIDE_LOUDMOUTH_H) && !defined (LM_COMPILATION)
+#error "Only <loudmouth/loudmouth.h> can be included directly, this file may disappear or change contents."
+#endif
+
+#include <loudmouth/lm-message-node.h>
+
+G_BEGIN_DECLS
+
+/**
+ * LmNodePath:
+ *
+ * A compiled path expression, see lm_node_path_new().
+ */
+typedef struct _LmNodePath LmNodePath;
+
+/**
+ * LmNodePathIter:
+ *
+ * Iterates over the matches of an #LmNodePath. It is usually allocated on
+ * the stack and set up with lm_node_path_iter_init(), the fields are
+ * private.
+ */
+typedef struct {
+	/* < private > */
+	LmNodePath    *path;
+	LmMessageNode *root;
+	LmMessageNode *node;
+	gboolean       done;
+} LmNodePathIter;
+
+LmNodePath *    lm_node_path_new        (const gchar     *path,
+					 GError         **error);
+LmNodePath *    lm_node_path_ref        (LmNodePath      *path);
+void            lm_node_path_unref      (LmNodePath      *path);
+LmMessageNode * lm_node_path_find       (LmNodePath      *path,
+					 LmMessageNode   *node);
+const gchar *   lm_node_path_get_value  (LmNodePath      *path,
+					 LmMessageNode   *node);
+void            lm_node_path_iter_init  (LmNodePathIter  *iter,
+					 LmNodePath      *path,
+					 LmMessageNode   *node);
+LmMessageNode * lm_node_path_iter_next  (LmNodePathIter  *iter,
+					 const gchar    **value);
+
+G_END_DECLS
+
+#endif /* __LM_NODE_PATH_H__ */
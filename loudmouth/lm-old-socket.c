@@ -83,7 +83,12 @@ struct _LmOldSocket {
 	gboolean      cancel_open;
 	
 	GSource      *watch_out;
-	GString      *out_buf;
+	/* Output that couldn't be written yet, from the allocator of the
+	 * connection */
+	const LmAllocator *allocator;
+	gchar        *out_buf;
+	gsize         out_len;
+	gsize         out_size;
 
 	LmConnectData *connect_data;
 
@@ -122,10 +127,10 @@ static gboolean     socket_buffered_write_cb  (GIOChannel     *source,
 					       GIOCondition    condition,
 					       LmOldSocket       *socket);
 static void         socket_close_io_channel   (GIOChannel     *io_channel);
-static gboolean     old_socket_output_is_buffered    (LmOldSocket       *socket,
+static gboolean     old_socket_append_output         (LmOldSocket       *socket,
                                                       const gchar    *buffer,
-                                                      gint            len);
-static void         old_socket_setup_output_buffer   (LmOldSocket       *socket,
+                                                      gsize           len);
+static gboolean     old_socket_setup_output_buffer   (LmOldSocket       *socket,
                                                       const gchar    *buffer,
                                                       gint            len);
 
@@ -143,9 +148,8 @@ socket_free (LmOldSocket *socket)
 		lm_proxy_unref (socket->proxy);
 	}
 	
-	if (socket->out_buf) {
-		g_string_free (socket->out_buf, TRUE);
-	}
+	_lm_allocator_free (socket->allocator, socket->out_buf, 
+			    socket->out_size);
 
         if (socket->resolver) {
                 g_object_unref (socket->resolver);
@@ -187,16 +191,22 @@ lm_old_socket_write (LmOldSocket *socket, const gchar *buf, gint len)
 {
 	gint b_written;
 
-	if (old_socket_output_is_buffered (socket, buf, len)) {
+	if (socket->out_len > 0) {
+		lm_verbose ("Appending %d bytes to output buffer\n", len);
+		if (!old_socket_append_output (socket, buf, len)) {
+			return -1;
+		}
                 return len;
         }
 
         b_written = old_socket_do_write (socket, buf, len);
 
         if (b_written < len && b_written != -1) {
-                old_socket_setup_output_buffer (socket,
-                                                buf + b_written,
-                                                len - b_written);
+                if (!old_socket_setup_output_buffer (socket,
+                                                     buf + b_written,
+                                                     len - b_written)) {
+			return -1;
+		}
                 return len;
         }
         
@@ -217,10 +227,10 @@ socket_read_incoming (LmOldSocket *socket,
 
 	if (socket->ssl_started) {
 		status = _lm_ssl_read (socket->ssl, 
-				       buf, buf_size - 1, bytes_read);
+				       buf, buf_size, bytes_read);
 	} else {
 		status = g_io_channel_read_chars (socket->io_channel,
-						  buf, buf_size - 1,
+						  buf, buf_size,
 						  bytes_read,
 						  NULL);
 	}
@@ -247,8 +257,6 @@ socket_read_incoming (LmOldSocket *socket,
 		return FALSE;
 	}
 
-	buf[*bytes_read] = '\0';
-
 	/* There is more data to be read */
 	return TRUE;
 }
@@ -261,6 +269,7 @@ socket_in_event (GIOChannel   *source,
 	gchar     buf[IN_BUFFER_SIZE];
 	gsize     bytes_read = 0;
 	gboolean  read_anything = FALSE;
+	gboolean  closed;
 	gboolean  hangup = 0;
 	gint      reason = 0;
 
@@ -275,13 +284,24 @@ socket_in_event (GIOChannel   *source,
 		       (int)bytes_read);
 		g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, 
 		       "-----------------------------------\n");
-		g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "'%s'\n", buf);
+		g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "'%.*s'\n", 
+		       (int)bytes_read, buf);
 		g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, 
 		       "-----------------------------------\n");
 		
 		lm_verbose ("Read: %d chars\n", (int)bytes_read);
 
-		(socket->data_func) (socket, buf, socket->user_data);
+		/* The callback may close the connection and drop its 
+		 * reference to us, e.g. on a parse error */
+		lm_old_socket_ref (socket);
+		(socket->data_func) (socket, buf, bytes_read, 
+				     socket->user_data);
+		closed = socket->io_channel == NULL;
+		lm_old_socket_unref (socket);
+
+		if (closed) {
+			return FALSE;
+		}
 
 		read_anything = TRUE;
 
@@ -684,26 +704,45 @@ socket_do_connect (LmConnectData *connect_data)
 	return TRUE;
 }
 
+/* Returns %FALSE if the allocator of the connection ran out of memory.
+ * A stanza cut short would break the stream, so the socket is shut down
+ * then and the connection closes once the read side sees that. */
 static gboolean
-old_socket_output_is_buffered (LmOldSocket     *socket,
-			       const gchar  *buffer,
-			       gint          len)
+old_socket_append_output (LmOldSocket *socket, const gchar *buffer, gsize len)
 {
-	if (socket->out_buf) {
-		lm_verbose ("Appending %d bytes to output buffer\n", len);
-		g_string_append_len (socket->out_buf, buffer, len);
-		return TRUE;
+	if (socket->out_len + len > socket->out_size) {
+		gsize  size = MAX (socket->out_size * 2, socket->out_len + len);
+		gchar *out_buf;
+
+		out_buf = _lm_allocator_realloc (socket->allocator,
+						 socket->out_buf,
+						 socket->out_size,
+						 size);
+		if (G_UNLIKELY (!out_buf)) {
+			lm_verbose ("Out of memory for the output buffer, "
+				    "shutting down\n");
+			_lm_sock_shutdown (socket->fd);
+			return FALSE;
+		}
+
+		socket->out_buf = out_buf;
+		socket->out_size = size;
 	}
 
-	return FALSE;
+	memcpy (socket->out_buf + socket->out_len, buffer, len);
+	socket->out_len += len;
+
+	return TRUE;
 }
 
-static void
+static gboolean
 old_socket_setup_output_buffer (LmOldSocket *socket, const gchar *buffer, gint len)
 {
 	lm_verbose ("OUTPUT BUFFER ENABLED\n");
 
-	socket->out_buf = g_string_new_len (buffer, len);
+	if (!old_socket_append_output (socket, buffer, len)) {
+		return FALSE;
+	}
 
 	socket->watch_out =
 		lm_misc_add_io_watch (socket->context,
@@ -711,6 +750,8 @@ old_socket_setup_output_buffer (LmOldSocket *socket, const gchar *buffer, gint l
 				      G_IO_OUT,
 				      (GIOFunc) socket_buffered_write_cb,
 				      socket);
+
+	return TRUE;
 }
 
 static gboolean
@@ -719,16 +760,15 @@ socket_buffered_write_cb (GIOChannel   *source,
 			  LmOldSocket     *socket)
 {
 	gint     b_written;
-	GString *out_buf;
 	/* FIXME: Do the writing */
 
-	out_buf = socket->out_buf;
-	if (!out_buf) {
+	if (socket->out_len == 0) {
 		/* Should not be possible */
 		return FALSE;
 	}
 
-	b_written = old_socket_do_write (socket, out_buf->str, out_buf->len);
+	b_written = old_socket_do_write (socket, socket->out_buf, 
+					 socket->out_len);
 
 	if (b_written < 0) {
 		(socket->closed_func) (socket, LM_DISCONNECT_REASON_ERROR, 
@@ -736,8 +776,10 @@ socket_buffered_write_cb (GIOChannel   *source,
 		return FALSE;
 	}
 
-	g_string_erase (out_buf, 0, (gsize) b_written);
-	if (out_buf->len == 0) {
+	socket->out_len -= b_written;
+	memmove (socket->out_buf, socket->out_buf + b_written, 
+		 socket->out_len);
+	if (socket->out_len == 0) {
 		lm_verbose ("Output buffer is empty, going back to normal output\n");
 
 		if (socket->watch_out) {
@@ -745,8 +787,12 @@ socket_buffered_write_cb (GIOChannel   *source,
 			socket->watch_out = NULL;
 		}
 
-		g_string_free (out_buf, TRUE);
+		/* Output rarely backs up, don't keep the memory for it */
+		_lm_allocator_free (socket->allocator, socket->out_buf, 
+				    socket->out_size);
 		socket->out_buf = NULL;
+		socket->out_size = 0;
+
 		return FALSE;
 	}
 
@@ -858,6 +904,7 @@ lm_old_socket_create (GMainContext      *context,
 	socket->ref_count = 1;
 
 	socket->connection = connection;
+	socket->allocator = lm_connection_get_allocator (connection);
 	socket->domain = g_strdup (domain);
 	socket->server = g_strdup (server);
 	socket->port = port;
@@ -29,6 +29,7 @@ typedef struct _LmOldSocket LmOldSocket;
 
 typedef void    (* IncomingDataFunc)  (LmOldSocket         *socket,
 				       const gchar         *buf,
+				       gsize                len,
 				       gpointer             user_data);
 
 typedef void    (* SocketClosedFunc)  (LmOldSocket         *socket,
@@ -27,12 +27,48 @@
 #include "lm-internals.h"
 #include "lm-message-node.h"
 #include "lm-parser.h"
+#include "lm-scan.h"
 
 #define SHORT_END_TAG "/>"
 #define XML_MAX_DEPTH 5
 
 #define LM_PARSER(o) ((LmParser *) o)
 
+/* The parser is a small incremental XML tokenizer tailored for XMPP
+ * streams. Tokens are handed on as (pointer, length) spans into the
+ * buffer that was passed to lm_parser_parse_len(). Only a token that is
+ * split between two reads is copied, into parser->pending, and is
+ * completed when the next chunk arrives.
+ */
+
+typedef enum {
+	PARSER_STATUS_OK,
+	PARSER_STATUS_INCOMPLETE,
+	PARSER_STATUS_ERROR
+} ParserStatus;
+
+typedef struct {
+	const gchar *name;
+	gsize        name_len;
+	const gchar *value;
+	gsize        value_len;
+	gchar       *decoded;
+} ParserAttribute;
+
+/* Growable buffer taking its memory from the allocator of the parser,
+ * the bytes aren't nul terminated */
+typedef struct {
+	gchar       *str;
+	gsize        len;
+	gsize        size;
+} ParserBuffer;
+
+typedef struct {
+	gsize        name_len;
+	/* Where the text of the element starts in LmParser::text */
+	gsize        text_start;
+} OpenElement;
+
 struct LmParser {
 	LmParserMessageFunction  function;
 	gpointer                 user_data;
@@ -40,171 +76,1799 @@ struct LmParser {
 	
 	LmMessageNode           *cur_root;
 	LmMessageNode           *cur_node;
-		
-	GMarkupParser           *m_parser;
-	GMarkupParseContext     *context;
+
+	/* Start of a token that didn't fit in the last chunk */
+	ParserBuffer             pending;
+	/* How far LmParser::pending was searched for the end of the token,
+	 * and the quote of an attribute value open there */
+	gsize                    pending_scan;
+	gchar                    pending_quote;
+	/* Bytes copied into LmParser::pending since the parser was made */
+	gsize                    n_copied;
+	/* Stack of open element names, each followed by an OpenElement */
+	GString                 *open_elements;
+	/* Decoded text of the open elements, committed at their end tags */
+	ParserBuffer             text;
+	/* Attributes of the start tag being processed */
+	GArray                  *attributes;
+
+	/* Holds the nodes and strings of the stanza being parsed */
+	LmArena                 *arena;
+	/* Where the arenas and messages come from, %NULL for GLib */
+	const LmAllocator       *allocator;
+	/* The last failure was the allocator giving out or a stanza being
+	 * too large, not bad data */
+	gboolean                 hit_limit;
+	/* Largest stanza accepted, 0 for no limit */
+	gsize                    max_stanza_size;
+	/* Bytes of the current stanza tokenized so far */
+	gsize                    stanza_len;
+
+	/* In lazy mode only the root element of a stanza is built, its
+	 * content is kept unparsed until the children are asked for */
+	gboolean                 lazy;
+	/* Keep the bytes of each stanza as they were received */
+	gboolean                 keep_raw;
+	/* Where the content of the root starts in LmParser::raw */
+	gsize                    raw_content_start;
+	/* The received stanza, handed to the message built from it */
+	const gchar             *stanza_raw;
+	gsize                    stanza_raw_len;
+
+	/* Decides what to do with each stanza from its start tag */
+	LmParserFilterFunction   filter;
+	LmParserRawFunction      raw_function;
+	gpointer                 filter_data;
+	/* Decoded name and attributes handed to the filter */
+	ParserBuffer             filter_strings;
+	GPtrArray               *filter_names;
+	GPtrArray               *filter_values;
+	/* What the filter decided for the current stanza */
+	LmParserFilterResult     stanza_result;
+
+	/* Number of open elements that no nodes are built for */
+	guint                    skip_depth;
+	/* Bytes of a lazy root or a raw stanza seen in earlier chunks */
+	ParserBuffer             raw;
+	gboolean                 capturing;
+	/* Where the capture starts in the buffer being tokenized */
+	const gchar             *capture_start;
 };
 
+#define CDATA_START   "<![CDATA["
+#define CDATA_END     "]]>"
+#define COMMENT_START "<!--"
+#define COMMENT_END   "-->"
+#define PI_END        "?>"
+
+static gboolean     parser_start_node_cb   (LmParser              *parser,
+					    const gchar           *node_name,
+					    gsize                  node_name_len,
+					    const ParserAttribute *attributes,
+					    guint                  n_attributes);
+static gboolean     parser_end_node_cb     (LmParser              *parser,
+					    const gchar           *node_name,
+					    gsize                  node_name_len);
+static gboolean     parser_text_cb         (LmParser              *parser,
+					    gsize                  text_start);
+static void         parser_error           (LmParser              *parser,
+					    const gchar           *format,
+					    ...) G_GNUC_PRINTF (2, 3);
+static ParserStatus parser_tokenize        (LmParser              *parser,
+					    const gchar           *buf,
+					    gsize                  len,
+					    gsize                 *consumed);
+
+static inline gboolean
+parser_is_space (gchar c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+static inline gboolean
+parser_is_name_start_char (gchar c)
+{
+	return g_ascii_isalpha (c) || c == '_' || c == ':' || (guchar) c >= 0x80;
+}
+
+static inline gboolean
+parser_is_name_char (gchar c)
+{
+	return g_ascii_isalnum (c) || c == '_' || c == ':' ||
+		c == '.' || c == '-' || (guchar) c >= 0x80;
+}
+
+static void
+parser_push_element (LmParser *parser, const gchar *name, gsize len)
+{
+	OpenElement element;
+
+	element.name_len = len;
+	element.text_start = parser->text.len;
+
+	g_string_append_len (parser->open_elements, name, len);
+	g_string_append_len (parser->open_elements, 
+			     (const gchar *) &element, sizeof (OpenElement));
+}
+
+static const gchar *
+parser_top_element (LmParser *parser, gsize *len, gsize *text_start)
+{
+	GString     *stack = parser->open_elements;
+	OpenElement  element;
+
+	if (stack->len == 0) {
+		return NULL;
+	}
+
+	memcpy (&element, stack->str + stack->len - sizeof (OpenElement), 
+		sizeof (OpenElement));
+	*len = element.name_len;
+	if (text_start) {
+		*text_start = element.text_start;
+	}
+
+	return stack->str + stack->len - sizeof (OpenElement) - *len;
+}
+
+/* Fails the stanza being parsed, and with it the stream, since the
+ * allocator of the parser ran out of memory */
+static void
+parser_out_of_memory (LmParser *parser)
+{
+	parser_error (parser, "Out of memory for the stanza");
+	parser->hit_limit = TRUE;
+}
+
+static inline gboolean
+parser_in_stanza (LmParser *parser)
+{
+	return parser->cur_root != NULL || parser->skip_depth > 0;
+}
+
+/* Checks that the current stanza stays within the limit with @len more
+ * bytes */
+static gboolean
+parser_check_stanza_size (LmParser *parser, gsize len)
+{
+	if (parser->max_stanza_size > 0 &&
+	    parser->stanza_len + len > parser->max_stanza_size) {
+		parser_error (parser, 
+			      "Stanza larger than %" G_GSIZE_FORMAT " bytes",
+			      parser->max_stanza_size);
+		parser->hit_limit = TRUE;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+parser_count_stanza (LmParser *parser, gsize len)
+{
+	if (!parser_check_stanza_size (parser, len)) {
+		return FALSE;
+	}
+
+	parser->stanza_len += len;
+
+	return TRUE;
+}
+
+/* Makes room for @extra more bytes in @buf */
+static gboolean
+parser_buffer_reserve (LmParser *parser, ParserBuffer *buf, gsize extra)
+{
+	gchar *str;
+	gsize  size;
+
+	if (buf->len + extra <= buf->size) {
+		return TRUE;
+	}
+
+	size = MAX (buf->size, 64);
+	while (size < buf->len + extra) {
+		size *= 2;
+	}
+
+	str = _lm_allocator_realloc (parser->allocator, buf->str, 
+				     buf->size, size);
+	if (G_UNLIKELY (!str)) {
+		parser_out_of_memory (parser);
+		return FALSE;
+	}
+
+	buf->str = str;
+	buf->size = size;
+
+	return TRUE;
+}
+
+static gboolean
+parser_buffer_append (LmParser     *parser, 
+		      ParserBuffer *buf, 
+		      const gchar  *str, 
+		      gsize         len)
+{
+	if (len == 0) {
+		return TRUE;
+	}
+
+	if (!parser_buffer_reserve (parser, buf, len)) {
+		return FALSE;
+	}
+
+	memcpy (buf->str + buf->len, str, len);
+	buf->len += len;
+
+	return TRUE;
+}
+
+static void
+parser_buffer_free (LmParser *parser, ParserBuffer *buf)
+{
+	_lm_allocator_free (parser->allocator, buf->str, buf->size);
+
+	buf->str = NULL;
+	buf->len = 0;
+	buf->size = 0;
+}
+
+/* Copies what @buf holds to memory from @allocator, emptying it if that
+ * fails */
+static gboolean
+parser_buffer_move (LmParser          *parser, 
+		    ParserBuffer      *buf, 
+		    const LmAllocator *allocator)
+{
+	gsize  len = buf->len;
+	gchar *str = NULL;
+
+	if (len > 0) {
+		str = _lm_allocator_alloc (allocator, len);
+		if (str) {
+			memcpy (str, buf->str, len);
+		}
+	}
+
+	parser_buffer_free (parser, buf);
+	if (str) {
+		buf->str = str;
+		buf->len = len;
+		buf->size = len;
+	}
+
+	return len == 0 || str != NULL;
+}
+
+/* All nodes of a stanza are allocated from the same arena, a fresh one 
+ * is started with each toplevel element */
+static LmArena *
+parser_get_arena (LmParser *parser)
+{
+	if (!parser->arena) {
+		parser->arena = lm_arena_new_with_allocator (parser->allocator);
+		if (G_UNLIKELY (!parser->arena)) {
+			parser_out_of_memory (parser);
+		}
+	}
+
+	return parser->arena;
+}
+
+/* Lets go of the arena of the current stanza. If none of its nodes
+ * are referenced any more the arena is kept for the next stanza. */
+static void
+parser_release_arena (LmParser *parser)
+{
+	if (parser->arena && !lm_arena_recycle (parser->arena)) {
+		lm_arena_unref (parser->arena);
+		parser->arena = NULL;
+	}
+}
+
+/* Stops capturing, adding the bytes up to @end */
+static gboolean
+parser_end_capture (LmParser *parser, const gchar *end)
+{
+	parser->capturing = FALSE;
+
+	return parser_buffer_append (parser, &parser->raw, 
+				     parser->capture_start,
+				     end - parser->capture_start);
+}
+
+/* Pops the innermost element, committing its text before closing it.
+ * @tag points to the closing tag and @tag_end past it. Returns %FALSE 
+ * if the allocator ran out of memory. */
+static gboolean
+parser_close_element (LmParser    *parser, 
+		      const gchar *tag, 
+		      const gchar *tag_end)
+{
+	const gchar *name;
+	gsize        len;
+	gsize        text_start;
+
+	name = parser_top_element (parser, &len, &text_start);
+	if (!name) {
+		return TRUE;
+	}
+
+	/* The tag is counted once it is handled, which may be too late
+	 * when it ends the stanza */
+	if (parser_in_stanza (parser) &&
+	    !parser_check_stanza_size (parser, tag_end - tag)) {
+		return FALSE;
+	}
+
+	if (parser->skip_depth > 0) {
+		/* No node was built for it */
+		g_string_truncate (parser->open_elements,
+				   name - parser->open_elements->str);
+
+		parser->skip_depth--;
+		if (parser->skip_depth > 0 || 
+		    parser->stanza_result == LM_PARSER_FILTER_KEEP) {
+			return TRUE;
+		}
+
+		/* End of a stanza the filter didn't keep */
+		if (parser->stanza_result == LM_PARSER_FILTER_RAW) {
+			if (!parser_end_capture (parser, tag_end)) {
+				return FALSE;
+			}
+			if (parser->raw_function) {
+				(* parser->raw_function) (parser, 
+							  parser->raw.str,
+							  parser->raw.len,
+							  parser->filter_data);
+			}
+			parser->raw.len = 0;
+		}
+
+		parser->stanza_result = LM_PARSER_FILTER_KEEP;
+		return TRUE;
+	}
+
+	if (parser->capturing && parser->cur_node == parser->cur_root) {
+		LmArena *arena = parser_get_arena (parser);
+		gsize    content_end;
+
+		if (!arena) {
+			return FALSE;
+		}
+
+		if (parser->keep_raw) {
+			/* The whole stanza, the content is cut from it */
+			if (!parser_end_capture (parser, tag_end)) {
+				return FALSE;
+			}
+			parser->stanza_raw = lm_arena_strndup (arena,
+							       parser->raw.str,
+							       parser->raw.len);
+			if (G_UNLIKELY (!parser->stanza_raw)) {
+				parser_out_of_memory (parser);
+				return FALSE;
+			}
+			parser->stanza_raw_len = parser->raw.len;
+			content_end = parser->raw.len - (tag_end - tag);
+		} else {
+			if (!parser_end_capture (parser, tag)) {
+				return FALSE;
+			}
+			content_end = parser->raw.len;
+		}
+
+		/* The lazy root is closed, hand its content to it */
+		if (parser->lazy && 
+		    content_end > parser->raw_content_start) {
+			parser->cur_root->unparsed = 
+				lm_arena_strndup (arena,
+						  parser->raw.str + 
+						  parser->raw_content_start,
+						  content_end - 
+						  parser->raw_content_start);
+			if (G_UNLIKELY (!parser->cur_root->unparsed)) {
+				parser_out_of_memory (parser);
+				return FALSE;
+			}
+		}
+		parser->raw.len = 0;
+	}
+
+	if (!parser_text_cb (parser, text_start) ||
+	    !parser_end_node_cb (parser, name, len)) {
+		return FALSE;
+	}
+
+	g_string_truncate (parser->open_elements,
+			   name - parser->open_elements->str);
+
+	return TRUE;
+}
+
+static void
+parser_error (LmParser *parser, const gchar *format, ...)
+{
+	va_list  args;
+	gchar   *str;
+
+	va_start (args, format);
+	str = g_strdup_vprintf (format, args);
+	va_end (args);
+
+	g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
+	       "Parsing failed: %s\n", str);
+
+	g_free (str);
+}
+
+/* Returns the unicode character of the character reference between '&#'
+ * and ';', or 0 if it isn't a permitted one */
+static gunichar
+parser_char_ref_value (const gchar *ref, gsize len)
+{
+	gunichar value = 0;
+	guint    base = 10;
+	gsize    i = 0;
+
+	if (len > 0 && ref[0] == 'x') {
+		base = 16;
+		i = 1;
+	}
+
+	if (i == len) {
+		return 0;
+	}
+
+	for (; i < len; i++) {
+		gint digit;
+
+		if (base == 16) {
+			digit = g_ascii_xdigit_value (ref[i]);
+		} else {
+			digit = g_ascii_digit_value (ref[i]);
+		}
+
+		if (digit < 0) {
+			return 0;
+		}
+
+		value = value * base + digit;
+		if (value > 0x10FFFF) {
+			return 0;
+		}
+	}
+
+	if ((value >= 0x1 && value <= 0xD7FF) ||
+	    (value >= 0xE000 && value <= 0xFFFD) ||
+	    (value >= 0x10000 && value <= 0x10FFFF)) {
+		return value;
+	}
+
+	return 0;
+}
+
+/* Returns the character of one of the predefined entities or 0 */
+static inline gchar
+parser_entity_value (const gchar *ref, gsize len)
+{
+	switch (len) {
+	case 2:
+		if (ref[1] == 't') {
+			if (ref[0] == 'l') {
+				return '<';
+			}
+			if (ref[0] == 'g') {
+				return '>';
+			}
+		}
+		break;
+	case 3:
+		if (ref[0] == 'a' && ref[1] == 'm' && ref[2] == 'p') {
+			return '&';
+		}
+		break;
+	case 4:
+		if (memcmp (ref, "quot", 4) == 0) {
+			return '"';
+		}
+		if (memcmp (ref, "apos", 4) == 0) {
+			return '\'';
+		}
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/* Decodes entity and character references in @len bytes at @src and 
+ * normalizes line breaks the way an XML processor must. Attribute values
+ * get their whitespace normalized as well. The result is written to 
+ * @dest which must have room for @len bytes, the output is never longer 
+ * than the input. Returns the decoded length or -1 on malformed input.
+ */
+static gssize
+parser_unescape (LmParser    *parser,
+		 const gchar *src,
+		 gsize        len,
+		 gchar       *dest,
+		 gboolean     is_attribute)
+{
+	const gchar *p = src;
+	const gchar *end = src + len;
+	gchar       *d = dest;
+
+	while (p < end) {
+		const gchar *semi;
+		const gchar *ref;
+		gsize        ref_len;
+		gsize        plain_len;
+
+		/* Copy everything up to the next reference or line break 
+		 * in one go */
+		plain_len = lm_scan_plain (p, end - p, is_attribute);
+		if (plain_len > 0) {
+			memmove (d, p, plain_len);
+			d += plain_len;
+			p += plain_len;
+			continue;
+		}
+
+		switch (*p) {
+		case '&':
+			ref = p + 1;
+			semi = memchr (ref, ';', end - ref);
+			if (!semi) {
+				parser_error (parser, 
+					      "Entity reference is not terminated by ';'");
+				return -1;
+			}
+			ref_len = semi - ref;
+
+			if (ref_len > 0 && ref[0] == '#') {
+				gunichar ch;
+
+				ch = parser_char_ref_value (ref + 1, ref_len - 1);
+				if (ch == 0) {
+					parser_error (parser,
+						      "Character reference '%.*s' does not encode a permitted character",
+						      (int) ref_len, ref);
+					return -1;
+				}
+				d += g_unichar_to_utf8 (ch, d);
+			} else {
+				gchar ch;
+
+				ch = parser_entity_value (ref, ref_len);
+				if (ch == 0) {
+					parser_error (parser, 
+						      "Entity name '%.*s' is not known",
+						      (int) ref_len, ref);
+					return -1;
+				}
+				*d++ = ch;
+			}
+
+			p = semi + 1;
+			break;
+		case '\r':
+			*d++ = is_attribute ? ' ' : '\n';
+			if (++p < end && *p == '\n') {
+				p++;
+			}
+			break;
+		case '\n':
+		case '\t':
+			*d++ = is_attribute ? ' ' : *p;
+			p++;
+			break;
+		default:
+			/* Non ASCII and control characters */
+			do {
+				*d++ = *p++;
+			} while (p < end && (*p & 0x80));
+			break;
+		}
+	}
+
+	return d - dest;
+}
+
+/* Checks that @str is valid UTF-8. Since the input is no longer nul 
+ * terminated this is also what catches embedded nul bytes. */
+static gboolean
+parser_validate_span (LmParser *parser, const gchar *str, gsize len)
+{
+	if (G_LIKELY (g_utf8_validate (str, len, NULL))) {
+		return TRUE;
+	}
+
+	if (memchr (str, '\0', len)) {
+		parser_error (parser, "Embedded nul byte in stream");
+	} else {
+		parser_error (parser, "Invalid UTF-8 encoded text");
+	}
+
+	return FALSE;
+}
+
+/* Validates a text or attribute value span in one pass and tells whether
+ * it can be used verbatim, without unescaping. Runs of plain ASCII are 
+ * skipped by lm_scan_plain(), only what is left over is looked at here. */
+static gboolean
+parser_scan_span (LmParser    *parser, 
+		  const gchar *str, 
+		  gsize        len, 
+		  gboolean     is_attribute,
+		  gboolean    *plain)
+{
+	const gchar *p = str;
+	const gchar *end = str + len;
+
+	*plain = TRUE;
+
+	while (p < end) {
+		p += lm_scan_plain (p, end - p, is_attribute);
+		if (p == end) {
+			break;
+		}
+
+		if (*p & 0x80) {
+			const gchar *run = p;
+
+			/* A run of non ASCII bytes ends at a character 
+			 * boundary so it can be validated on its own */
+			while (p < end && (*p & 0x80)) {
+				p++;
+			}
+			if (!g_utf8_validate (run, p - run, NULL)) {
+				parser_error (parser, "Invalid UTF-8 encoded text");
+				return FALSE;
+			}
+			continue;
+		}
+
+		switch (*p) {
+		case '\0':
+			parser_error (parser, "Embedded nul byte in stream");
+			return FALSE;
+		case '&':
+		case '\r':
+			*plain = FALSE;
+			break;
+		case '\n':
+		case '\t':
+			if (is_attribute) {
+				*plain = FALSE;
+			}
+			break;
+		default:
+			break;
+		}
+		p++;
+	}
+
+	return TRUE;
+}
+
+/* Copies an attribute value into the stanza arena, unescaping if needed */
+static gchar *
+parser_decode_attribute (LmParser    *parser,
+			 const gchar *str, 
+			 gsize        len)
+{
+	LmArena  *arena;
+	gchar    *ret;
+	gssize    ret_len;
+	gboolean  plain;
+
+	if (!parser_scan_span (parser, str, len, TRUE, &plain)) {
+		return NULL;
+	}
+
+	arena = parser_get_arena (parser);
+	if (!arena) {
+		return NULL;
+	}
+
+	ret = lm_arena_alloc (arena, len + 1);
+	if (G_UNLIKELY (!ret)) {
+		parser_out_of_memory (parser);
+		return NULL;
+	}
+
+	if (plain) {
+		memcpy (ret, str, len);
+		ret_len = len;
+	} else {
+		ret_len = parser_unescape (parser, str, len, ret, TRUE);
+		if (ret_len < 0) {
+			return NULL;
+		}
+	}
+
+	ret[ret_len] = '\0';
+
+	return ret;
+}
+
+/* Returns %FALSE if the allocator ran out of memory */
+static gboolean
+parser_start_node_cb (LmParser              *parser,
+		      const gchar           *node_name,
+		      gsize                  node_name_len,
+		      const ParserAttribute *attributes,
+		      guint                  n_attributes)
+{
+	LmArena       *arena;
+	LmMessageNode *node;
+	guint          i;
+
+	arena = parser_get_arena (parser);
+	if (!arena) {
+		return FALSE;
+	}
+
+	node = _lm_message_node_new_len (arena, node_name, node_name_len);
+	if (G_UNLIKELY (!node)) {
+		parser_out_of_memory (parser);
+		return FALSE;
+	}
+
+	if (!parser->cur_root) {
+		/* New toplevel element */
+		parser->cur_root = node;
+		parser->cur_node = parser->cur_root;
+	} else {
+		LmMessageNode *parent_node;
+		
+		parent_node = parser->cur_node;
+		
+		parser->cur_node = node;
+		_lm_message_node_add_child_node (parent_node,
+						 parser->cur_node);
+	}
+
+	for (i = 0; i < n_attributes; ++i) {
+		const ParserAttribute *attr = &attributes[i];
+
+		g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER, 
+		       "ATTRIBUTE: %.*s = %s\n", 
+		       (int) attr->name_len, attr->name, attr->decoded);
+
+		if (!_lm_message_node_add_borrowed_attribute (parser->cur_node,
+							      attr->name,
+							      attr->name_len,
+							      attr->decoded)) {
+			parser_out_of_memory (parser);
+			return FALSE;
+		}
+	}
+	
+	if (node_name_len == strlen ("stream:stream") &&
+	    strncmp ("stream:stream", node_name, node_name_len) == 0) {
+		return parser_end_node_cb (parser, node_name, node_name_len);
+	}
+
+	return TRUE;
+}
+
+/* Returns %FALSE if the allocator ran out of memory */
+static gboolean
+parser_end_node_cb (LmParser    *parser,
+		    const gchar *node_name,
+		    gsize        node_name_len)
+{
+	g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
+	       "Trying to close node: %.*s\n", (int) node_name_len, node_name);
+
+        if (!parser->cur_node) {
+                /* FIXME: LM-1 should look at this */
+                return TRUE;
+        }
+        
+	if (strncmp (parser->cur_node->name, node_name, node_name_len) != 0 ||
+	    parser->cur_node->name[node_name_len] != '\0') {
+		g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
+		       "Trying to close node that isn't open: %.*s",
+		       (int) node_name_len, node_name);
+		return TRUE;
+	}
+
+	if (parser->cur_node == parser->cur_root) {
+		LmMessage   *m;
+		const gchar *raw = parser->stanza_raw;
+		
+		parser->stanza_raw = NULL;
+		m = _lm_message_new_from_node (parser->allocator, 
+					       parser->cur_root);
+
+		if (!m && _lm_message_type_from_string (parser->cur_root->name) !=
+		    LM_MESSAGE_TYPE_UNKNOWN) {
+			parser_out_of_memory (parser);
+			return FALSE;
+		}
+
+		if (!m) {
+			g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
+			       "Couldn't create message: %s\n",
+			       parser->cur_root->name);
+			lm_message_node_unref (parser->cur_root);
+			parser->cur_node = parser->cur_root = NULL;
+			parser_release_arena (parser);
+			return TRUE;
+		}
+
+		if (raw) {
+			_lm_message_set_raw_stanza (m, raw, 
+						    parser->stanza_raw_len);
+		}
+
+		g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
+		       "Have a new message\n");
+		if (parser->function) {
+			(* parser->function) (parser, m, parser->user_data);
+		}
+
+		lm_message_unref (m);
+		lm_message_node_unref (parser->cur_root);
+		
+		/* Nodes still referenced elsewhere keep the arena alive */
+		parser->cur_node = parser->cur_root = NULL;
+		parser_release_arena (parser);
+	} else {
+		LmMessageNode *tmp_node;
+		tmp_node = parser->cur_node;
+		parser->cur_node = parser->cur_node->parent;
+
+		lm_message_node_unref (tmp_node);
+	}
+
+	return TRUE;
+}
+
+/* Sets the text accumulated since @text_start as the value of the
+ * current node. Returns %FALSE if the allocator ran out of memory. */
+static gboolean
+parser_text_cb (LmParser *parser, gsize text_start)
+{
+	ParserBuffer *text = &parser->text;
+
+	if (parser->cur_node && text->len > text_start) {
+		LmArena *arena = parser_get_arena (parser);
+		gchar   *value;
+
+		if (!arena) {
+			return FALSE;
+		}
+
+		value = lm_arena_strndup (arena,
+					  text->str + text_start,
+					  text->len - text_start);
+		if (G_UNLIKELY (!value)) {
+			parser_out_of_memory (parser);
+			return FALSE;
+		}
+
+		_lm_message_node_set_borrowed_value (parser->cur_node, value);
+	}
+
+	text->len = text_start;
+
+	return TRUE;
+}
+
+/* Decodes a span and appends it to @dest */
+static gboolean
+parser_append_decoded (LmParser     *parser,
+		       ParserBuffer *dest,
+		       const gchar  *str, 
+		       gsize         len,
+		       gboolean      is_attribute)
+{
+	gssize   ret_len;
+	gboolean plain;
+
+	if (!parser_scan_span (parser, str, len, is_attribute, &plain)) {
+		return FALSE;
+	}
+
+	if (plain) {
+		return parser_buffer_append (parser, dest, str, len);
+	}
+
+	/* Unescaping never makes the text longer */
+	if (!parser_buffer_reserve (parser, dest, len)) {
+		return FALSE;
+	}
+	ret_len = parser_unescape (parser, str, len, dest->str + dest->len, 
+				   is_attribute);
+	if (ret_len < 0) {
+		return FALSE;
+	}
+
+	dest->len += ret_len;
+
+	return TRUE;
+}
+
+/* Checks a span that no node is built for without keeping it */
+static gboolean
+parser_check_span (LmParser    *parser, 
+		   const gchar *str, 
+		   gsize        len, 
+		   gboolean     is_attribute)
+{
+	ParserBuffer *text = &parser->text;
+	gboolean      plain;
+	gssize        ret_len;
+
+	if (!parser_scan_span (parser, str, len, is_attribute, &plain)) {
+		return FALSE;
+	}
+
+	if (plain) {
+		return TRUE;
+	}
+
+	/* Decode into the spare room of the text buffer to check the 
+	 * references */
+	if (!parser_buffer_reserve (parser, text, len)) {
+		return FALSE;
+	}
+	ret_len = parser_unescape (parser, str, len, text->str + text->len,
+				   is_attribute);
+
+	return ret_len >= 0;
+}
+
+/* Returns how much of a text run cut by the end of the buffer can be 
+ * handled already. Entity references, a trailing '\r' that might be 
+ * followed by '\n' and a cut UTF-8 character are left for when more 
+ * data has arrived. */
+static gsize
+parser_text_safe_len (const gchar *text, gsize len)
+{
+	gsize safe = len;
+	gsize i;
+
+	for (i = len; i > 0; i--) {
+		if (text[i - 1] == ';') {
+			break;
+		}
+		if (text[i - 1] == '&') {
+			safe = i - 1;
+			break;
+		}
+	}
+
+	if (safe > 0 && text[safe - 1] == '\r') {
+		safe--;
+	}
+
+	for (i = 1; i <= 3 && i <= safe; i++) {
+		guchar c = text[safe - i];
+
+		if ((c & 0xC0) == 0x80) {
+			continue;
+		}
+
+		if (c >= 0xC0) {
+			gsize char_len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+
+			if (char_len > i) {
+				safe -= i;
+			}
+		}
+		break;
+	}
+
+	return safe;
+}
+
+static ParserStatus
+parser_handle_text (LmParser *parser, const gchar *text, gsize len)
+{
+	if (parser->open_elements->len == 0) {
+		gsize i;
+
+		for (i = 0; i < len; i++) {
+			if (!parser_is_space (text[i])) {
+				parser_error (parser, 
+					      "Document must begin with an element");
+				return PARSER_STATUS_ERROR;
+			}
+		}
+
+		return PARSER_STATUS_OK;
+	}
+
+	if (parser->skip_depth > 0) {
+		if (!parser_check_span (parser, text, len, FALSE)) {
+			return PARSER_STATUS_ERROR;
+		}
+
+		return PARSER_STATUS_OK;
+	}
+
+	if (!parser->cur_node) {
+		/* Whitespace and keep alives between stanzas */
+		if (!parser_validate_span (parser, text, len)) {
+			return PARSER_STATUS_ERROR;
+		}
+
+		return PARSER_STATUS_OK;
+	}
+
+	if (!parser_append_decoded (parser, &parser->text, text, len, FALSE)) {
+		return PARSER_STATUS_ERROR;
+	}
+
+	return PARSER_STATUS_OK;
+}
+
+/* Hands the decoded name and attributes of a new stanza to the filter,
+ * the strings are kept in buffers owned by the parser so that nothing 
+ * is allocated for stanzas that are dropped */
+static gboolean
+parser_run_filter (LmParser *parser, const gchar *name, gsize name_len)
+{
+	ParserBuffer *strings = &parser->filter_strings;
+	const gchar  *xmlns = NULL;
+	const gchar  *str;
+	guint         i;
+
+	strings->len = 0;
+	if (!parser_buffer_append (parser, strings, name, name_len) ||
+	    !parser_buffer_append (parser, strings, "", 1)) {
+		return FALSE;
+	}
+
+	for (i = 0; i < parser->attributes->len; i++) {
+		ParserAttribute *attr;
+
+		attr = &g_array_index (parser->attributes, ParserAttribute, i);
+
+		if (!parser_validate_span (parser, attr->name, attr->name_len)) {
+			return FALSE;
+		}
+		if (!parser_buffer_append (parser, strings, 
+					   attr->name, attr->name_len) ||
+		    !parser_buffer_append (parser, strings, "", 1) ||
+		    !parser_append_decoded (parser, strings, attr->value, 
+					    attr->value_len, TRUE) ||
+		    !parser_buffer_append (parser, strings, "", 1)) {
+			return FALSE;
+		}
+	}
+
+	/* The buffer doesn't move any more, point into it */
+	g_ptr_array_set_size (parser->filter_names, 0);
+	g_ptr_array_set_size (parser->filter_values, 0);
+
+	str = strings->str + name_len + 1;
+	for (i = 0; i < parser->attributes->len; i++) {
+		const gchar *value;
+
+		value = str + strlen (str) + 1;
+		if (strcmp (str, "xmlns") == 0) {
+			xmlns = value;
+		}
+
+		g_ptr_array_add (parser->filter_names, (gpointer) str);
+		g_ptr_array_add (parser->filter_values, (gpointer) value);
+
+		str = value + strlen (value) + 1;
+	}
+
+	g_ptr_array_add (parser->filter_names, NULL);
+	g_ptr_array_add (parser->filter_values, NULL);
+
+	parser->stanza_result = 
+		(* parser->filter) (parser, strings->str, xmlns,
+				    (const gchar **) parser->filter_names->pdata,
+				    (const gchar **) parser->filter_values->pdata,
+				    parser->filter_data);
+
+	return TRUE;
+}
+
+static ParserStatus
+parser_handle_start_tag (LmParser     *parser,
+			 const gchar  *tag,
+			 const gchar  *end,
+			 const gchar **next)
+{
+	const gchar *p = tag + 1;
+	const gchar *name;
+	gsize        name_len;
+	gboolean     is_empty = FALSE;
+	gboolean     skip;
+	guint        i;
+
+	name = p;
+	while (p < end && parser_is_name_char (*p)) {
+		p++;
+	}
+	if (p == end) {
+		return PARSER_STATUS_INCOMPLETE;
+	}
+	name_len = p - name;
+
+	if (name_len == 0 || !parser_is_name_start_char (*name)) {
+		parser_error (parser, "'%.*s' is not a valid name", 
+			      (int) MAX (name_len, 1), name);
+		return PARSER_STATUS_ERROR;
+	}
+
+	g_array_set_size (parser->attributes, 0);
+
+	while (TRUE) {
+		ParserAttribute  attr;
+		const gchar     *close;
+		gchar            quote;
+
+		while (p < end && parser_is_space (*p)) {
+			p++;
+		}
+		if (p == end) {
+			return PARSER_STATUS_INCOMPLETE;
+		}
+
+		if (*p == '>') {
+			p++;
+			break;
+		}
+
+		if (*p == '/') {
+			if (p + 1 == end) {
+				return PARSER_STATUS_INCOMPLETE;
+			}
+			if (p[1] != '>') {
+				parser_error (parser, 
+					      "Expected a '>' to end the empty-element tag '%.*s'",
+					      (int) name_len, name);
+				return PARSER_STATUS_ERROR;
+			}
+			is_empty = TRUE;
+			p += 2;
+			break;
+		}
+
+		attr.name = p;
+		while (p < end && parser_is_name_char (*p)) {
+			p++;
+		}
+		if (p == end) {
+			return PARSER_STATUS_INCOMPLETE;
+		}
+		attr.name_len = p - attr.name;
+
+		if (attr.name_len == 0 || !parser_is_name_start_char (*attr.name)) {
+			parser_error (parser, "Odd character '%c' in element '%.*s'",
+				      *p, (int) name_len, name);
+			return PARSER_STATUS_ERROR;
+		}
+
+		while (p < end && parser_is_space (*p)) {
+			p++;
+		}
+		if (p == end) {
+			return PARSER_STATUS_INCOMPLETE;
+		}
+		if (*p != '=') {
+			parser_error (parser, 
+				      "Expected a '=' after attribute name '%.*s' of element '%.*s'",
+				      (int) attr.name_len, attr.name,
+				      (int) name_len, name);
+			return PARSER_STATUS_ERROR;
+		}
+		p++;
+
+		while (p < end && parser_is_space (*p)) {
+			p++;
+		}
+		if (p == end) {
+			return PARSER_STATUS_INCOMPLETE;
+		}
+		if (*p != '"' && *p != '\'') {
+			parser_error (parser,
+				      "Expected an open quote mark for the value of attribute '%.*s' of element '%.*s'",
+				      (int) attr.name_len, attr.name,
+				      (int) name_len, name);
+			return PARSER_STATUS_ERROR;
+		}
+		quote = *p++;
+
+		close = memchr (p, quote, end - p);
+		if (!close) {
+			return PARSER_STATUS_INCOMPLETE;
+		}
+
+		attr.value = p;
+		attr.value_len = close - p;
+		attr.decoded = NULL;
+		g_array_append_val (parser->attributes, attr);
+
+		p = close + 1;
+	}
+
+	/* The whole tag is available, validate before building anything */
+	if (!parser_validate_span (parser, name, name_len)) {
+		return PARSER_STATUS_ERROR;
+	}
+
+	/* More than a node can hold */
+	if (parser->attributes->len > G_MAXUINT16) {
+		parser_error (parser, "Too many attributes on element '%.*s'",
+			      (int) name_len, name);
+		return PARSER_STATUS_ERROR;
+	}
+
+	if (!parser->cur_root && parser->skip_depth == 0 && parser->filter) {
+		if (!parser_run_filter (parser, name, name_len)) {
+			return PARSER_STATUS_ERROR;
+		}
+	}
+
+	/* Elements of filtered stanzas and inside a lazy root are only 
+	 * checked */
+	skip = parser->skip_depth > 0 || 
+		parser->stanza_result != LM_PARSER_FILTER_KEEP ||
+		(parser->lazy && parser->cur_root);
+
+	for (i = 0; i < parser->attributes->len; i++) {
+		ParserAttribute *attr;
+		gboolean         valid;
+
+		attr = &g_array_index (parser->attributes, ParserAttribute, i);
+
+		valid = parser_validate_span (parser, attr->name, attr->name_len);
+		if (valid && skip) {
+			valid = parser_check_span (parser, attr->value, 
+						   attr->value_len, TRUE);
+		} else if (valid) {
+			attr->decoded = parser_decode_attribute (parser, 
+								 attr->value,
+								 attr->value_len);
+			valid = attr->decoded != NULL;
+		}
+
+		if (!valid) {
+			return PARSER_STATUS_ERROR;
+		}
+	}
+
+	parser_push_element (parser, name, name_len);
+
+	if (skip) {
+		parser->skip_depth++;
+
+		if (parser->skip_depth == 1 &&
+		    parser->stanza_result == LM_PARSER_FILTER_RAW) {
+			parser->capturing = TRUE;
+			parser->capture_start = tag;
+		}
+	} else {
+		if (!parser_start_node_cb (parser, name, name_len,
+					   (const ParserAttribute *) parser->attributes->data,
+					   parser->attributes->len)) {
+			return PARSER_STATUS_ERROR;
+		}
+
+		if (parser->keep_raw && parser->cur_root &&
+		    parser->cur_node == parser->cur_root) {
+			/* Keep the new root from its start tag on */
+			parser->capturing = TRUE;
+			parser->capture_start = tag;
+			parser->raw_content_start = p - tag;
+		} else if (parser->lazy && !is_empty && parser->cur_root) {
+			/* Keep the content of the new root as it is */
+			parser->capturing = TRUE;
+			parser->capture_start = p;
+			parser->raw_content_start = 0;
+		}
+	}
+
+	if (is_empty && !parser_close_element (parser, tag, p)) {
+		return PARSER_STATUS_ERROR;
+	}
+
+	*next = p;
+
+	return PARSER_STATUS_OK;
+}
+
+static ParserStatus
+parser_handle_end_tag (LmParser     *parser,
+		       const gchar  *tag,
+		       const gchar  *end,
+		       const gchar **next)
+{
+	const gchar *p = tag + 2;
+	const gchar *name;
+	const gchar *open_name;
+	gsize        name_len;
+	gsize        open_len;
 
-/* Used while parsing */
-static void    parser_start_node_cb (GMarkupParseContext  *context,
-				     const gchar          *node_name,
-				     const gchar         **attribute_names,
-				     const gchar         **attribute_values,
-				     gpointer              user_data,
-				     GError              **error);
-static void    parser_end_node_cb   (GMarkupParseContext  *context,
-				     const gchar          *node_name,
-				     gpointer              user_data,
-				     GError              **error);
-static void    parser_text_cb       (GMarkupParseContext  *context,
-				     const gchar          *text,
-				     gsize                 text_len,  
-				     gpointer              user_data,
-				     GError              **error);
-static void    parser_error_cb      (GMarkupParseContext  *context,
-				     GError               *error,
-				     gpointer              user_data);
+	name = p;
+	while (p < end && parser_is_name_char (*p)) {
+		p++;
+	}
+	name_len = p - name;
 
-static void
-parser_start_node_cb (GMarkupParseContext  *context,
-		      const gchar          *node_name,
-		      const gchar         **attribute_names,
-		      const gchar         **attribute_values,
-		      gpointer              user_data,
-		      GError              **error)
-{	
-	LmParser     *parser;
-	gint          i;
-	
-	parser = LM_PARSER (user_data);;
-	
+	while (p < end && parser_is_space (*p)) {
+		p++;
+	}
+	if (p == end) {
+		return PARSER_STATUS_INCOMPLETE;
+	}
+
+	if (*p != '>' || name_len == 0) {
+		parser_error (parser, "Malformed closing tag '%.*s'",
+			      (int) name_len, name);
+		return PARSER_STATUS_ERROR;
+	}
 
-/* 	parser->cur_depth++; */
+	open_name = parser_top_element (parser, &open_len, NULL);
+	if (!open_name) {
+		parser_error (parser, 
+			      "Element '%.*s' was closed, no element is currently open",
+			      (int) name_len, name);
+		return PARSER_STATUS_ERROR;
+	}
 
-	if (!parser->cur_root) {
-		/* New toplevel element */
-		parser->cur_root = _lm_message_node_new (node_name);
-		parser->cur_node = parser->cur_root;
+	if (open_len != name_len || memcmp (open_name, name, name_len) != 0) {
+		parser_error (parser, 
+			      "Element '%.*s' was closed, but the currently open element is '%.*s'",
+			      (int) name_len, name, (int) open_len, open_name);
+		return PARSER_STATUS_ERROR;
+	}
+
+	if (!parser_close_element (parser, tag, p + 1)) {
+		return PARSER_STATUS_ERROR;
+	}
+
+	*next = p + 1;
+
+	return PARSER_STATUS_OK;
+}
+
+/* Finds @terminator after @start, returns a pointer past it */
+static const gchar *
+parser_find_terminator (const gchar *start, 
+			const gchar *end, 
+			const gchar *terminator)
+{
+	gsize        term_len = strlen (terminator);
+	const gchar *p = start;
+
+	while (p + term_len <= end) {
+		p = memchr (p, terminator[0], end - p);
+		if (!p || p + term_len > end) {
+			return NULL;
+		}
+
+		if (memcmp (p, terminator, term_len) == 0) {
+			return p + term_len;
+		}
+
+		p++;
+	}
+
+	return NULL;
+}
+
+/* Handles '<!' and '<?' constructs: comments, CDATA sections, processing
+ * instructions and doctype declarations. Only CDATA carries content. */
+static ParserStatus
+parser_handle_markup_decl (LmParser     *parser,
+			   const gchar  *tag,
+			   const gchar  *end,
+			   const gchar **next)
+{
+	gsize        avail = end - tag;
+	const gchar *close;
+
+	if (tag[1] == '?') {
+		close = parser_find_terminator (tag + 2, end, PI_END);
+	}
+	else if (avail >= strlen (COMMENT_START) &&
+		 memcmp (tag, COMMENT_START, strlen (COMMENT_START)) == 0) {
+		close = parser_find_terminator (tag + strlen (COMMENT_START),
+						end, COMMENT_END);
+	}
+	else if (avail >= strlen (CDATA_START) &&
+		 memcmp (tag, CDATA_START, strlen (CDATA_START)) == 0) {
+		const gchar *text = tag + strlen (CDATA_START);
+
+		close = parser_find_terminator (text, end, CDATA_END);
+		if (close && parser->cur_node) {
+			gsize len = close - strlen (CDATA_END) - text;
+
+			if (!parser_validate_span (parser, text, len)) {
+				return PARSER_STATUS_ERROR;
+			}
+			if (parser->skip_depth == 0 &&
+			    !parser_buffer_append (parser, &parser->text, 
+						   text, len)) {
+				return PARSER_STATUS_ERROR;
+			}
+		}
+	}
+	else if (memcmp (tag, COMMENT_START, MIN (avail, strlen (COMMENT_START))) == 0 ||
+		 memcmp (tag, CDATA_START, MIN (avail, strlen (CDATA_START))) == 0) {
+		/* Can't tell which one it is yet */
+		return PARSER_STATUS_INCOMPLETE;
 	} else {
-		LmMessageNode *parent_node;
-		
-		parent_node = parser->cur_node;
-		
-		parser->cur_node = _lm_message_node_new (node_name);
-		_lm_message_node_add_child_node (parent_node,
-						 parser->cur_node);
+		close = memchr (tag, '>', avail);
+		if (close) {
+			close++;
+		}
 	}
 
-	for (i = 0; attribute_names[i]; ++i) {
-		g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER, 
-		       "ATTRIBUTE: %s = %s\n", 
-		       attribute_names[i],
-		       attribute_values[i]);
-		
-		lm_message_node_set_attributes (parser->cur_node,
-						attribute_names[i],
-						attribute_values[i], 
-						NULL);
+	if (!close) {
+		return PARSER_STATUS_INCOMPLETE;
 	}
-	
-	if (strcmp ("stream:stream", node_name) == 0) {
-		parser_end_node_cb (context,
-				    "stream:stream",
-				    user_data, 
-				    error);
+
+	if (!parser_validate_span (parser, tag, close - tag)) {
+		return PARSER_STATUS_ERROR;
+	}
+
+	*next = close;
+
+	return PARSER_STATUS_OK;
+}
+
+/* Runs the tokenizer over @buf. Sets @consumed to the number of bytes 
+ * that made up complete tokens, the rest has to be fed again together 
+ * with more data. */
+static ParserStatus
+parser_tokenize (LmParser    *parser, 
+		 const gchar *buf, 
+		 gsize        len, 
+		 gsize       *consumed)
+{
+	const gchar  *p = buf;
+	const gchar  *end = buf + len;
+	ParserStatus  status = PARSER_STATUS_OK;
+
+	if (parser->capturing) {
+		parser->capture_start = buf;
+	}
+
+	while (p < end && status == PARSER_STATUS_OK) {
+		const gchar *next = p;
+		gboolean     in_stanza = parser_in_stanza (parser);
+
+		if (*p != '<') {
+			const gchar *tag;
+
+			tag = memchr (p, '<', end - p);
+			if (!tag) {
+				gsize safe_len;
+
+				/* Text continues in the next chunk, handle 
+				 * what we can so that it isn't scanned again */
+				safe_len = parser_text_safe_len (p, end - p);
+				if (safe_len > 0) {
+					status = parser_handle_text (parser, p, 
+								     safe_len);
+					if (status == PARSER_STATUS_ERROR) {
+						break;
+					}
+					if (in_stanza &&
+					    !parser_count_stanza (parser, 
+								  safe_len)) {
+						status = PARSER_STATUS_ERROR;
+						break;
+					}
+					p += safe_len;
+				}
+
+				status = PARSER_STATUS_INCOMPLETE;
+				break;
+			}
+
+			status = parser_handle_text (parser, p, tag - p);
+			next = tag;
+		} 
+		else if (p + 1 == end) {
+			status = PARSER_STATUS_INCOMPLETE;
+		} else {
+			switch (p[1]) {
+			case '/':
+				status = parser_handle_end_tag (parser, p, end, 
+								&next);
+				break;
+			case '!':
+			case '?':
+				status = parser_handle_markup_decl (parser, p, end,
+								    &next);
+				break;
+			default:
+				status = parser_handle_start_tag (parser, p, end, 
+								  &next);
+				break;
+			}
+		}
+
+		if (status == PARSER_STATUS_OK) {
+			if ((in_stanza || parser_in_stanza (parser)) &&
+			    !parser_count_stanza (parser, next - p)) {
+				status = PARSER_STATUS_ERROR;
+				break;
+			}
+			if (!parser_in_stanza (parser)) {
+				parser->stanza_len = 0;
+			}
+			p = next;
+		}
+	}
+
+	*consumed = p - buf;
+
+	/* The buffer goes away, save what was seen of the content */
+	if (parser->capturing && status != PARSER_STATUS_ERROR &&
+	    !parser_buffer_append (parser, &parser->raw, 
+				   parser->capture_start,
+				   p - parser->capture_start)) {
+		status = PARSER_STATUS_ERROR;
 	}
+
+	return status;
 }
 
+/* Drops everything belonging to a partially parsed stanza */
 static void
-parser_end_node_cb (GMarkupParseContext  *context,
-		    const gchar          *node_name,
-		    gpointer              user_data,
-		    GError              **error)
+parser_reset_state (LmParser *parser)
 {
-	LmParser     *parser;
-	
-	parser = LM_PARSER (user_data);
-	
-	g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
-	       "Trying to close node: %s\n", node_name);
+	LmMessageNode *node;
 
-        if (!parser->cur_node) {
-                /* FIXME: LM-1 should look at this */
-                return;
-        }
-        
-	if (strcmp (parser->cur_node->name, node_name) != 0) {
-		if (strcmp (node_name, "stream:stream")) {
-			g_print ("Got an stream:stream end\n");
+	/* Open elements below the root still hold their creation 
+	 * reference, see parser_end_node_cb() */
+	for (node = parser->cur_node; 
+	     node && node != parser->cur_root; 
+	     node = node->parent) {
+		lm_message_node_unref (node);
+	}
+
+	if (parser->cur_root) {
+		lm_message_node_unref (parser->cur_root);
+	}
+
+	parser->cur_root = NULL;
+	parser->cur_node = NULL;
+	parser_release_arena (parser);
+
+	parser->pending.len = 0;
+	parser->pending_scan = 0;
+	parser->pending_quote = 0;
+	g_string_truncate (parser->open_elements, 0);
+	parser->text.len = 0;
+	parser->raw.len = 0;
+
+	parser->stanza_len = 0;
+	parser->skip_depth = 0;
+	parser->capturing = FALSE;
+	parser->stanza_raw = NULL;
+	parser->stanza_result = LM_PARSER_FILTER_KEEP;
+}
+
+/* Looks in @str for the end of the entity reference or tag at the start
+ * of LmParser::pending, keeping track of a quoted attribute value open 
+ * at the end of the last call. Returns a pointer past the end. */
+static const gchar *
+parser_find_token_end (LmParser *parser, const gchar *str, const gchar *end)
+{
+	const gchar *token = parser->pending.str;
+
+	for (; str < end; str++) {
+		if (token[0] == '&') {
+			/* A '<' ends it as an error */
+			if (*str == ';' || *str == '<') {
+				return str + 1;
+			}
+		} else if (parser->pending_quote) {
+			if (*str == parser->pending_quote) {
+				parser->pending_quote = 0;
+			}
+		} else if (*str == '>') {
+			return str + 1;
+		} else if ((*str == '"' || *str == '\'') && 
+			   token[1] != '/' && token[1] != '!') {
+			/* A '>' in an attribute value doesn't end the tag */
+			parser->pending_quote = *str;
 		}
-		
-		g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
-		       "Trying to close node that isn't open: %s",
-		       node_name);
-		return;
 	}
 
-	if (parser->cur_node == parser->cur_root) {
-		LmMessage *m;
-		
-		m = _lm_message_new_from_node (parser->cur_root);
+	return NULL;
+}
 
-		if (!m) {
-			g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
-			       "Couldn't create message: %s\n",
-			       parser->cur_root->name);
-			return;
+/* Finds how much of @buf has to be added to LmParser::pending for the 
+ * token at its start to possibly have ended, going on from where the 
+ * last call stopped. Markup always ends with a '>', so a long attribute
+ * value, comment or CDATA section coming in many chunks is only 
+ * tokenized again once its end is there, and what follows it in @buf 
+ * can be tokenized in place. Returns %FALSE if all of @buf is needed 
+ * and the token still goes on. */
+static gboolean
+parser_pending_end (LmParser    *parser, 
+		    const gchar *buf, 
+		    gsize        len, 
+		    gsize       *need)
+{
+	const gchar *str = parser->pending.str;
+	gsize        pending_len = parser->pending.len;
+	const gchar *terminator = NULL;
+	const gchar *end;
+	gsize        start = 0;
+
+	*need = len;
+
+	/* Other text and short tokens are cheap to look at again, a few 
+	 * more bytes are enough to finish them or tell what they are */
+	if ((str[0] != '<' && str[0] != '&') ||
+	    (str[0] == '<' && pending_len < strlen (CDATA_START))) {
+		*need = MIN (len, strlen (CDATA_START));
+		return TRUE;
+	}
+
+	if (str[0] != '<') {
+		/* An entity reference, see below */
+	} else if (memcmp (str, COMMENT_START, strlen (COMMENT_START)) == 0) {
+		terminator = COMMENT_END;
+		start = strlen (COMMENT_START);
+	} else if (memcmp (str, CDATA_START, strlen (CDATA_START)) == 0) {
+		terminator = CDATA_END;
+		start = strlen (CDATA_START);
+	} else if (str[1] == '?') {
+		terminator = PI_END;
+		start = 2;
+	}
+
+	if (terminator) {
+		gsize overlap = strlen (terminator) - 1;
+		gchar window[4];
+		gsize tail;
+		gsize head;
+
+		if (parser->pending_scan > start + overlap) {
+			start = parser->pending_scan - overlap;
 		}
+		parser->pending_scan = pending_len;
 
-		g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
-		       "Have a new message\n");
-		if (parser->function) {
-			(* parser->function) (parser, m, parser->user_data);
+		if (parser_find_terminator (str + start, str + pending_len, 
+					    terminator)) {
+			*need = 0;
+			return TRUE;
 		}
 
-		lm_message_unref (m);
-		lm_message_node_unref (parser->cur_root);
-		
-			
-		parser->cur_node = parser->cur_root = NULL;
+		/* The terminator may have started in the last chunk */
+		tail = MIN (overlap, pending_len - start);
+		head = MIN (overlap, len);
+		memcpy (window, str + pending_len - tail, tail);
+		memcpy (window + tail, buf, head);
+		end = parser_find_terminator (window, window + tail + head,
+					      terminator);
+		if (end) {
+			*need = end - window - tail;
+			return TRUE;
+		}
+
+		end = parser_find_terminator (buf, buf + len, terminator);
 	} else {
-		LmMessageNode *tmp_node;
-		tmp_node = parser->cur_node;
-		parser->cur_node = parser->cur_node->parent;
+		/* What was kept of the token is only looked at once */
+		end = parser_find_token_end (parser, 
+					     str + parser->pending_scan, 
+					     str + pending_len);
+		parser->pending_scan = pending_len;
+		if (end) {
+			*need = 0;
+			return TRUE;
+		}
 
-		lm_message_node_unref (tmp_node);
+		end = parser_find_token_end (parser, buf, buf + len);
+	}
+
+	if (end) {
+		*need = end - buf;
 	}
+
+	/* What is added of @buf has been looked at now */
+	parser->pending_scan += *need;
+
+	return end != NULL;
 }
 
-static void
-parser_text_cb (GMarkupParseContext   *context,
-		const gchar           *text,
-		gsize                  text_len,  
-		gpointer               user_data,
-		GError               **error)
+/* Keeps the unfinished token at the end of @buf for the next chunk */
+static gboolean
+parser_save_pending (LmParser *parser, const gchar *buf, gsize len)
 {
-	LmParser *parser;
-	
-	g_return_if_fail (user_data != NULL);
-	
-	parser = LM_PARSER (user_data);
-	
-	if (parser->cur_node && strcmp (text, "") != 0) {
-		lm_message_node_set_value (parser->cur_node, text);
-	} 
+	parser->pending_scan = 0;
+	parser->pending_quote = 0;
+	parser->n_copied += len;
+
+	return parser_buffer_append (parser, &parser->pending, buf, len);
 }
 
-static void
-parser_error_cb (GMarkupParseContext *context,
-		 GError              *error,
-		 gpointer             user_data)
+static gboolean
+parser_feed (LmParser *parser, const gchar *buf, gsize len)
 {
-	g_return_if_fail (user_data != NULL);
-	g_return_if_fail (error != NULL);
-	
-	g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
-	       "Parsing failed: %s\n", error->message);
+	ParserBuffer *pending = &parser->pending;
+	ParserStatus  status = PARSER_STATUS_OK;
+	gsize         consumed;
+	gsize         need;
+
+	parser->hit_limit = FALSE;
+
+	/* Finish the token left from the last chunk, copying no more of
+	 * @buf than it takes */
+	while (pending->len > 0 && len > 0) {
+		gboolean may_be_complete;
+
+		may_be_complete = parser_pending_end (parser, buf, len, &need);
+
+		parser->n_copied += need;
+		if (!parser_buffer_append (parser, pending, buf, need)) {
+			status = PARSER_STATUS_ERROR;
+			break;
+		}
+		buf += need;
+		len -= need;
+
+		if (!may_be_complete) {
+			status = PARSER_STATUS_INCOMPLETE;
+			break;
+		}
+
+		status = parser_tokenize (parser, pending->str, pending->len,
+					  &consumed);
+		if (status == PARSER_STATUS_ERROR) {
+			break;
+		}
+
+		if (consumed > 0) {
+			/* A new token starts the pending bytes now */
+			memmove (pending->str, pending->str + consumed,
+				 pending->len - consumed);
+			pending->len -= consumed;
+			parser->pending_scan = 0;
+			parser->pending_quote = 0;
+		}
+	}
+
+	/* The rest is tokenized where it is */
+	if (status != PARSER_STATUS_ERROR && pending->len == 0 && len > 0) {
+		status = parser_tokenize (parser, buf, len, &consumed);
+
+		if (status != PARSER_STATUS_ERROR && consumed < len &&
+		    !parser_save_pending (parser, buf + consumed, 
+					  len - consumed)) {
+			status = PARSER_STATUS_ERROR;
+		}
+	}
+
+	/* A token that doesn't end can't be let grow forever either */
+	if (status != PARSER_STATUS_ERROR && parser->max_stanza_size > 0 &&
+	    pending->len > parser->max_stanza_size) {
+		parser_error (parser, 
+			      "Token larger than %" G_GSIZE_FORMAT " bytes",
+			      parser->max_stanza_size);
+		parser->hit_limit = TRUE;
+		status = PARSER_STATUS_ERROR;
+	}
+
+	if (status == PARSER_STATUS_ERROR) {
+		parser_reset_state (parser);
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 LmParser *
@@ -215,27 +1879,18 @@ lm_parser_new (LmParserMessageFunction function,
 	LmParser *parser;
 	
 	parser = g_new0 (LmParser, 1);
-	if (!parser) {
-		return NULL;
-	}
 	
-	parser->m_parser = g_new0 (GMarkupParser, 1);
-	if (!parser->m_parser) {
-		g_free (parser);
-		return NULL;
-	}
-
 	parser->function  = function;
 	parser->user_data = user_data;
 	parser->notify    = notify;
 	
-	parser->m_parser->start_element = parser_start_node_cb;
-	parser->m_parser->end_element   = parser_end_node_cb;
-	parser->m_parser->text          = parser_text_cb;
-	parser->m_parser->error         = parser_error_cb;
+	parser->open_elements = g_string_new (NULL);
 
-	parser->context = g_markup_parse_context_new (parser->m_parser, 0,
-						      parser, NULL);
+	parser->filter_names   = g_ptr_array_new ();
+	parser->filter_values  = g_ptr_array_new ();
+	parser->stanza_result  = LM_PARSER_FILTER_KEEP;
+	parser->attributes    = g_array_new (FALSE, FALSE, 
+					     sizeof (ParserAttribute));
 
 	parser->cur_root = NULL;
 	parser->cur_node = NULL;
@@ -247,20 +1902,198 @@ gboolean
 lm_parser_parse (LmParser *parser, const gchar *string)
 {
 	g_return_val_if_fail (parser != NULL, FALSE);
-	
-        if (!parser->context) {
-                parser->context = g_markup_parse_context_new (parser->m_parser, 0,
-                                                              parser, NULL);
-        }
-        
-        if (g_markup_parse_context_parse (parser->context, string, 
-					  (gssize)strlen (string), NULL)) {
-		return TRUE;
-        } else {
-		g_markup_parse_context_free (parser->context);
-		parser->context = NULL;
-		return FALSE;
-        }
+	g_return_val_if_fail (string != NULL, FALSE);
+
+	return parser_feed (parser, string, strlen (string));
+}
+
+/* Parses @len bytes at @buf, which doesn't need to be nul terminated.
+ * A nul byte within the data is a parse error. */
+gboolean
+lm_parser_parse_len (LmParser *parser, const gchar *buf, gsize len)
+{
+	g_return_val_if_fail (parser != NULL, FALSE);
+	g_return_val_if_fail (buf != NULL || len == 0, FALSE);
+
+	return parser_feed (parser, buf, len);
+}
+
+/* Whether the last call to lm_parser_parse() or lm_parser_parse_len()
+ * that failed did so because the allocator of the parser ran out of 
+ * memory, rather than because of malformed data */
+gboolean
+lm_parser_hit_limit (LmParser *parser)
+{
+	g_return_val_if_fail (parser != NULL, FALSE);
+
+	return parser->hit_limit;
+}
+
+/* How many bytes of the input were copied to be tokenized together with
+ * the chunk after them, which tells the tests how much a stream cut in 
+ * odd places costs */
+gsize
+_lm_parser_get_n_copied (LmParser *parser)
+{
+	g_return_val_if_fail (parser != NULL, 0);
+
+	return parser->n_copied;
+}
+
+/* Forgets about the current stream, including any partially received
+ * stanza, so that the parser is ready for a new stream header. The 
+ * buffers of the parser are kept, which makes this cheaper than a new 
+ * parser on stream restarts and reconnects. Must not be called from the
+ * callbacks of the parser. */
+void
+lm_parser_reset (LmParser *parser)
+{
+	g_return_if_fail (parser != NULL);
+
+	parser_reset_state (parser);
+}
+
+/* In lazy mode only the root element of each stanza and its attributes
+ * are built right away. The children are built from the unparsed content
+ * the first time they are asked for, see _lm_parser_build_children(). */
+void
+lm_parser_set_lazy (LmParser *parser, gboolean lazy)
+{
+	g_return_if_fail (parser != NULL);
+
+	parser->lazy = lazy;
+}
+
+gboolean
+lm_parser_get_lazy (LmParser *parser)
+{
+	g_return_val_if_fail (parser != NULL, FALSE);
+
+	return parser->lazy;
+}
+
+/* Stanzas parsed from now on and the messages made from them are 
+ * allocated with @allocator, %NULL for GLib. It must stay valid until 
+ * they are all freed. */
+void
+lm_parser_set_allocator (LmParser *parser, const LmAllocator *allocator)
+{
+	gboolean moved = TRUE;
+
+	g_return_if_fail (parser != NULL);
+
+	/* The buffers are from the old one, what they hold is copied */
+	moved = parser_buffer_move (parser, &parser->pending, allocator) && moved;
+	moved = parser_buffer_move (parser, &parser->text, allocator) && moved;
+	moved = parser_buffer_move (parser, &parser->raw, allocator) && moved;
+	moved = parser_buffer_move (parser, &parser->filter_strings, 
+				    allocator) && moved;
+
+	parser->allocator = allocator;
+
+	if (!moved) {
+		g_warning ("Out of memory switching allocators, dropping the "
+			   "partially received stanza");
+		parser_reset_state (parser);
+	}
+
+	/* The arena being recycled is from the old one */
+	if (parser->arena) {
+		lm_arena_unref (parser->arena);
+		parser->arena = NULL;
+	}
+}
+
+/* Stanzas larger than @size bytes, or tokens that have grown larger
+ * than that without ending, fail the parse like an allocator running
+ * out of memory would. 0, the default, means no limit. */
+void
+lm_parser_set_max_stanza_size (LmParser *parser, gsize size)
+{
+	g_return_if_fail (parser != NULL);
+
+	parser->max_stanza_size = size;
+}
+
+gsize
+lm_parser_get_max_stanza_size (LmParser *parser)
+{
+	g_return_val_if_fail (parser != NULL, 0);
+
+	return parser->max_stanza_size;
+}
+
+/* With @keep_raw set the bytes of each stanza are kept as they were
+ * received, see lm_message_get_raw_stanza(). They share the arena of the
+ * stanza so keeping them is a single copy. */
+void
+lm_parser_set_keep_raw (LmParser *parser, gboolean keep_raw)
+{
+	g_return_if_fail (parser != NULL);
+
+	parser->keep_raw = keep_raw;
+}
+
+gboolean
+lm_parser_get_keep_raw (LmParser *parser)
+{
+	g_return_val_if_fail (parser != NULL, FALSE);
+
+	return parser->keep_raw;
+}
+
+/* @filter is called with the decoded name and attributes of the start 
+ * tag of each stanza. Stanzas it drops are checked for well-formedness 
+ * only, stanzas it wants raw are handed to @raw_function as received. */
+void
+lm_parser_set_filter (LmParser               *parser,
+		      LmParserFilterFunction  filter,
+		      LmParserRawFunction     raw_function,
+		      gpointer                user_data)
+{
+	g_return_if_fail (parser != NULL);
+
+	parser->filter       = filter;
+	parser->raw_function = raw_function;
+	parser->filter_data  = user_data;
+}
+
+/* Builds the children of a lazily parsed node from its content, which 
+ * was checked when the stanza was received */
+void
+_lm_parser_build_children (LmMessageNode *node, const gchar *content)
+{
+	LmParser *parser;
+	gsize     consumed;
+
+	parser = lm_parser_new (NULL, NULL, NULL);
+
+	parser->cur_root = node;
+	parser->cur_node = node;
+	parser->arena = node->arena ? lm_arena_ref (node->arena) : NULL;
+	parser_push_element (parser, node->name, strlen (node->name));
+
+	/* The text of @node itself was set when it was parsed */
+	if (parser_tokenize (parser, content, strlen (content), 
+			     &consumed) == PARSER_STATUS_ERROR) {
+		LmMessageNode *l;
+
+		/* The content was checked, only the memory can run out.
+		 * What was built is kept, the open elements lose their
+		 * creation reference like in parser_reset_state(). */
+		g_warning ("Out of memory building the children of %s", 
+			   node->name);
+
+		for (l = parser->cur_node; l && l != node; l = l->parent) {
+			lm_message_node_unref (l);
+		}
+	}
+
+	/* Don't let the parser drop the references of the caller */
+	parser->cur_root = NULL;
+	parser->cur_node = NULL;
+
+	lm_parser_free (parser);
 }
 
 void
@@ -270,10 +2103,18 @@ lm_parser_free (LmParser *parser)
 		(* parser->notify) (parser->user_data);
 	}
 
-	if (parser->context) {
-		g_markup_parse_context_free (parser->context);
+	parser_reset_state (parser);
+	if (parser->arena) {
+		lm_arena_unref (parser->arena);
 	}
-	g_free (parser->m_parser);
+
+	parser_buffer_free (parser, &parser->pending);
+	g_string_free (parser->open_elements, TRUE);
+	parser_buffer_free (parser, &parser->text);
+	parser_buffer_free (parser, &parser->raw);
+	parser_buffer_free (parser, &parser->filter_strings);
+	g_ptr_array_free (parser->filter_names, TRUE);
+	g_ptr_array_free (parser->filter_values, TRUE);
+	g_array_free (parser->attributes, TRUE);
 	g_free (parser);
 }
-
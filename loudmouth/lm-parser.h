@@ -22,6 +22,7 @@
 #define __LM_PARSER_H__
 
 #include <glib.h>
+#include "lm-alloc.h"
 #include "lm-message.h"
 
 typedef struct LmParser LmParser;
@@ -30,11 +31,48 @@ typedef void (* LmParserMessageFunction) (LmParser     *parser,
 					  LmMessage    *message,
 					  gpointer      user_data);
 
+typedef enum {
+	LM_PARSER_FILTER_KEEP,
+	LM_PARSER_FILTER_DROP,
+	LM_PARSER_FILTER_RAW
+} LmParserFilterResult;
+
+typedef LmParserFilterResult (* LmParserFilterFunction) (LmParser     *parser,
+							 const gchar  *name,
+							 const gchar  *xmlns,
+							 const gchar **attribute_names,
+							 const gchar **attribute_values,
+							 gpointer      user_data);
+typedef void (* LmParserRawFunction) (LmParser     *parser,
+				      const gchar  *stanza,
+				      gsize         len,
+				      gpointer      user_data);
+
 LmParser *   lm_parser_new       (LmParserMessageFunction  function,
 				  gpointer                 user_data,
 				  GDestroyNotify           notify);
 gboolean     lm_parser_parse     (LmParser                *parser,
 				  const gchar             *string);
+gboolean     lm_parser_parse_len (LmParser                *parser,
+				  const gchar             *buf,
+				  gsize                    len);
+gboolean     lm_parser_hit_limit (LmParser                *parser);
+void         lm_parser_reset     (LmParser                *parser);
+void         lm_parser_set_lazy  (LmParser                *parser,
+				  gboolean                 lazy);
+gboolean     lm_parser_get_lazy  (LmParser                *parser);
+void         lm_parser_set_keep_raw (LmParser             *parser,
+				     gboolean              keep_raw);
+gboolean     lm_parser_get_keep_raw (LmParser             *parser);
+void         lm_parser_set_max_stanza_size (LmParser      *parser,
+					    gsize          size);
+gsize        lm_parser_get_max_stanza_size (LmParser      *parser);
+void         lm_parser_set_allocator (LmParser            *parser,
+				      const LmAllocator   *allocator);
+void         lm_parser_set_filter (LmParser               *parser,
+				   LmParserFilterFunction  filter,
+				   LmParserRawFunction     raw_function,
+				   gpointer                user_data);
 void         lm_parser_free      (LmParser                *parser);
 
 #endif /* __LM_PARSER_H__ */
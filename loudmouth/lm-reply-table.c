@@ -0,0 +1,243 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include "lm-internals.h"
+#include "lm-reply-table.h"
+
+/* Linear probing, kept at most half full. Removed entries shift the ones
+ * after them back so no tombstones are needed, and the table shrinks
+ * again once most of the replies came in. */
+#define REPLY_TABLE_MIN_BITS 4
+
+typedef struct {
+	/* 0 marks an empty slot, generated ids are never 0 */
+	guint32  key;
+	gpointer value;
+} ReplySlot;
+
+struct _LmReplyTable {
+	ReplySlot      *slots;
+	guint           bits;
+	guint           n_entries;
+
+	/* Ids that weren't generated by us, created when first needed */
+	GHashTable     *strings;
+
+	GDestroyNotify  value_destroy;
+};
+
+static inline guint
+reply_table_home (LmReplyTable *table, guint32 key)
+{
+	/* Fibonacci hashing, the ids are mostly sequential */
+	return (guint32) (key * 2654435769U) >> (32 - table->bits);
+}
+
+static guint
+reply_table_find (LmReplyTable *table, guint32 key)
+{
+	guint mask = (1U << table->bits) - 1;
+	guint i;
+
+	for (i = reply_table_home (table, key);
+	     table->slots[i].key != 0 && table->slots[i].key != key;
+	     i = (i + 1) & mask) {
+	}
+
+	return i;
+}
+
+static void
+reply_table_resize (LmReplyTable *table, guint bits)
+{
+	ReplySlot *old_slots = table->slots;
+	guint      old_size = 1U << table->bits;
+	guint      i;
+
+	table->slots = g_new0 (ReplySlot, 1U << bits);
+	table->bits = bits;
+
+	for (i = 0; i < old_size; i++) {
+		if (old_slots[i].key != 0) {
+			table->slots[reply_table_find (table, old_slots[i].key)] =
+				old_slots[i];
+		}
+	}
+
+	g_free (old_slots);
+}
+
+LmReplyTable *
+lm_reply_table_new (GDestroyNotify value_destroy)
+{
+	LmReplyTable *table;
+
+	table = g_new0 (LmReplyTable, 1);
+	table->bits = REPLY_TABLE_MIN_BITS;
+	table->slots = g_new0 (ReplySlot, 1U << table->bits);
+	table->value_destroy = value_destroy;
+
+	return table;
+}
+
+void
+lm_reply_table_free (LmReplyTable *table)
+{
+	guint size = 1U << table->bits;
+	guint i;
+
+	if (table->value_destroy) {
+		for (i = 0; i < size; i++) {
+			if (table->slots[i].key != 0) {
+				table->value_destroy (table->slots[i].value);
+			}
+		}
+	}
+
+	if (table->strings) {
+		g_hash_table_destroy (table->strings);
+	}
+
+	g_free (table->slots);
+	g_free (table);
+}
+
+/* Replaces the value of @id if there already is one */
+void
+lm_reply_table_insert (LmReplyTable *table,
+		       const gchar  *id,
+		       gpointer      value)
+{
+	ReplySlot *slot;
+	guint32    key;
+
+	g_return_if_fail (table != NULL);
+	g_return_if_fail (id != NULL);
+
+	if (!_lm_utils_parse_id (id, &key)) {
+		if (!table->strings) {
+			table->strings =
+				g_hash_table_new_full (g_str_hash, g_str_equal,
+						       g_free,
+						       table->value_destroy);
+		}
+
+		g_hash_table_insert (table->strings, g_strdup (id), value);
+		return;
+	}
+
+	if ((table->n_entries + 1) * 2 > (1U << table->bits)) {
+		reply_table_resize (table, table->bits + 1);
+	}
+
+	slot = &table->slots[reply_table_find (table, key)];
+	if (slot->key == 0) {
+		slot->key = key;
+		table->n_entries++;
+	} else if (table->value_destroy) {
+		table->value_destroy (slot->value);
+	}
+
+	slot->value = value;
+}
+
+gpointer
+lm_reply_table_lookup (LmReplyTable *table, const gchar *id)
+{
+	guint32 key;
+
+	g_return_val_if_fail (table != NULL, NULL);
+	g_return_val_if_fail (id != NULL, NULL);
+
+	if (!_lm_utils_parse_id (id, &key)) {
+		return table->strings ?
+			g_hash_table_lookup (table->strings, id) : NULL;
+	}
+
+	return table->slots[reply_table_find (table, key)].value;
+}
+
+/* Removes @id and returns its value without destroying it */
+gpointer
+lm_reply_table_steal (LmReplyTable *table, const gchar *id)
+{
+	guint     mask = (1U << table->bits) - 1;
+	gpointer  value;
+	guint32   key;
+	guint     i;
+	guint     j;
+
+	g_return_val_if_fail (table != NULL, NULL);
+	g_return_val_if_fail (id != NULL, NULL);
+
+	if (!_lm_utils_parse_id (id, &key)) {
+		gpointer orig_key;
+
+		if (!table->strings ||
+		    !g_hash_table_lookup_extended (table->strings, id,
+						   &orig_key, &value)) {
+			return NULL;
+		}
+
+		g_hash_table_steal (table->strings, id);
+		g_free (orig_key);
+
+		return value;
+	}
+
+	i = reply_table_find (table, key);
+	if (table->slots[i].key == 0) {
+		return NULL;
+	}
+
+	value = table->slots[i].value;
+
+	/* Moves entries that probed past @i back into the hole */
+	for (j = (i + 1) & mask; table->slots[j].key != 0; j = (j + 1) & mask) {
+		guint home = reply_table_home (table, table->slots[j].key);
+
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			table->slots[i] = table->slots[j];
+			i = j;
+		}
+	}
+
+	table->slots[i].key = 0;
+	table->slots[i].value = NULL;
+	table->n_entries--;
+
+	if (table->bits > REPLY_TABLE_MIN_BITS &&
+	    table->n_entries * 8 < (1U << table->bits)) {
+		reply_table_resize (table, table->bits - 1);
+	}
+
+	return value;
+}
+
+guint
+lm_reply_table_size (LmReplyTable *table)
+{
+	g_return_val_if_fail (table != NULL, 0);
+
+	return table->n_entries +
+		(table->strings ? g_hash_table_size (table->strings) : 0);
+}
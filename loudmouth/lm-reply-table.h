@@ -0,0 +1,43 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_REPLY_TABLE_H__
+#define __LM_REPLY_TABLE_H__
+
+#include <glib.h>
+
+/* Maps stanza ids to whatever waits for the reply. Ids made by
+ * _lm_utils_generate_id() are kept by their number in an open addressed
+ * table, other ids in a string hash table next to it. */
+
+typedef struct _LmReplyTable LmReplyTable;
+
+LmReplyTable * lm_reply_table_new     (GDestroyNotify  value_destroy);
+void           lm_reply_table_free    (LmReplyTable   *table);
+void           lm_reply_table_insert  (LmReplyTable   *table,
+				       const gchar    *id,
+				       gpointer        value);
+gpointer       lm_reply_table_lookup  (LmReplyTable   *table,
+				       const gchar    *id);
+gpointer       lm_reply_table_steal   (LmReplyTable   *table,
+				       const gchar    *id);
+guint          lm_reply_table_size    (LmReplyTable   *table);
+
+#endif /* __LM_REPLY_TABLE_H__ */
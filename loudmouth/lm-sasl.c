@@ -323,9 +323,8 @@ sasl_digest_md5_send_initial_response (LmSASL *sasl, GHashTable *challenge)
 				      (gsize) strlen(response));
 
 	msg = lm_message_new (NULL, LM_MESSAGE_TYPE_RESPONSE);
-	lm_message_node_set_attributes (msg->node,
-					"xmlns", XMPP_NS_SASL_AUTH,
-					NULL);
+	lm_message_node_set_attribute_static (msg->node,
+					      "xmlns", XMPP_NS_SASL_AUTH);
 	lm_message_node_set_value (msg->node, response64);
 
 	result = lm_connection_send (sasl->connection, msg, NULL);
@@ -376,9 +375,8 @@ sasl_digest_md5_check_server_response(LmSASL *sasl, GHashTable *challenge)
 	}
 
 	msg = lm_message_new (NULL, LM_MESSAGE_TYPE_RESPONSE);
-	lm_message_node_set_attributes (msg->node,
-					"xmlns", XMPP_NS_SASL_AUTH,
-					NULL);
+	lm_message_node_set_attribute_static (msg->node,
+					      "xmlns", XMPP_NS_SASL_AUTH);
 
 	result = lm_connection_send (sasl->connection, msg, NULL);
 	lm_message_unref (msg);
@@ -557,7 +555,7 @@ sasl_failure_cb (LmMessageHandler *handler,
 
 	sasl = (LmSASL *) user_data;
 
-	if (message->node->children) {
+	if (lm_message_node_get_children (message->node)) {
 		const gchar *r;
 		
 		r = lm_message_node_get_value (message->node->children);
@@ -619,10 +617,10 @@ sasl_start (LmSASL *sasl)
 		g_free (cstr);
 
 		/* Here we say the Google magic word. Bad Google. */
-		lm_message_node_set_attributes (auth_msg->node,
-						"xmlns:ga", "http://www.google.com/talk/protocol/auth",
-						"ga:client-uses-full-bind-result", "true",
-						NULL);
+		lm_message_node_set_attribute_static (auth_msg->node,
+						      "xmlns:ga", "http://www.google.com/talk/protocol/auth");
+		lm_message_node_set_attribute_static (auth_msg->node,
+						      "ga:client-uses-full-bind-result", "true");
 
 	} 
 	else if (sasl->auth_type == AUTH_TYPE_DIGEST) {
@@ -630,10 +628,10 @@ sasl_start (LmSASL *sasl)
 		sasl->state = SASL_AUTH_STATE_DIGEST_MD5_STARTED;
 	}
 
-	lm_message_node_set_attributes (auth_msg->node,
-					"xmlns", XMPP_NS_SASL_AUTH,
-					"mechanism", mech,
-					NULL);
+	lm_message_node_set_attribute_static (auth_msg->node,
+					      "xmlns", XMPP_NS_SASL_AUTH);
+	lm_message_node_set_attribute_static (auth_msg->node,
+					      "mechanism", mech);
 
 	result = lm_connection_send (sasl->connection, auth_msg, NULL);
 	lm_message_unref (auth_msg);
@@ -0,0 +1,311 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include "lm-scan.h"
+
+/* The SIMD versions need the target attribute to be usable without 
+ * building the whole library for a newer CPU */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef struct {
+	gsize (* plain) (const guchar *str, gsize len, gboolean is_attribute);
+	gsize (* clean) (const guchar *str, gsize len);
+} ScanFuncs;
+
+/* Plain bytes are printable ASCII other than '&'. Tabs and line feeds 
+ * are plain in text but get normalized in attribute values, carriage
+ * returns never are. */
+static inline gboolean
+scan_is_plain (guchar c, gboolean is_attribute)
+{
+	if (c >= 0x20 && c < 0x80) {
+		return c != '&';
+	}
+
+	return !is_attribute && (c == '\t' || c == '\n');
+}
+
+static gsize
+scan_plain_scalar (const guchar *str, gsize len, gboolean is_attribute)
+{
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		if (!scan_is_plain (str[i], is_attribute)) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+static gsize
+scan_clean_scalar (const guchar *str, gsize len)
+{
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		if (!lm_scan_is_clean (str[i])) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+#ifdef SCAN_X86
+
+__attribute__ ((target ("sse2")))
+static gsize
+scan_plain_sse2 (const guchar *str, gsize len, gboolean is_attribute)
+{
+	const __m128i space = _mm_set1_epi8 (0x20);
+	const __m128i amp = _mm_set1_epi8 ('&');
+	const __m128i tab = _mm_set1_epi8 ('\t');
+	const __m128i lf = _mm_set1_epi8 ('\n');
+	gsize         i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v;
+		__m128i stop;
+		guint   mask;
+
+		v = _mm_loadu_si128 ((const __m128i *) (str + i));
+
+		/* The compare is signed so bytes from 0x80 up are below 
+		 * space as well */
+		stop = _mm_or_si128 (_mm_cmplt_epi8 (v, space),
+				     _mm_cmpeq_epi8 (v, amp));
+		if (!is_attribute) {
+			stop = _mm_andnot_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, tab),
+							       _mm_cmpeq_epi8 (v, lf)),
+						 stop);
+		}
+
+		mask = _mm_movemask_epi8 (stop);
+		if (mask) {
+			return i + __builtin_ctz (mask);
+		}
+	}
+
+	return i + scan_plain_scalar (str + i, len - i, is_attribute);
+}
+
+__attribute__ ((target ("sse2")))
+static gsize
+scan_clean_sse2 (const guchar *str, gsize len)
+{
+	const __m128i max_control = _mm_set1_epi8 (0x1f);
+	const __m128i tab = _mm_set1_epi8 ('\t');
+	const __m128i lf = _mm_set1_epi8 ('\n');
+	const __m128i cr = _mm_set1_epi8 ('\r');
+	const __m128i del = _mm_set1_epi8 (0x7f);
+	const __m128i c1 = _mm_set1_epi8 ((gchar) 0xc2);
+	const __m128i lt = _mm_set1_epi8 ('<');
+	const __m128i gt = _mm_set1_epi8 ('>');
+	const __m128i amp = _mm_set1_epi8 ('&');
+	const __m128i apos = _mm_set1_epi8 ('\'');
+	const __m128i quot = _mm_set1_epi8 ('"');
+	gsize         i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v;
+		__m128i control;
+		__m128i markup;
+		guint   mask;
+
+		v = _mm_loadu_si128 ((const __m128i *) (str + i));
+
+		/* Unsigned v <= 0x1f, bytes of multibyte characters are 
+		 * clean but the 0xc2 C1 controls start with */
+		control = _mm_cmpeq_epi8 (_mm_max_epu8 (v, max_control), 
+					  max_control);
+		control = _mm_andnot_si128 (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, tab),
+									_mm_cmpeq_epi8 (v, lf)),
+							  _mm_cmpeq_epi8 (v, cr)),
+					    control);
+		control = _mm_or_si128 (control,
+					_mm_or_si128 (_mm_cmpeq_epi8 (v, del),
+						      _mm_cmpeq_epi8 (v, c1)));
+
+		markup = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, lt),
+						     _mm_cmpeq_epi8 (v, gt)),
+				       _mm_or_si128 (_mm_cmpeq_epi8 (v, amp),
+						     _mm_or_si128 (_mm_cmpeq_epi8 (v, apos),
+								   _mm_cmpeq_epi8 (v, quot))));
+
+		mask = _mm_movemask_epi8 (_mm_or_si128 (control, markup));
+		if (mask) {
+			return i + __builtin_ctz (mask);
+		}
+	}
+
+	return i + scan_clean_scalar (str + i, len - i);
+}
+
+__attribute__ ((target ("avx2")))
+static gsize
+scan_plain_avx2 (const guchar *str, gsize len, gboolean is_attribute)
+{
+	const __m256i space = _mm256_set1_epi8 (0x20);
+	const __m256i amp = _mm256_set1_epi8 ('&');
+	const __m256i tab = _mm256_set1_epi8 ('\t');
+	const __m256i lf = _mm256_set1_epi8 ('\n');
+	gsize         i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v;
+		__m256i stop;
+		guint   mask;
+
+		v = _mm256_loadu_si256 ((const __m256i *) (str + i));
+
+		stop = _mm256_or_si256 (_mm256_cmpgt_epi8 (space, v),
+					_mm256_cmpeq_epi8 (v, amp));
+		if (!is_attribute) {
+			stop = _mm256_andnot_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, tab),
+								     _mm256_cmpeq_epi8 (v, lf)),
+						    stop);
+		}
+
+		mask = (guint) _mm256_movemask_epi8 (stop);
+		if (mask) {
+			return i + __builtin_ctz (mask);
+		}
+	}
+
+	return i + scan_plain_sse2 (str + i, len - i, is_attribute);
+}
+
+__attribute__ ((target ("avx2")))
+static gsize
+scan_clean_avx2 (const guchar *str, gsize len)
+{
+	const __m256i max_control = _mm256_set1_epi8 (0x1f);
+	const __m256i tab = _mm256_set1_epi8 ('\t');
+	const __m256i lf = _mm256_set1_epi8 ('\n');
+	const __m256i cr = _mm256_set1_epi8 ('\r');
+	const __m256i del = _mm256_set1_epi8 (0x7f);
+	const __m256i c1 = _mm256_set1_epi8 ((gchar) 0xc2);
+	const __m256i lt = _mm256_set1_epi8 ('<');
+	const __m256i gt = _mm256_set1_epi8 ('>');
+	const __m256i amp = _mm256_set1_epi8 ('&');
+	const __m256i apos = _mm256_set1_epi8 ('\'');
+	const __m256i quot = _mm256_set1_epi8 ('"');
+	gsize         i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v;
+		__m256i control;
+		__m256i markup;
+		guint   mask;
+
+		v = _mm256_loadu_si256 ((const __m256i *) (str + i));
+
+		control = _mm256_cmpeq_epi8 (_mm256_max_epu8 (v, max_control), 
+					     max_control);
+		control = _mm256_andnot_si256 (_mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, tab),
+										 _mm256_cmpeq_epi8 (v, lf)),
+								_mm256_cmpeq_epi8 (v, cr)),
+					       control);
+		control = _mm256_or_si256 (control,
+					   _mm256_or_si256 (_mm256_cmpeq_epi8 (v, del),
+							    _mm256_cmpeq_epi8 (v, c1)));
+
+		markup = _mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, lt),
+							   _mm256_cmpeq_epi8 (v, gt)),
+					  _mm256_or_si256 (_mm256_cmpeq_epi8 (v, amp),
+							   _mm256_or_si256 (_mm256_cmpeq_epi8 (v, apos),
+									    _mm256_cmpeq_epi8 (v, quot))));
+
+		mask = (guint) _mm256_movemask_epi8 (_mm256_or_si256 (control, markup));
+		if (mask) {
+			return i + __builtin_ctz (mask);
+		}
+	}
+
+	return i + scan_clean_sse2 (str + i, len - i);
+}
+
+static const ScanFuncs scan_funcs_avx2 = { 
+	scan_plain_avx2, scan_clean_avx2 
+};
+static const ScanFuncs scan_funcs_sse2 = { 
+	scan_plain_sse2, scan_clean_sse2 
+};
+
+#endif /* SCAN_X86 */
+
+static const ScanFuncs scan_funcs_scalar = { 
+	scan_plain_scalar, scan_clean_scalar 
+};
+
+static const ScanFuncs *
+scan_choose_funcs (void)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init ();
+
+	if (__builtin_cpu_supports ("avx2")) {
+		return &scan_funcs_avx2;
+	}
+	if (__builtin_cpu_supports ("sse2")) {
+		return &scan_funcs_sse2;
+	}
+#endif
+
+	return &scan_funcs_scalar;
+}
+
+static inline const ScanFuncs *
+scan_get_funcs (void)
+{
+	static gsize funcs = 0;
+
+	if (g_once_init_enter (&funcs)) {
+		g_once_init_leave (&funcs, (gsize) scan_choose_funcs ());
+	}
+
+	return (const ScanFuncs *) funcs;
+}
+
+/* Returns the length of the run of plain bytes at the start of @str. 
+ * Anything else needs a closer look: entity references and line breaks
+ * are decoded and non ASCII bytes have to be validated as UTF-8. */
+gsize
+lm_scan_plain (const gchar *str, gsize len, gboolean is_attribute)
+{
+	return scan_get_funcs ()->plain ((const guchar *) str, len, 
+					 is_attribute);
+}
+
+/* Returns the length of the run at the start of @str that can be 
+ * written out without escaping */
+gsize
+lm_scan_clean (const gchar *str, gsize len)
+{
+	return scan_get_funcs ()->clean ((const guchar *) str, len);
+}
@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_SCAN_H__
+#define __LM_SCAN_H__
+
+#include <glib.h>
+
+/* Byte class scanning for the parser and the serializer. The 
+ * implementation is picked at runtime from what the CPU supports. */
+
+/* Clean bytes can be written out as they are: anything but the markup
+ * characters and control characters other than whitespace. 0xc2 starts
+ * the C1 controls in UTF-8, so it is looked at more closely too. */
+static inline gboolean
+lm_scan_is_clean (guchar c)
+{
+	switch (c) {
+	case '<':
+	case '>':
+	case '&':
+	case '\'':
+	case '"':
+		return FALSE;
+	case '\t':
+	case '\n':
+	case '\r':
+		return TRUE;
+	case 0x7f:
+	case 0xc2:
+		return FALSE;
+	default:
+		return c >= 0x20;
+	}
+}
+
+gsize   lm_scan_plain  (const gchar *str,
+			gsize        len,
+			gboolean     is_attribute);
+gsize   lm_scan_clean  (const gchar *str,
+			gsize        len);
+
+#endif /* __LM_SCAN_H__ */
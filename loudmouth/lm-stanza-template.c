@@ -0,0 +1,352 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2003 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:lm-stanza-template
+ * @Title: LmStanzaTemplate
+ * @Short_description: Pre-serialized stanzas for sending many alike
+ *
+ * An #LmStanzaTemplate is made from an #LmMessage and a number of slots,
+ * each slot is an attribute or the text of a node in the message. The
+ * message is serialized once and every send with
+ * lm_connection_send_template() only copies the serialized bytes and
+ * the escaped slot values into the output, no message is built.
+ *
+ * <informalexample><programlisting>
+ * m = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_MESSAGE,
+ *                                   LM_MESSAGE_SUB_TYPE_HEADLINE);
+ * body = lm_message_node_add_child (m->node, "body", NULL);
+ *
+ * tmpl = lm_stanza_template_new (m);
+ * lm_stanza_template_add_slot (tmpl, m->node, "to");
+ * lm_stanza_template_add_slot (tmpl, m->node, "id");
+ * lm_stanza_template_add_slot (tmpl, body, NULL);
+ * lm_message_unref (m);
+ *
+ * values[0] = "user@example.com";
+ * values[1] = "notify42";
+ * values[2] = "Hello";
+ * lm_connection_send_template (connection, tmpl, values, NULL);
+ * </programlisting></informalexample>
+ */
+
+#include <config.h>
+#include <string.h>
+
+#include "lm-internals.h"
+#include "lm-stanza-template.h"
+
+typedef struct {
+	LmMessageNode *node;
+	/* %NULL for the text of @node */
+	gchar         *attribute;
+} TemplateSlot;
+
+/* A slot value goes in at @offset of the serialized bytes */
+typedef struct {
+	gsize offset;
+	guint slot;
+} TemplateSplice;
+
+struct _LmStanzaTemplate {
+	/* Dropped when the template is compiled */
+	LmMessage      *message;
+	GArray         *slots;
+
+	/* Serialized message without the slot values */
+	GString        *bytes;
+	TemplateSplice *splices;
+	guint           n_splices;
+
+	gint            ref_count;
+};
+
+static gboolean
+stanza_template_find_slot (LmStanzaTemplate *tmpl,
+			   LmMessageNode    *node,
+			   const gchar      *attribute,
+			   guint            *index)
+{
+	guint i;
+
+	for (i = 0; i < tmpl->slots->len; i++) {
+		TemplateSlot *slot = &g_array_index (tmpl->slots, 
+						     TemplateSlot, i);
+
+		if (slot->node != node) {
+			continue;
+		}
+
+		if (slot->attribute == attribute ||
+		    (slot->attribute && attribute &&
+		     strcmp (slot->attribute, attribute) == 0)) {
+			*index = i;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/**
+ * lm_stanza_template_new:
+ * @message: the stanza to make a template of
+ *
+ * Creates a template from @message. Slots are added with
+ * lm_stanza_template_add_slot(), after that the template keeps its own
+ * reference to @message and the message may not be changed any more.
+ * It is serialized the first time the template is used.
+ *
+ * Return value: a newly created #LmStanzaTemplate
+ **/
+LmStanzaTemplate *
+lm_stanza_template_new (LmMessage *message)
+{
+	LmStanzaTemplate *tmpl;
+
+	g_return_val_if_fail (message != NULL, NULL);
+
+	tmpl = g_new0 (LmStanzaTemplate, 1);
+	tmpl->ref_count = 1;
+	tmpl->message = lm_message_ref (message);
+	tmpl->slots = g_array_new (FALSE, FALSE, sizeof (TemplateSlot));
+
+	return tmpl;
+}
+
+/**
+ * lm_stanza_template_add_slot:
+ * @tmpl: an #LmStanzaTemplate
+ * @node: a node of the message of @tmpl
+ * @attribute: an attribute name or %NULL for the text of @node
+ *
+ * Adds a slot for the attribute @attribute of @node, or for the text of
+ * @node if @attribute is %NULL. Its value is given when the template is
+ * used and always escaped. Slots can only be added before the template
+ * is used for the first time.
+ *
+ * Return value: the index of the slot in the values passed to
+ * lm_connection_send_template()
+ **/
+guint
+lm_stanza_template_add_slot (LmStanzaTemplate *tmpl,
+			     LmMessageNode    *node,
+			     const gchar      *attribute)
+{
+	TemplateSlot slot;
+	guint        i;
+
+	g_return_val_if_fail (tmpl != NULL, 0);
+	g_return_val_if_fail (tmpl->bytes == NULL, 0);
+	g_return_val_if_fail (node != NULL, 0);
+
+	if (stanza_template_find_slot (tmpl, node, attribute, &i)) {
+		return i;
+	}
+
+	/* The message is written with the slots empty */
+	if (attribute) {
+		lm_message_node_set_attribute (node, attribute, "");
+	} else {
+		lm_message_node_set_value (node, "");
+	}
+
+	slot.node = node;
+	slot.attribute = g_strdup (attribute);
+	g_array_append_val (tmpl->slots, slot);
+
+	return tmpl->slots->len - 1;
+}
+
+/**
+ * lm_stanza_template_get_n_slots:
+ * @tmpl: an #LmStanzaTemplate
+ *
+ * Fetches the number of slots in @tmpl, which is the number of values
+ * it takes.
+ *
+ * Return value: the number of slots
+ **/
+guint
+lm_stanza_template_get_n_slots (LmStanzaTemplate *tmpl)
+{
+	g_return_val_if_fail (tmpl != NULL, 0);
+
+	return tmpl->slots->len;
+}
+
+typedef struct {
+	LmStanzaTemplate *tmpl;
+	GArray           *splices;
+} TemplateCompile;
+
+static gboolean
+stanza_template_write_slot (LmMessageNode *node,
+			    const gchar   *key,
+			    GString       *out,
+			    gpointer       user_data)
+{
+	TemplateCompile *compile = user_data;
+	TemplateSplice   splice;
+
+	if (!stanza_template_find_slot (compile->tmpl, node, key, 
+					&splice.slot)) {
+		return FALSE;
+	}
+
+	splice.offset = out->len;
+	g_array_append_val (compile->splices, splice);
+
+	return TRUE;
+}
+
+static void
+stanza_template_compile (LmStanzaTemplate *tmpl)
+{
+	TemplateCompile compile;
+
+	if (tmpl->bytes) {
+		return;
+	}
+
+	compile.tmpl = tmpl;
+	compile.splices = g_array_new (FALSE, FALSE, sizeof (TemplateSplice));
+
+	tmpl->bytes = g_string_new (NULL);
+	_lm_message_node_write_full (tmpl->message->node, tmpl->bytes,
+				     stanza_template_write_slot, &compile);
+
+	tmpl->n_splices = compile.splices->len;
+	tmpl->splices = (TemplateSplice *) g_array_free (compile.splices, 
+							 FALSE);
+
+	lm_message_unref (tmpl->message);
+	tmpl->message = NULL;
+}
+
+/* Appends the stanza with @values in the slots to @out */
+void
+_lm_stanza_template_write (LmStanzaTemplate  *tmpl,
+			   GString           *out,
+			   const gchar      **values)
+{
+	gsize offset = 0;
+	guint i;
+
+	g_return_if_fail (tmpl != NULL);
+	g_return_if_fail (out != NULL);
+	g_return_if_fail (values != NULL || tmpl->slots->len == 0);
+
+	stanza_template_compile (tmpl);
+
+	for (i = 0; i < tmpl->n_splices; i++) {
+		const TemplateSplice *splice = &tmpl->splices[i];
+		const gchar          *value = values[splice->slot];
+
+		g_string_append_len (out, tmpl->bytes->str + offset,
+				     splice->offset - offset);
+		if (value) {
+			_lm_message_node_append_escaped (out, value);
+		}
+		offset = splice->offset;
+	}
+
+	g_string_append_len (out, tmpl->bytes->str + offset,
+			     tmpl->bytes->len - offset);
+}
+
+/**
+ * lm_stanza_template_to_string:
+ * @tmpl: an #LmStanzaTemplate
+ * @values: the slot values, %NULL values leave the slot empty
+ *
+ * Returns the XML that lm_connection_send_template() would send with
+ * @values.
+ *
+ * Return value: a newly allocated string
+ **/
+gchar *
+lm_stanza_template_to_string (LmStanzaTemplate  *tmpl,
+			      const gchar      **values)
+{
+	GString *ret;
+
+	g_return_val_if_fail (tmpl != NULL, NULL);
+
+	ret = g_string_new (NULL);
+	_lm_stanza_template_write (tmpl, ret, values);
+
+	return g_string_free (ret, FALSE);
+}
+
+/**
+ * lm_stanza_template_ref:
+ * @tmpl: an #LmStanzaTemplate
+ *
+ * Adds a reference to @tmpl.
+ *
+ * Return value: the template
+ **/
+LmStanzaTemplate *
+lm_stanza_template_ref (LmStanzaTemplate *tmpl)
+{
+	g_return_val_if_fail (tmpl != NULL, NULL);
+
+	tmpl->ref_count++;
+
+	return tmpl;
+}
+
+/**
+ * lm_stanza_template_unref:
+ * @tmpl: an #LmStanzaTemplate
+ *
+ * Removes a reference from @tmpl. When no more references are present
+ * the template is freed.
+ **/
+void
+lm_stanza_template_unref (LmStanzaTemplate *tmpl)
+{
+	guint i;
+
+	g_return_if_fail (tmpl != NULL);
+
+	tmpl->ref_count--;
+
+	if (tmpl->ref_count > 0) {
+		return;
+	}
+
+	for (i = 0; i < tmpl->slots->len; i++) {
+		g_free (g_array_index (tmpl->slots, TemplateSlot, i).attribute);
+	}
+	g_array_free (tmpl->slots, TRUE);
+
+	if (tmpl->message) {
+		lm_message_unref (tmpl->message);
+	}
+
+	if (tmpl->bytes) {
+		g_string_free (tmpl->bytes, TRUE);
+	}
+
+	g_free (tmpl->splices);
+	g_free (tmpl);
+}
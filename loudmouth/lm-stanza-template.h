@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2003 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_STANZA_TEMPLATE_H__
+#define __LM_STANZA_TEMPLATE_H__
+
+#if !defined (LM_INSIDE_LOUDMOUTH_H) && !defined (LM_COMPILATION)
+#error "Only <loudmouth/loudmouth.h> can be included directly, this file may disappear or change contents."
+#endif
+
+#include <loudmouth/lm-message.h>
+
+G_BEGIN_DECLS
+
+/**
+ * LmStanzaTemplate:
+ *
+ * A pre-serialized stanza with slots for the parts that change between
+ * sends, see lm_stanza_template_new().
+ */
+typedef struct _LmStanzaTemplate LmStanzaTemplate;
+
+LmStanzaTemplate * lm_stanza_template_new       (LmMessage         *message);
+guint              lm_stanza_template_add_slot  (LmStanzaTemplate  *tmpl,
+						 LmMessageNode     *node,
+						 const gchar       *attribute);
+guint              lm_stanza_template_get_n_slots (LmStanzaTemplate *tmpl);
+gchar *            lm_stanza_template_to_string (LmStanzaTemplate  *tmpl,
+						 const gchar      **values);
+LmStanzaTemplate * lm_stanza_template_ref       (LmStanzaTemplate  *tmpl);
+void               lm_stanza_template_unref     (LmStanzaTemplate  *tmpl);
+
+G_END_DECLS
+
+#endif /* __LM_STANZA_TEMPLATE_H__ */
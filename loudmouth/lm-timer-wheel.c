@@ -0,0 +1,216 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include "lm-timer-wheel.h"
+
+/* Level 0 has a slot per tick, each level above a slot per whole turn
+ * of the level below. Timers further out than the wheel reaches are
+ * put in the last slot they can and moved on when it comes around. */
+#define WHEEL_LEVELS    4
+#define WHEEL_BITS      6
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_MAX_DELTA ((G_GUINT64_CONSTANT (1) << \
+			  (WHEEL_LEVELS * WHEEL_BITS)) - 1)
+
+struct _LmTimerWheel {
+	LmTimer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+	guint64  now;
+	guint    n_timers;
+};
+
+static void
+timer_wheel_link (LmTimerWheel *wheel, LmTimer *timer)
+{
+	guint64   delta = timer->expires - wheel->now;
+	guint64   expires = timer->expires;
+	LmTimer **slot;
+	guint     level;
+
+	if (delta > WHEEL_MAX_DELTA) {
+		expires = wheel->now + WHEEL_MAX_DELTA;
+		delta = WHEEL_MAX_DELTA;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < (G_GUINT64_CONSTANT (1) <<
+			     (WHEEL_BITS * (level + 1)))) {
+			break;
+		}
+	}
+
+	slot = &wheel->slots[level][(expires >> (WHEEL_BITS * level)) &
+				    WHEEL_MASK];
+
+	timer->next = *slot;
+	if (timer->next) {
+		timer->next->prev_next = &timer->next;
+	}
+	timer->prev_next = slot;
+	*slot = timer;
+}
+
+static void
+timer_wheel_unlink (LmTimer *timer)
+{
+	*timer->prev_next = timer->next;
+	if (timer->next) {
+		timer->next->prev_next = timer->prev_next;
+	}
+
+	timer->next = NULL;
+	timer->prev_next = NULL;
+}
+
+/* Spreads the timers of a slot of @level over the levels below */
+static void
+timer_wheel_cascade (LmTimerWheel *wheel, guint level)
+{
+	LmTimer **slot;
+	LmTimer  *timer;
+	LmTimer  *next;
+
+	slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) &
+				    WHEEL_MASK];
+	timer = *slot;
+	*slot = NULL;
+
+	for (; timer; timer = next) {
+		next = timer->next;
+		timer_wheel_link (wheel, timer);
+	}
+}
+
+LmTimerWheel *
+lm_timer_wheel_new (void)
+{
+	return g_new0 (LmTimerWheel, 1);
+}
+
+/* Timers still pending have to be cancelled by their owners first */
+void
+lm_timer_wheel_free (LmTimerWheel *wheel)
+{
+	g_return_if_fail (wheel != NULL);
+
+	g_free (wheel);
+}
+
+/* Sets @timer to expire @ticks after the current tick, at least one */
+void
+lm_timer_wheel_add (LmTimerWheel *wheel, LmTimer *timer, guint64 ticks)
+{
+	g_return_if_fail (wheel != NULL);
+	g_return_if_fail (timer != NULL);
+
+	if (timer->prev_next) {
+		lm_timer_wheel_cancel (wheel, timer);
+	}
+
+	timer->expires = wheel->now + MAX (ticks, 1);
+	timer_wheel_link (wheel, timer);
+	wheel->n_timers++;
+}
+
+void
+lm_timer_wheel_cancel (LmTimerWheel *wheel, LmTimer *timer)
+{
+	g_return_if_fail (wheel != NULL);
+	g_return_if_fail (timer != NULL);
+
+	if (!timer->prev_next) {
+		return;
+	}
+
+	timer_wheel_unlink (timer);
+	wheel->n_timers--;
+}
+
+gboolean
+lm_timer_wheel_is_pending (LmTimer *timer)
+{
+	g_return_val_if_fail (timer != NULL, FALSE);
+
+	return timer->prev_next != NULL;
+}
+
+/* Moves the wheel on to the tick @now and calls @func for every timer
+ * that expired on the way. The timer is no longer pending when @func
+ * runs, which may add and cancel timers. Going back is ignored. */
+void
+lm_timer_wheel_advance (LmTimerWheel *wheel,
+			guint64       now,
+			LmTimerFunc   func,
+			gpointer      user_data)
+{
+	g_return_if_fail (wheel != NULL);
+	g_return_if_fail (func != NULL);
+
+	while (wheel->now < now) {
+		LmTimer **slot;
+		guint     level;
+
+		if (wheel->n_timers == 0) {
+			wheel->now = now;
+			break;
+		}
+
+		wheel->now++;
+
+		/* Every level that completed a turn moves a slot down */
+		for (level = 1; level < WHEEL_LEVELS; level++) {
+			if (wheel->now & ((G_GUINT64_CONSTANT (1) <<
+					   (WHEEL_BITS * level)) - 1)) {
+				break;
+			}
+		}
+		while (--level > 0) {
+			timer_wheel_cascade (wheel, level);
+		}
+
+		slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+		while (*slot) {
+			LmTimer *timer = *slot;
+
+			timer_wheel_unlink (timer);
+			wheel->n_timers--;
+
+			(* func) (timer, user_data);
+		}
+	}
+}
+
+guint64
+lm_timer_wheel_get_now (LmTimerWheel *wheel)
+{
+	g_return_val_if_fail (wheel != NULL, 0);
+
+	return wheel->now;
+}
+
+guint
+lm_timer_wheel_get_n_timers (LmTimerWheel *wheel)
+{
+	g_return_val_if_fail (wheel != NULL, 0);
+
+	return wheel->n_timers;
+}
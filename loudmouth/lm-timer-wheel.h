@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_TIMER_WHEEL_H__
+#define __LM_TIMER_WHEEL_H__
+
+#include <glib.h>
+
+/* Hierarchical timer wheel counting in ticks, the caller decides how
+ * long a tick is and when to advance. Adding and cancelling a timer is
+ * constant time no matter how many are pending. */
+
+typedef struct _LmTimerWheel LmTimerWheel;
+typedef struct _LmTimer      LmTimer;
+
+/* Embedded in whatever the timer is for, the fields are private */
+struct _LmTimer {
+	LmTimer  *next;
+	LmTimer **prev_next;
+	guint64   expires;
+};
+
+typedef void (* LmTimerFunc) (LmTimer *timer, gpointer user_data);
+
+LmTimerWheel * lm_timer_wheel_new         (void);
+void           lm_timer_wheel_free        (LmTimerWheel *wheel);
+void           lm_timer_wheel_add         (LmTimerWheel *wheel,
+					   LmTimer      *timer,
+					   guint64       ticks);
+void           lm_timer_wheel_cancel      (LmTimerWheel *wheel,
+					   LmTimer      *timer);
+gboolean       lm_timer_wheel_is_pending  (LmTimer      *timer);
+void           lm_timer_wheel_advance     (LmTimerWheel *wheel,
+					   guint64       now,
+					   LmTimerFunc   func,
+					   gpointer      user_data);
+guint64        lm_timer_wheel_get_now     (LmTimerWheel *wheel);
+guint          lm_timer_wheel_get_n_timers (LmTimerWheel *wheel);
+
+#endif /* __LM_TIMER_WHEEL_H__ */
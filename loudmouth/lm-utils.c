@@ -75,17 +75,86 @@ _lm_utils_free_callback (LmCallback *cb)
 	g_free (cb);
 }
 
+/* Generated ids are the prefix and a counter in lower case hex without
+ * leading zeros, so that each id has exactly one number and back */
+#define ID_PREFIX     "lm"
+#define ID_PREFIX_LEN 2
+
+/* Fills @buf with a new stanza id, unique within the process. The 
+ * counter is taken with a compare and swap so messages can be created
+ * from several threads. Returns @buf. */
 gchar *
-_lm_utils_generate_id (void)
+_lm_utils_generate_id (gchar buf[LM_ID_SIZE])
 {
-	static guint  last_id = 0;
-	GTimeVal      tv;
-	glong         val;
-
-	g_get_current_time (&tv);
-	val = (tv.tv_sec & tv.tv_usec) + last_id++;
-		
-	return g_strdup_printf ("%ld%ld", val, tv.tv_usec);
+	static volatile gint  last_id = 0;
+	static const gchar    digits[] = "0123456789abcdef";
+	gint                  old_id;
+	guint32               id;
+	gchar                 tmp[8];
+	gchar                *p;
+	guint                 n = 0;
+
+	do {
+		old_id = g_atomic_int_get (&last_id);
+		id = (guint32) old_id + 1;
+		/* 0 is never handed out, see _lm_utils_parse_id() */
+		if (id == 0) {
+			id = 1;
+		}
+	} while (!g_atomic_int_compare_and_exchange (&last_id, old_id, 
+						     (gint) id));
+
+	do {
+		tmp[n++] = digits[id & 0xf];
+		id >>= 4;
+	} while (id);
+
+	memcpy (buf, ID_PREFIX, ID_PREFIX_LEN);
+	for (p = buf + ID_PREFIX_LEN; n > 0; p++) {
+		*p = tmp[--n];
+	}
+	*p = '\0';
+
+	return buf;
+}
+
+/* Gets the number back from an id made by _lm_utils_generate_id(), 
+ * anything else returns %FALSE */
+gboolean
+_lm_utils_parse_id (const gchar *str, guint32 *id)
+{
+	const gchar *p;
+	guint32      val = 0;
+
+	if (strncmp (str, ID_PREFIX, ID_PREFIX_LEN) != 0) {
+		return FALSE;
+	}
+
+	p = str + ID_PREFIX_LEN;
+	if (*p == '0' || *p == '\0') {
+		return FALSE;
+	}
+
+	for (; *p; p++) {
+		guint digit;
+
+		if (*p >= '0' && *p <= '9') {
+			digit = *p - '0';
+		} else if (*p >= 'a' && *p <= 'f') {
+			digit = *p - 'a' + 10;
+		} else {
+			return FALSE;
+		}
+
+		if (val > G_MAXUINT32 >> 4) {
+			return FALSE;
+		}
+		val = (val << 4) | digit;
+	}
+
+	*id = val;
+
+	return TRUE;
 }
 
 gchar*
@@ -23,14 +23,17 @@
 
 #define LM_INSIDE_LOUDMOUTH_H 1
 
+#include <loudmouth/lm-alloc.h>
 #include <loudmouth/lm-connection.h>
 #include <loudmouth/lm-error.h>
 #include <loudmouth/lm-message.h>
 #include <loudmouth/lm-message-handler.h>
 #include <loudmouth/lm-message-node.h>
+#include <loudmouth/lm-node-path.h>
 #include <loudmouth/lm-proxy.h>
 #include <loudmouth/lm-utils.h>
 #include <loudmouth/lm-ssl.h>
+#include <loudmouth/lm-stanza-template.h>
 
 #undef LM_INSIDE_LOUDMOUTH_H
 
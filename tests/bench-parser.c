@@ -0,0 +1,131 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Feeds the benchmark corpora to LmParser in socket sized reads */
+
+#include <stdlib.h>
+#include <glib.h>
+
+#include "loudmouth/lm-debug.h"
+#include "loudmouth/lm-parser.h"
+#include "bench.h"
+
+static gint     iterations = 5;
+static gint     chunk_size = 4096;
+static gboolean lazy = FALSE;
+
+static GOptionEntry entries[] = {
+	{ "iterations", 'i', 0, G_OPTION_ARG_INT, &iterations,
+	  "Number of times each corpus is parsed", "N" },
+	{ "chunk-size", 'c', 0, G_OPTION_ARG_INT, &chunk_size,
+	  "Size of the reads handed to the parser", "BYTES" },
+	{ "lazy", 'l', 0, G_OPTION_ARG_NONE, &lazy,
+	  "Only build the root of each stanza", NULL },
+	{ NULL }
+};
+
+static void
+bench_message_cb (LmParser *parser, LmMessage *m, gpointer user_data)
+{
+	guint *n_messages = user_data;
+
+	(*n_messages)++;
+}
+
+static void
+bench_parse_corpus (BenchCorpus *corpus)
+{
+	BenchMeasure  measure;
+	const gchar  *data = corpus->data->str;
+	gsize         len = corpus->data->len;
+	guint         n_messages = 0;
+	gint          i;
+
+	bench_measure_start (&measure);
+
+	for (i = 0; i < iterations; i++) {
+		LmParser *parser;
+		gsize     pos;
+
+		parser = lm_parser_new (bench_message_cb, &n_messages, NULL);
+		lm_parser_set_lazy (parser, lazy);
+
+		for (pos = 0; pos < len; pos += chunk_size) {
+			if (!lm_parser_parse_len (parser, data + pos, 
+						  MIN ((gsize) chunk_size, 
+						       len - pos))) {
+				g_printerr ("Failed to parse corpus %s\n", 
+					    corpus->name);
+				exit (EXIT_FAILURE);
+			}
+		}
+
+		lm_parser_free (parser);
+	}
+
+	bench_measure_stop (&measure);
+
+	/* The stream header is delivered as a message as well */
+	if (n_messages != (corpus->n_stanzas + 1) * iterations) {
+		g_printerr ("Got %u messages from corpus %s, expected %u\n",
+			    n_messages, corpus->name,
+			    (corpus->n_stanzas + 1) * iterations);
+		exit (EXIT_FAILURE);
+	}
+
+	bench_print_result (corpus->name, &measure, len * iterations,
+			    corpus->n_stanzas * iterations);
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError         *error = NULL;
+	GPtrArray      *corpora;
+	guint           i;
+
+	context = g_option_context_new ("- benchmark the XMPP parser");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (context);
+
+	if (iterations < 1 || chunk_size < 1) {
+		g_printerr ("Iterations and chunk size must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Only log what was asked for with LM_DEBUG */
+	lm_debug_init ();
+
+	corpora = bench_corpora_new ();
+
+	bench_print_header ();
+	for (i = 0; i < corpora->len; i++) {
+		bench_parse_corpus (g_ptr_array_index (corpora, i));
+	}
+
+	bench_corpora_free (corpora);
+
+	return EXIT_SUCCESS;
+}
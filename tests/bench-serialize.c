@@ -0,0 +1,294 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Serializes the stanzas of the benchmark corpora the way they are
+ * written to the wire */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "loudmouth/lm-debug.h"
+#include "loudmouth/lm-parser.h"
+#include "loudmouth/lm-stanza-template.h"
+#include "bench.h"
+
+static gint iterations = 5;
+
+static GOptionEntry entries[] = {
+	{ "iterations", 'i', 0, G_OPTION_ARG_INT, &iterations,
+	  "Number of times each corpus is serialized", "N" },
+	{ NULL }
+};
+
+static void
+bench_collect_cb (LmParser *parser, LmMessage *m, gpointer user_data)
+{
+	GPtrArray *messages = user_data;
+
+	if (lm_message_get_type (m) != LM_MESSAGE_TYPE_STREAM) {
+		g_ptr_array_add (messages, lm_message_ref (m));
+	}
+}
+
+static void
+bench_serialize_corpus (BenchCorpus *corpus)
+{
+	BenchMeasure  measure;
+	LmParser     *parser;
+	GPtrArray    *messages;
+	gsize         bytes = 0;
+	guint         j;
+	gint          i;
+
+	messages = g_ptr_array_new ();
+	parser = lm_parser_new (bench_collect_cb, messages, NULL);
+	if (!lm_parser_parse_len (parser, corpus->data->str, 
+				  corpus->data->len)) {
+		g_printerr ("Failed to parse corpus %s\n", corpus->name);
+		exit (EXIT_FAILURE);
+	}
+	lm_parser_free (parser);
+
+	bench_measure_start (&measure);
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < messages->len; j++) {
+			LmMessage *m = g_ptr_array_index (messages, j);
+			gchar     *str;
+
+			str = lm_message_node_to_string (m->node);
+			bytes += strlen (str);
+			g_free (str);
+		}
+	}
+
+	bench_measure_stop (&measure);
+
+	bench_print_result (corpus->name, &measure, bytes, 
+			    messages->len * iterations);
+
+	for (j = 0; j < messages->len; j++) {
+		lm_message_unref (g_ptr_array_index (messages, j));
+	}
+	g_ptr_array_free (messages, TRUE);
+}
+
+/* Notification traffic: the same message to many recipients, built for
+ * each send and then from a template */
+#define BENCH_SENDS      20000
+#define BENCH_RECIPIENTS 64
+
+static void
+bench_notifications (void)
+{
+	BenchMeasure      measure;
+	LmMessage        *m;
+	LmMessageNode    *body;
+	LmStanzaTemplate *tmpl;
+	gchar            *jids[BENCH_RECIPIENTS];
+	gchar            *ids[BENCH_RECIPIENTS];
+	const gchar      *values[3];
+	const gchar      *text = "Your order has shipped & is on its way";
+	gsize             bytes = 0;
+	gint              i;
+	guint             j;
+
+	for (j = 0; j < BENCH_RECIPIENTS; j++) {
+		jids[j] = g_strdup_printf ("user%u@example.com/phone", j);
+		ids[j] = g_strdup_printf ("notify%u", j);
+	}
+
+	bench_measure_start (&measure);
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < BENCH_SENDS; j++) {
+			gchar *str;
+
+			m = lm_message_new_with_sub_type (jids[j % BENCH_RECIPIENTS],
+							  LM_MESSAGE_TYPE_MESSAGE,
+							  LM_MESSAGE_SUB_TYPE_HEADLINE);
+			lm_message_node_add_child (m->node, "body", text);
+			str = lm_message_node_to_string (m->node);
+			bytes += strlen (str);
+			g_free (str);
+			lm_message_unref (m);
+		}
+	}
+
+	bench_measure_stop (&measure);
+	bench_print_result ("notify-build", &measure, bytes, 
+			    BENCH_SENDS * iterations);
+
+	m = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_MESSAGE,
+					  LM_MESSAGE_SUB_TYPE_HEADLINE);
+	body = lm_message_node_add_child (m->node, "body", NULL);
+	tmpl = lm_stanza_template_new (m);
+	lm_stanza_template_add_slot (tmpl, m->node, "to");
+	lm_stanza_template_add_slot (tmpl, m->node, "id");
+	lm_stanza_template_add_slot (tmpl, body, NULL);
+	lm_message_unref (m);
+
+	bytes = 0;
+
+	bench_measure_start (&measure);
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < BENCH_SENDS; j++) {
+			gchar *str;
+
+			values[0] = jids[j % BENCH_RECIPIENTS];
+			values[1] = ids[j % BENCH_RECIPIENTS];
+			values[2] = text;
+
+			str = lm_stanza_template_to_string (tmpl, values);
+			bytes += strlen (str);
+			g_free (str);
+		}
+	}
+
+	bench_measure_stop (&measure);
+	bench_print_result ("notify-template", &measure, bytes, 
+			    BENCH_SENDS * iterations);
+
+	lm_stanza_template_unref (tmpl);
+
+	for (j = 0; j < BENCH_RECIPIENTS; j++) {
+		g_free (jids[j]);
+		g_free (ids[j]);
+	}
+}
+
+/* Presence broadcast: one stanza with a caps payload sent to many 
+ * recipients, by changing the same message and from shallow clones */
+static void
+bench_fanout (void)
+{
+	BenchMeasure   measure;
+	LmMessage     *m;
+	LmMessageNode *node;
+	gchar         *jids[BENCH_RECIPIENTS];
+	gsize          bytes = 0;
+	gint           i;
+	guint          j;
+
+	for (j = 0; j < BENCH_RECIPIENTS; j++) {
+		jids[j] = g_strdup_printf ("room%u@muc.example.com/nick", j);
+	}
+
+	m = lm_message_new (NULL, LM_MESSAGE_TYPE_PRESENCE);
+	lm_message_node_add_child (m->node, "show", "away");
+	lm_message_node_add_child (m->node, "status", "In a meeting, back at 3 & then lunch");
+	node = lm_message_node_add_child (m->node, "c", NULL);
+	lm_message_node_set_attributes (node, 
+					"xmlns", "http://jabber.org/protocol/caps",
+					"hash", "sha-1",
+					"node", "http://code.google.com/p/loudmouth",
+					"ver", "QgayPKawpkPSDYmwT/WM94uAlu0=",
+					NULL);
+	node = lm_message_node_add_child (m->node, "x", NULL);
+	lm_message_node_set_attribute (node, "xmlns", "vcard-temp:x:update");
+	lm_message_node_add_child (node, "photo", 
+				   "01b87fcd030b72895ff8e88db57ec525450f000d");
+
+	bench_measure_start (&measure);
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < BENCH_SENDS; j++) {
+			gchar *str;
+
+			lm_message_node_set_attribute (m->node, "to", 
+						       jids[j % BENCH_RECIPIENTS]);
+			str = lm_message_node_to_string (m->node);
+			bytes += strlen (str);
+			g_free (str);
+		}
+	}
+
+	bench_measure_stop (&measure);
+	bench_print_result ("fanout-reuse", &measure, bytes, 
+			    BENCH_SENDS * iterations);
+
+	bytes = 0;
+	bench_measure_start (&measure);
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < BENCH_SENDS; j++) {
+			LmMessage *clone;
+			gchar     *str;
+
+			clone = lm_message_clone_shallow (m);
+			lm_message_node_set_attribute (clone->node, "to", 
+						       jids[j % BENCH_RECIPIENTS]);
+			str = lm_message_node_to_string (clone->node);
+			bytes += strlen (str);
+			g_free (str);
+			lm_message_unref (clone);
+		}
+	}
+
+	bench_measure_stop (&measure);
+	bench_print_result ("fanout-clone", &measure, bytes, 
+			    BENCH_SENDS * iterations);
+
+	lm_message_unref (m);
+
+	for (j = 0; j < BENCH_RECIPIENTS; j++) {
+		g_free (jids[j]);
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError         *error = NULL;
+	GPtrArray      *corpora;
+	guint           i;
+
+	context = g_option_context_new ("- benchmark stanza serialization");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (context);
+
+	if (iterations < 1) {
+		g_printerr ("Iterations must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Only log what was asked for with LM_DEBUG */
+	lm_debug_init ();
+
+	corpora = bench_corpora_new ();
+
+	bench_print_header ();
+	for (i = 0; i < corpora->len; i++) {
+		bench_serialize_corpus (g_ptr_array_index (corpora, i));
+	}
+	bench_notifications ();
+	bench_fanout ();
+
+	bench_corpora_free (corpora);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,347 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#ifdef G_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+#include "bench.h"
+
+#define CHAT_MESSAGES       10000
+#define ROSTER_ITEMS        10000
+#define MUC_PRESENCES       5000
+#define BASE64_MESSAGES     100
+#define BASE64_BLOCK_SIZE   (48 * 1024)
+#define PUBSUB_EVENTS       1000
+#define PUBSUB_DEPTH        32
+
+#ifdef __GLIBC__
+/* Count every allocation made in the process, by GLib and Loudmouth 
+ * alike, by wrapping the allocator of the C library */
+#define BENCH_COUNT_ALLOCS 1
+
+extern void *__libc_malloc  (size_t size);
+extern void *__libc_calloc  (size_t n_members, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static gulong n_allocs = 0;
+
+void *
+malloc (size_t size)
+{
+	n_allocs++;
+	return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n_members, size_t size)
+{
+	n_allocs++;
+	return __libc_calloc (n_members, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+	n_allocs++;
+	return __libc_realloc (ptr, size);
+}
+#endif /* __GLIBC__ */
+
+static BenchCorpus *
+bench_corpus_new (const gchar *name)
+{
+	BenchCorpus *corpus;
+
+	corpus = g_new0 (BenchCorpus, 1);
+	corpus->name = name;
+	corpus->data = g_string_new (BENCH_STREAM_START);
+
+	return corpus;
+}
+
+/* One to one chat with chat states and the odd escaped character */
+static BenchCorpus *
+bench_corpus_chat (void)
+{
+	BenchCorpus *corpus;
+	guint        i;
+
+	corpus = bench_corpus_new ("chat");
+
+	for (i = 0; i < CHAT_MESSAGES; i++) {
+		g_string_append_printf (corpus->data,
+					"<message from='romeo@montague.lit/orchard' "
+					"to='juliet@capulet.lit/balcony' "
+					"type='chat' id='msg%u'>"
+					"<body>Message number %u, &quot;what's in a "
+					"name?&quot; That which we call a rose by any "
+					"other name would smell as sweet.</body>"
+					"<active xmlns='http://jabber.org/protocol/chatstates'/>"
+					"</message>",
+					i, i);
+	}
+	corpus->n_stanzas = CHAT_MESSAGES;
+
+	return corpus;
+}
+
+/* A single roster result with many items */
+static BenchCorpus *
+bench_corpus_roster (void)
+{
+	BenchCorpus *corpus;
+	guint        i;
+
+	corpus = bench_corpus_new ("roster");
+
+	g_string_append (corpus->data,
+			 "<iq to='juliet@example.com/balcony' type='result' "
+			 "id='roster_1'><query xmlns='jabber:iq:roster'>");
+	for (i = 0; i < ROSTER_ITEMS; i++) {
+		g_string_append_printf (corpus->data,
+					"<item jid='contact%u@example.net' "
+					"name='Contact %u' subscription='both'>"
+					"<group>%s</group></item>",
+					i, i, i % 3 ? "Friends" : "Work");
+	}
+	g_string_append (corpus->data, "</query></iq>");
+	corpus->n_stanzas = 1;
+
+	return corpus;
+}
+
+/* Presence from the occupants of a crowded room when joining it */
+static BenchCorpus *
+bench_corpus_muc (void)
+{
+	BenchCorpus *corpus;
+	guint        i;
+
+	corpus = bench_corpus_new ("muc-presence");
+
+	for (i = 0; i < MUC_PRESENCES; i++) {
+		g_string_append_printf (corpus->data,
+					"<presence from='coven@chat.shakespeare.lit/nick%u' "
+					"to='hag66@shakespeare.lit/pda'>"
+					"<show>away</show><priority>%u</priority>"
+					"<c xmlns='http://jabber.org/protocol/caps' "
+					"hash='sha-1' node='http://code.google.com/p/exodus' "
+					"ver='QgayPKawpkPSDYmwT/WM94uAlu0='/>"
+					"<x xmlns='http://jabber.org/protocol/muc#user'>"
+					"<item affiliation='member' role='participant' "
+					"jid='user%u@shakespeare.lit/resource'/></x>"
+					"</presence>",
+					i, i % 10, i);
+	}
+	corpus->n_stanzas = MUC_PRESENCES;
+
+	return corpus;
+}
+
+/* In-band bytestream data, large base64 encoded bodies */
+static BenchCorpus *
+bench_corpus_base64 (void)
+{
+	BenchCorpus *corpus;
+	guchar      *block;
+	guint32      seed = 1;
+	guint        i;
+
+	corpus = bench_corpus_new ("base64");
+
+	block = g_malloc (BASE64_BLOCK_SIZE);
+
+	for (i = 0; i < BASE64_MESSAGES; i++) {
+		gchar *encoded;
+		guint  j;
+
+		for (j = 0; j < BASE64_BLOCK_SIZE; j++) {
+			seed = seed * 1103515245 + 12345;
+			block[j] = seed >> 24;
+		}
+		encoded = g_base64_encode (block, BASE64_BLOCK_SIZE);
+
+		g_string_append_printf (corpus->data,
+					"<iq from='romeo@montague.lit/orchard' "
+					"to='juliet@capulet.lit/balcony' type='set' "
+					"id='ibb%u'>"
+					"<data xmlns='http://jabber.org/protocol/ibb' "
+					"seq='%u' sid='i781hf64'>%s</data></iq>",
+					i, i, encoded);
+		g_free (encoded);
+	}
+	corpus->n_stanzas = BASE64_MESSAGES;
+
+	g_free (block);
+
+	return corpus;
+}
+
+/* Pubsub notifications carrying deeply nested payloads */
+static BenchCorpus *
+bench_corpus_pubsub (void)
+{
+	BenchCorpus *corpus;
+	guint        i;
+
+	corpus = bench_corpus_new ("pubsub");
+
+	for (i = 0; i < PUBSUB_EVENTS; i++) {
+		guint depth;
+
+		g_string_append_printf (corpus->data,
+					"<message from='pubsub.shakespeare.lit' "
+					"to='francisco@denmark.lit' id='foo%u'>"
+					"<event xmlns='http://jabber.org/protocol/pubsub#event'>"
+					"<items node='princely_musings'>"
+					"<item id='ae890ac52d0df67ed7cfdf51b644e901'>"
+					"<entry xmlns='http://www.w3.org/2005/Atom'>"
+					"<title>Soliloquy</title>"
+					"<summary>To be, or not to be: that is the "
+					"question</summary>",
+					i);
+
+		for (depth = 0; depth < PUBSUB_DEPTH; depth++) {
+			g_string_append_printf (corpus->data, 
+						"<div level='%u'>", depth);
+		}
+		g_string_append (corpus->data, "Whether 'tis nobler in the mind");
+		for (depth = 0; depth < PUBSUB_DEPTH; depth++) {
+			g_string_append (corpus->data, "</div>");
+		}
+
+		g_string_append (corpus->data,
+				 "<published>2003-12-13T18:30:02Z</published>"
+				 "</entry></item></items></event></message>");
+	}
+	corpus->n_stanzas = PUBSUB_EVENTS;
+
+	return corpus;
+}
+
+GPtrArray *
+bench_corpora_new (void)
+{
+	GPtrArray *corpora;
+
+	corpora = g_ptr_array_new ();
+	g_ptr_array_add (corpora, bench_corpus_chat ());
+	g_ptr_array_add (corpora, bench_corpus_roster ());
+	g_ptr_array_add (corpora, bench_corpus_muc ());
+	g_ptr_array_add (corpora, bench_corpus_base64 ());
+	g_ptr_array_add (corpora, bench_corpus_pubsub ());
+
+	return corpora;
+}
+
+void
+bench_corpora_free (GPtrArray *corpora)
+{
+	guint i;
+
+	for (i = 0; i < corpora->len; i++) {
+		BenchCorpus *corpus = g_ptr_array_index (corpora, i);
+
+		g_string_free (corpus->data, TRUE);
+		g_free (corpus);
+	}
+
+	g_ptr_array_free (corpora, TRUE);
+}
+
+void
+bench_measure_start (BenchMeasure *measure)
+{
+	measure->timer = g_timer_new ();
+#ifdef BENCH_COUNT_ALLOCS
+	measure->allocs = n_allocs;
+#else
+	measure->allocs = 0;
+#endif
+	g_timer_start (measure->timer);
+}
+
+void
+bench_measure_stop (BenchMeasure *measure)
+{
+	g_timer_stop (measure->timer);
+#ifdef BENCH_COUNT_ALLOCS
+	measure->allocs = n_allocs - measure->allocs;
+#endif
+}
+
+/* Peak resident set size of the process so far in kilobytes, or 0 if
+ * it isn't known */
+static glong
+bench_peak_rss (void)
+{
+#ifdef G_OS_UNIX
+	struct rusage usage;
+
+	if (getrusage (RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+		return usage.ru_maxrss / 1024;
+#else
+		return usage.ru_maxrss;
+#endif
+	}
+#endif
+
+	return 0;
+}
+
+void
+bench_print_header (void)
+{
+	g_print ("%-14s %10s %12s %14s %12s\n",
+		 "corpus", "MB/s", "stanzas/s", "allocs/stanza", "peak RSS");
+}
+
+void
+bench_print_result (const gchar  *name,
+		    BenchMeasure *measure,
+		    gsize         bytes,
+		    guint         n_stanzas)
+{
+	gdouble  seconds;
+	gchar   *allocs;
+
+	seconds = g_timer_elapsed (measure->timer, NULL);
+	g_timer_destroy (measure->timer);
+
+#ifdef BENCH_COUNT_ALLOCS
+	allocs = g_strdup_printf ("%.1f", (gdouble) measure->allocs / n_stanzas);
+#else
+	allocs = g_strdup ("n/a");
+#endif
+
+	g_print ("%-14s %10.1f %12.0f %14s %9ld KB\n",
+		 name,
+		 bytes / seconds / (1024 * 1024),
+		 n_stanzas / seconds,
+		 allocs,
+		 bench_peak_rss ());
+
+	g_free (allocs);
+}
@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <glib.h>
+
+/* Stream header every corpus is preceded by */
+#define BENCH_STREAM_START \
+	"<stream:stream xmlns='jabber:client' " \
+	"xmlns:stream='http://etherx.jabber.org/streams' " \
+	"from='example.com' id='bench' version='1.0'>"
+
+typedef struct {
+	const gchar *name;
+	GString     *data;
+	guint        n_stanzas;
+} BenchCorpus;
+
+typedef struct {
+	GTimer  *timer;
+	gulong   allocs;
+} BenchMeasure;
+
+GPtrArray *  bench_corpora_new     (void);
+void         bench_corpora_free    (GPtrArray    *corpora);
+
+void         bench_measure_start   (BenchMeasure *measure);
+void         bench_measure_stop    (BenchMeasure *measure);
+
+void         bench_print_header    (void);
+void         bench_print_result    (const gchar  *name,
+				    BenchMeasure *measure,
+				    gsize         bytes,
+				    guint         n_stanzas);
+
+#endif /* __BENCH_H__ */
@@ -0,0 +1,254 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#ifndef G_OS_WIN32
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+#include "loudmouth/lm-connection.h"
+#include "loudmouth/lm-message-handler.h"
+
+#ifndef G_OS_WIN32
+/* A server on the loopback interface that starts a stream with the 
+ * connection and then sends what the test tells it to */
+typedef struct {
+	GMainLoop  *loop;
+	gboolean    timed_out;
+	gint        listen_fd;
+	gint        fd;
+	gboolean    opened;
+	LmMessage  *reply;
+	gint        n_replies;
+	gint        n_others;
+} ReplyTimeoutTest;
+
+static void
+reply_timeout_write (ReplyTimeoutTest *test, const gchar *str)
+{
+	gsize len = strlen (str);
+
+	while (len > 0) {
+		gssize written = write (test->fd, str, len);
+
+		g_assert (written > 0);
+		str += written;
+		len -= written;
+	}
+}
+
+static gboolean
+reply_timeout_accept_cb (GIOChannel   *channel, 
+			 GIOCondition  condition, 
+			 gpointer      user_data)
+{
+	ReplyTimeoutTest *test = user_data;
+
+	test->fd = accept (test->listen_fd, NULL, NULL);
+	g_assert (test->fd >= 0);
+
+	reply_timeout_write (test, 
+			     "<?xml version='1.0'?>"
+			     "<stream:stream xmlns='jabber:client' "
+			     "xmlns:stream='http://etherx.jabber.org/streams' "
+			     "id='reply-timeout'>");
+
+	return FALSE;
+}
+
+static gboolean
+reply_timeout_give_up_cb (gpointer user_data)
+{
+	ReplyTimeoutTest *test = user_data;
+
+	test->timed_out = TRUE;
+	g_main_loop_quit (test->loop);
+
+	return FALSE;
+}
+
+/* Runs the main loop until a callback quits it */
+static void
+reply_timeout_run (ReplyTimeoutTest *test)
+{
+	guint id;
+
+	id = g_timeout_add (5000, reply_timeout_give_up_cb, test);
+	g_main_loop_run (test->loop);
+	g_assert (!test->timed_out);
+	g_source_remove (id);
+}
+
+static void
+reply_timeout_open_cb (LmConnection *connection, 
+		       gboolean      success, 
+		       gpointer      user_data)
+{
+	ReplyTimeoutTest *test = user_data;
+
+	test->opened = success;
+	g_main_loop_quit (test->loop);
+}
+
+static LmHandlerResult
+reply_timeout_reply_cb (LmMessageHandler *handler,
+			LmConnection     *connection,
+			LmMessage        *m,
+			gpointer          user_data)
+{
+	ReplyTimeoutTest *test = user_data;
+
+	test->reply = lm_message_ref (m);
+	test->n_replies++;
+	g_main_loop_quit (test->loop);
+
+	return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static LmHandlerResult
+reply_timeout_other_cb (LmMessageHandler *handler,
+			LmConnection     *connection,
+			LmMessage        *m,
+			gpointer          user_data)
+{
+	ReplyTimeoutTest *test = user_data;
+
+	test->n_others++;
+	g_main_loop_quit (test->loop);
+
+	return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static void
+test_reply_timeout ()
+{
+	ReplyTimeoutTest    test;
+	struct sockaddr_in  addr;
+	socklen_t           addr_len = sizeof (addr);
+	GIOChannel         *channel;
+	LmConnection       *connection;
+	LmMessageHandler   *reply_handler;
+	LmMessageHandler   *other_handler;
+	LmMessage          *m;
+	LmMessageNode      *error;
+	LmMessageNode      *condition;
+	gchar              *id;
+	gchar              *late;
+
+	memset (&test, 0, sizeof (test));
+	test.loop = g_main_loop_new (NULL, FALSE);
+	test.fd = -1;
+
+	test.listen_fd = socket (AF_INET, SOCK_STREAM, 0);
+	g_assert (test.listen_fd >= 0);
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	g_assert (bind (test.listen_fd, (struct sockaddr *) &addr, 
+			sizeof (addr)) == 0);
+	g_assert (listen (test.listen_fd, 1) == 0);
+	g_assert (getsockname (test.listen_fd, (struct sockaddr *) &addr,
+			       &addr_len) == 0);
+
+	channel = g_io_channel_unix_new (test.listen_fd);
+	g_io_add_watch (channel, G_IO_IN, reply_timeout_accept_cb, &test);
+
+	connection = lm_connection_new ("127.0.0.1");
+	lm_connection_set_port (connection, ntohs (addr.sin_port));
+	g_assert (lm_connection_open (connection, reply_timeout_open_cb, 
+				      &test, NULL, NULL));
+	reply_timeout_run (&test);
+	g_assert (test.opened);
+
+	reply_handler = lm_message_handler_new (reply_timeout_reply_cb, 
+						&test, NULL);
+	other_handler = lm_message_handler_new (reply_timeout_other_cb, 
+						&test, NULL);
+	lm_connection_register_message_handler (connection, other_handler,
+						LM_MESSAGE_TYPE_IQ,
+						LM_HANDLER_PRIORITY_NORMAL);
+
+	m = lm_message_new_with_sub_type ("peer@example.org", 
+					  LM_MESSAGE_TYPE_IQ,
+					  LM_MESSAGE_SUB_TYPE_GET);
+	g_assert (lm_connection_send_with_reply_full (connection, m, 
+						      reply_handler, 100, 
+						      NULL));
+	id = g_strdup (lm_message_node_get_attribute (m->node, "id"));
+	lm_message_unref (m);
+
+	/* Nothing answers, the handler gets an error from the peer */
+	reply_timeout_run (&test);
+	g_assert_cmpint (test.n_replies, ==, 1);
+	g_assert_cmpint (lm_message_get_sub_type (test.reply), ==, 
+			 LM_MESSAGE_SUB_TYPE_ERROR);
+	g_assert_cmpstr (lm_message_node_get_attribute (test.reply->node, 
+							"id"), ==, id);
+	g_assert_cmpstr (lm_message_node_get_attribute (test.reply->node, 
+							"from"), ==, 
+			 "peer@example.org");
+
+	error = lm_message_node_get_child (test.reply->node, "error");
+	g_assert (error != NULL);
+	g_assert_cmpstr (lm_message_node_get_attribute (error, "type"), ==, 
+			 "wait");
+	condition = lm_message_node_get_child (error, "remote-server-timeout");
+	g_assert (condition != NULL);
+	g_assert_cmpstr (lm_message_node_get_attribute (condition, "xmlns"), 
+			 ==, "urn:ietf:params:xml:ns:xmpp-stanzas");
+	lm_message_unref (test.reply);
+
+	/* The real reply comes in late and goes to the other handlers */
+	late = g_strdup_printf ("<iq type='result' id='%s' "
+				"from='peer@example.org'/>", id);
+	reply_timeout_write (&test, late);
+	reply_timeout_run (&test);
+	g_assert_cmpint (test.n_others, ==, 1);
+	g_assert_cmpint (test.n_replies, ==, 1);
+
+	lm_connection_close (connection, NULL);
+	lm_connection_unref (connection);
+	lm_message_handler_unref (reply_handler);
+	lm_message_handler_unref (other_handler);
+
+	g_free (late);
+	g_free (id);
+	g_io_channel_unref (channel);
+	close (test.fd);
+	close (test.listen_fd);
+	g_main_loop_unref (test.loop);
+}
+#endif
+
+int
+main (int argc, char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+	
+#ifndef G_OS_WIN32
+	g_test_add_func ("/connection/reply_timeout", test_reply_timeout);
+#endif
+
+	return g_test_run ();
+}
@@ -19,9 +19,211 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <glib.h>
 
+#include "loudmouth/lm-alloc.h"
+#include "loudmouth/lm-error.h"
+#include "loudmouth/lm-internals.h"
+#include "loudmouth/lm-node-path.h"
 #include "loudmouth/lm-parser.h"
+#include "loudmouth/lm-stanza-template.h"
+
+/* Chunk sizes used to feed documents to LmParser, 0 means all at once */
+static const gsize chunk_sizes[] = { 0, 1, 2, 3, 7, 64, 1000 };
+
+/* Builds message trees from GMarkup events the way LmParser did before 
+ * it got its own tokenizer, used as reference for the differential tests.
+ * All text directly inside an element makes up its value.
+ */
+typedef struct {
+	LmMessage     *holder;
+	LmMessageNode *cur_root;
+	LmMessageNode *cur_node;
+	GSList        *messages;
+} ReferenceParser;
+
+static void
+reference_end_element (GMarkupParseContext  *context,
+		       const gchar          *node_name,
+		       gpointer              user_data,
+		       GError              **error)
+{
+	ReferenceParser *ref = user_data;
+
+	if (!ref->cur_node) {
+		return;
+	}
+
+	if (ref->cur_node == ref->cur_root) {
+		ref->messages = g_slist_append (ref->messages,
+						lm_message_node_to_string (ref->cur_root));
+		ref->cur_root = ref->cur_node = NULL;
+	} else {
+		ref->cur_node = ref->cur_node->parent;
+	}
+}
+
+static void
+reference_start_element (GMarkupParseContext  *context,
+			 const gchar          *node_name,
+			 const gchar         **attribute_names,
+			 const gchar         **attribute_values,
+			 gpointer              user_data,
+			 GError              **error)
+{
+	ReferenceParser *ref = user_data;
+	gint             i;
+
+	if (!ref->cur_root) {
+		ref->cur_root = lm_message_node_add_child (ref->holder->node,
+							   node_name, NULL);
+		ref->cur_node = ref->cur_root;
+	} else {
+		ref->cur_node = lm_message_node_add_child (ref->cur_node,
+							   node_name, NULL);
+	}
+
+	for (i = 0; attribute_names[i]; ++i) {
+		lm_message_node_set_attribute (ref->cur_node,
+					       attribute_names[i],
+					       attribute_values[i]);
+	}
+
+	if (strcmp (node_name, "stream:stream") == 0) {
+		reference_end_element (context, node_name, user_data, error);
+	}
+}
+
+static void
+reference_text (GMarkupParseContext  *context,
+		const gchar          *text,
+		gsize                 text_len,
+		gpointer              user_data,
+		GError              **error)
+{
+	ReferenceParser *ref = user_data;
+
+	if (ref->cur_node && text_len > 0) {
+		const gchar *old_value;
+		gchar       *value;
+
+		old_value = lm_message_node_get_value (ref->cur_node);
+		value = g_strdup_printf ("%s%.*s", old_value ? old_value : "",
+					 (int) text_len, text);
+
+		lm_message_node_set_value (ref->cur_node, value);
+		g_free (value);
+	}
+}
+
+static gboolean
+reference_parse (const gchar *document, GSList **messages)
+{
+	GMarkupParser        markup_parser = { 
+		reference_start_element,
+		reference_end_element,
+		reference_text,
+		NULL,
+		NULL
+	};
+	GMarkupParseContext *context;
+	ReferenceParser      ref = { NULL, NULL, NULL, NULL };
+	gboolean             result;
+
+	ref.holder = lm_message_new (NULL, LM_MESSAGE_TYPE_MESSAGE);
+
+	context = g_markup_parse_context_new (&markup_parser, 0, &ref, NULL);
+	result = g_markup_parse_context_parse (context, document, -1, NULL);
+	g_markup_parse_context_free (context);
+
+	lm_message_unref (ref.holder);
+	*messages = ref.messages;
+
+	return result;
+}
+
+static void
+collect_message_cb (LmParser *parser, LmMessage *m, gpointer user_data)
+{
+	GSList **messages = user_data;
+
+	*messages = g_slist_append (*messages, 
+				    lm_message_node_to_string (m->node));
+}
+
+static gboolean
+lm_parse_in_chunks (const gchar  *document, 
+		    gsize         chunk_size, 
+		    gboolean      lazy,
+		    GSList      **messages)
+{
+	LmParser    *parser;
+	const gchar *p;
+	gsize        len;
+	gboolean     result = TRUE;
+
+	*messages = NULL;
+	parser = lm_parser_new (collect_message_cb, messages, NULL);
+	lm_parser_set_lazy (parser, lazy);
+
+	len = strlen (document);
+	if (chunk_size == 0) {
+		chunk_size = len;
+	}
+
+	for (p = document; p < document + len && result; p += chunk_size) {
+		result = lm_parser_parse_len (parser, p, 
+					      MIN (chunk_size, 
+						   (gsize) (document + len - p)));
+	}
+
+	lm_parser_free (parser);
+
+	return result;
+}
+
+static void
+free_messages (GSList *messages)
+{
+	g_slist_foreach (messages, (GFunc) g_free, NULL);
+	g_slist_free (messages);
+}
+
+static void
+test_differential (const gchar *document)
+{
+	GSList   *expected;
+	gboolean  expected_result;
+	guint     i;
+
+	expected_result = reference_parse (document, &expected);
+
+	/* Every chunk size, first building the whole tree and then lazily */
+	for (i = 0; i < 2 * G_N_ELEMENTS (chunk_sizes); i++) {
+		GSList   *messages, *l, *e;
+		gboolean  result;
+		gsize     chunk_size;
+		gboolean  lazy;
+
+		chunk_size = chunk_sizes[i % G_N_ELEMENTS (chunk_sizes)];
+		lazy = i >= G_N_ELEMENTS (chunk_sizes);
+
+		result = lm_parse_in_chunks (document, chunk_size, lazy, 
+					     &messages);
+
+		g_assert (result == expected_result);
+		g_assert (g_slist_length (messages) == g_slist_length (expected));
+
+		for (l = messages, e = expected; l; l = l->next, e = e->next) {
+			g_assert_cmpstr (l->data, ==, e->data);
+		}
+
+		free_messages (messages);
+	}
+
+	free_messages (expected);
+}
 
 static GSList *
 get_files (const gchar *prefix) 
@@ -85,6 +287,23 @@ test_parser_with_file (const gchar *file_path, gboolean is_valid)
 	g_free (file_contents);
 }
 
+static void
+test_differential_with_file (const gchar *file_path)
+{
+	gchar  *file_contents;
+	GError *error = NULL;
+
+	if (!g_file_get_contents (file_path, &file_contents, NULL, &error)) {
+		g_error ("Couldn't read file '%s': %s",
+			 file_path, error->message);
+		g_clear_error (&error);
+		return;
+	}
+
+	test_differential (file_contents);
+	g_free (file_contents);
+}
+
 static void
 test_valid_suite ()
 {
@@ -111,6 +330,1385 @@ test_invalid_suite ()
 	g_slist_free (list);
 }
 
+static void
+test_differential_suite ()
+{
+	GSList *list, *l;
+
+	list = get_files ("");
+	for (l = list; l; l = l->next) {
+		test_differential_with_file ((const gchar *) l->data);
+		g_free (l->data);
+	}
+	g_slist_free (list);
+}
+
+static void
+test_differential_constructs ()
+{
+	static const gchar *documents[] = {
+		"<stream:stream xmlns='jabber:client' "
+		"xmlns:stream='http://etherx.jabber.org/streams'>"
+		"<message to='a@b' from='c@d/e' type='chat' id='1'>"
+		"<body>a &lt;b&gt; &amp; &quot;c&quot; &apos;d&apos;</body>"
+		"<x xmlns='jabber:x:event'><composing/></x>"
+		"</message>  <presence/>\n<iq type='get' id='2'/>",
+
+		"<stream:stream>\n  <message id = \"&amp;&#65;&#x42;&#x263a;\" "
+		"to='a\tb\r\nc\nd'>\r\n<body>x\r\ny\rz&#x10000;</body>"
+		"<!-- comment --><?pi data?></message>",
+
+		"<stream:stream><message><body>k\xc3\xa4se</body>"
+		"<empty  /><other attr=\"'\" attr2='\"' /></message>",
+
+		"<stream:stream><message>before <b>bold</b> after"
+		"<!-- c --> &amp;<i/>end</message>",
+
+		"<stream:stream><message><body>&unknown;</body></message>",
+		"<stream:stream><message><body>&#0;</body></message>",
+		"<stream:stream><message><body>a\xff" "b</body></message>",
+		"<stream:stream><message to=unquoted/>",
+		"<stream:stream><message/ >",
+		"<stream:stream><message></presence>",
+		"text before the root element<stream:stream>",
+		"<stream:stream><1message/>",
+	};
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (documents); i++) {
+		test_differential (documents[i]);
+	}
+}
+
+static void
+test_embedded_nul ()
+{
+	static const gchar stream[] = 
+		"<stream:stream><message><body>ab\0cd</body></message>";
+	static const gchar between[] = 
+		"<stream:stream>\0<message/>";
+	LmParser *parser;
+
+	parser = lm_parser_new (NULL, NULL, NULL);
+	g_assert (!lm_parser_parse_len (parser, stream, sizeof (stream) - 1));
+	lm_parser_free (parser);
+
+	parser = lm_parser_new (NULL, NULL, NULL);
+	g_assert (!lm_parser_parse_len (parser, between, sizeof (between) - 1));
+	lm_parser_free (parser);
+}
+
+static void
+keep_child_cb (LmParser *parser, LmMessage *m, gpointer user_data)
+{
+	LmMessageNode **child = user_data;
+	LmMessageNode  *body;
+
+	body = lm_message_node_get_child (m->node, "body");
+	if (body) {
+		*child = lm_message_node_ref (body);
+	}
+}
+
+static void
+test_node_outlives_stanza ()
+{
+	LmParser      *parser;
+	LmMessageNode *child = NULL;
+
+	parser = lm_parser_new (keep_child_cb, &child, NULL);
+	g_assert (lm_parser_parse (parser, 
+				   "<stream:stream><message to='a@b'>"
+				   "<body lang='en'>hi &amp; bye</body>"
+				   "</message>"));
+	lm_parser_free (parser);
+
+	g_assert (child != NULL);
+	g_assert_cmpstr (lm_message_node_get_value (child), ==, "hi & bye");
+	g_assert_cmpstr (lm_message_node_get_attribute (child, "lang"), ==, 
+			 "en");
+
+	/* Setters replace strings owned by the parser */
+	lm_message_node_set_value (child, "changed");
+	lm_message_node_set_attribute (child, "lang", "sv");
+	g_assert_cmpstr (lm_message_node_get_value (child), ==, "changed");
+	g_assert_cmpstr (lm_message_node_get_attribute (child, "lang"), ==, 
+			 "sv");
+
+	lm_message_node_unref (child);
+}
+
+static void
+last_message_cb (LmParser *parser, LmMessage *m, gpointer user_data)
+{
+	LmMessage **last = user_data;
+
+	if (*last) {
+		lm_message_unref (*last);
+	}
+	*last = lm_message_ref (m);
+}
+
+static void
+test_message_types ()
+{
+	static const struct {
+		const gchar      *stanza;
+		LmMessageType     type;
+		LmMessageSubType  sub_type;
+	} stanzas[] = {
+		{ "<message type='chat'/>",
+		  LM_MESSAGE_TYPE_MESSAGE, LM_MESSAGE_SUB_TYPE_CHAT },
+		{ "<message/>",
+		  LM_MESSAGE_TYPE_MESSAGE, LM_MESSAGE_SUB_TYPE_NOT_SET },
+		{ "<presence type='unavailable'/>",
+		  LM_MESSAGE_TYPE_PRESENCE, LM_MESSAGE_SUB_TYPE_UNAVAILABLE },
+		{ "<iq type='Result'/>",
+		  LM_MESSAGE_TYPE_IQ, LM_MESSAGE_SUB_TYPE_RESULT },
+		{ "<iq type='bogus'/>",
+		  LM_MESSAGE_TYPE_IQ, LM_MESSAGE_SUB_TYPE_NOT_SET },
+		{ "<stream:error/>",
+		  LM_MESSAGE_TYPE_STREAM_ERROR, LM_MESSAGE_SUB_TYPE_NORMAL },
+		{ "<stream:features/>",
+		  LM_MESSAGE_TYPE_STREAM_FEATURES, LM_MESSAGE_SUB_TYPE_NORMAL }
+	};
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (stanzas); i++) {
+		LmParser  *parser;
+		LmMessage *m = NULL;
+
+		parser = lm_parser_new (last_message_cb, &m, NULL);
+		g_assert (lm_parser_parse (parser, "<stream:stream>"));
+		g_assert (lm_parser_parse (parser, stanzas[i].stanza));
+		lm_parser_free (parser);
+
+		g_assert (m != NULL);
+		g_assert_cmpint (lm_message_get_type (m), ==, stanzas[i].type);
+		g_assert_cmpint (lm_message_get_sub_type (m), ==, 
+				 stanzas[i].sub_type);
+		lm_message_unref (m);
+	}
+}
+
+static void
+test_lazy ()
+{
+	LmParser      *parser;
+	LmMessage     *m = NULL;
+	LmMessageNode *item;
+
+	parser = lm_parser_new (last_message_cb, &m, NULL);
+	lm_parser_set_lazy (parser, TRUE);
+
+	g_assert (lm_parser_parse (parser, 
+				   "<stream:stream><iq type='result' id='1'>"
+				   "<query xmlns='jabber:iq:roster'>"
+				   "<item jid='a@b' name='&lt;A&gt;'/>"
+				   "<item jid='c@d'/></query>"));
+	g_assert (lm_parser_parse (parser, "</iq>"));
+	lm_parser_free (parser);
+
+	g_assert (m != NULL);
+	g_assert_cmpint (lm_message_get_sub_type (m), ==, 
+			 LM_MESSAGE_SUB_TYPE_RESULT);
+	g_assert_cmpstr (lm_message_node_get_attribute (m->node, "id"), ==, "1");
+
+	/* Nothing below the root is built until asked for */
+	g_assert (m->node->children == NULL);
+
+	item = lm_message_node_find_child (m->node, "item");
+	g_assert (item != NULL);
+	g_assert_cmpstr (lm_message_node_get_attribute (item, "name"), ==, 
+			 "<A>");
+	g_assert_cmpstr (lm_message_node_get_attribute (item->next, "jid"), ==,
+			 "c@d");
+	g_assert (m->node->children == item->parent);
+
+	lm_message_unref (m);
+}
+
+static void
+test_keep_raw ()
+{
+	LmParser      *parser;
+	LmMessage     *m = NULL;
+	LmMessageNode *body;
+	const gchar   *raw;
+	gsize          len;
+
+	parser = lm_parser_new (last_message_cb, &m, NULL);
+	lm_parser_set_lazy (parser, TRUE);
+	lm_parser_set_keep_raw (parser, TRUE);
+
+	/* Split inside the root start tag and its content */
+	g_assert (lm_parser_parse (parser, 
+				   "<stream:stream><message to='a@b' "));
+	g_assert (lm_parser_parse (parser, "type=\"chat\"><body>x &amp;"));
+	g_assert (lm_parser_parse (parser, " y</body> </message>"));
+
+	raw = lm_message_get_raw_stanza (m, &len);
+	g_assert_cmpstr (raw, ==, "<message to='a@b' type=\"chat\">"
+			 "<body>x &amp; y</body> </message>");
+	g_assert_cmpint (len, ==, strlen (raw));
+
+	body = lm_message_node_get_child (m->node, "body");
+	g_assert_cmpstr (lm_message_node_get_value (body), ==, "x & y");
+
+	g_assert (lm_parser_parse (parser, "<presence from='c@d'/>"));
+	g_assert_cmpstr (lm_message_get_raw_stanza (m, NULL), ==, 
+			 "<presence from='c@d'/>");
+
+	lm_parser_set_keep_raw (parser, FALSE);
+	g_assert (lm_parser_parse (parser, "<presence/>"));
+	g_assert (lm_message_get_raw_stanza (m, NULL) == NULL);
+
+	lm_parser_free (parser);
+	lm_message_unref (m);
+}
+
+static void
+test_node_path ()
+{
+	LmParser       *parser;
+	LmMessage      *m = NULL;
+	LmNodePath     *path;
+	LmNodePathIter  iter;
+	const gchar    *value;
+	GError         *error = NULL;
+
+	parser = lm_parser_new (last_message_cb, &m, NULL);
+	lm_parser_set_lazy (parser, TRUE);
+	g_assert (lm_parser_parse (parser, 
+				   "<stream:stream><iq type='result' id='1'>"
+				   "<query xmlns='jabber:iq:version'><name>x</name>"
+				   "</query><query xmlns='jabber:iq:roster'>"
+				   "<item jid='a@b'><group>g</group></item><item/>"
+				   "<item jid='c@d'/></query><query "
+				   "xmlns='jabber:iq:roster'><item jid='e@f'/>"
+				   "</query></iq>"));
+	lm_parser_free (parser);
+
+	path = lm_node_path_new ("query[@xmlns='jabber:iq:roster']/item/@jid", 
+				 &error);
+	g_assert (error == NULL);
+
+	/* Items without a jid are skipped, matches come in document order
+	 * across all the matching queries */
+	lm_node_path_iter_init (&iter, path, m->node);
+	g_assert (lm_node_path_iter_next (&iter, &value) != NULL);
+	g_assert_cmpstr (value, ==, "a@b");
+	g_assert (lm_node_path_iter_next (&iter, &value) != NULL);
+	g_assert_cmpstr (value, ==, "c@d");
+	g_assert (lm_node_path_iter_next (&iter, &value) != NULL);
+	g_assert_cmpstr (value, ==, "e@f");
+	g_assert (lm_node_path_iter_next (&iter, &value) == NULL);
+	g_assert (lm_node_path_iter_next (&iter, &value) == NULL);
+	lm_node_path_unref (path);
+
+	path = lm_node_path_new ("*/item[@jid]/group", NULL);
+	g_assert_cmpstr (lm_node_path_get_value (path, m->node), ==, "g");
+	lm_node_path_unref (path);
+
+	path = lm_node_path_new ("query[@xmlns=\"jabber:iq:version\"]/item", 
+				 NULL);
+	g_assert (lm_node_path_find (path, m->node) == NULL);
+	lm_node_path_unref (path);
+
+	path = lm_node_path_new ("@id", NULL);
+	g_assert_cmpstr (lm_node_path_get_value (path, m->node), ==, "1");
+	lm_node_path_unref (path);
+
+	g_assert (lm_node_path_new ("query[@xmlns='a'", &error) == NULL);
+	g_assert (error != NULL && error->domain == LM_ERROR && 
+		  error->code == LM_ERROR_INVALID_PATH);
+	g_clear_error (&error);
+	g_assert (lm_node_path_new ("query/@jid/item", NULL) == NULL);
+	g_assert (lm_node_path_new ("query//item", NULL) == NULL);
+
+	lm_message_unref (m);
+}
+
+static void
+test_stanza_template ()
+{
+	LmMessage        *m;
+	LmMessageNode    *body;
+	LmStanzaTemplate *tmpl;
+	const gchar      *values[3];
+	gchar            *str;
+
+	m = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_MESSAGE,
+					  LM_MESSAGE_SUB_TYPE_HEADLINE);
+	body = lm_message_node_add_child (m->node, "body", NULL);
+	lm_message_node_add_child (m->node, "x", "fixed");
+
+	tmpl = lm_stanza_template_new (m);
+	g_assert_cmpuint (lm_stanza_template_add_slot (tmpl, body, NULL), ==, 0);
+	g_assert_cmpuint (lm_stanza_template_add_slot (tmpl, m->node, "to"), ==, 1);
+	g_assert_cmpuint (lm_stanza_template_add_slot (tmpl, m->node, "to"), ==, 1);
+	g_assert_cmpuint (lm_stanza_template_add_slot (tmpl, m->node, "id"), ==, 2);
+	g_assert_cmpuint (lm_stanza_template_get_n_slots (tmpl), ==, 3);
+	lm_message_unref (m);
+
+	values[0] = "<hi & bye>";
+	values[1] = "a@b";
+	values[2] = "n1";
+	str = lm_stanza_template_to_string (tmpl, values);
+	g_assert_cmpstr (str, ==, 
+			 "<message id=\"n1\" type=\"headline\" to=\"a@b\">"
+			 "<body>&lt;hi &amp; bye&gt;</body><x>fixed</x></message>");
+	g_free (str);
+
+	values[0] = NULL;
+	values[1] = "c'd";
+	str = lm_stanza_template_to_string (tmpl, values);
+	g_assert_cmpstr (str, ==, 
+			 "<message id=\"n1\" type=\"headline\" to=\"c&apos;d\">"
+			 "<body></body><x>fixed</x></message>");
+	g_free (str);
+
+	lm_stanza_template_unref (tmpl);
+}
+
+static void
+test_clone_shallow ()
+{
+	LmMessage     *m;
+	LmMessage     *clone;
+	LmMessageNode *node;
+	gchar         *str;
+
+	m = lm_message_new ("a@b", LM_MESSAGE_TYPE_PRESENCE);
+	lm_message_node_set_attribute (m->node, "id", "1");
+	node = lm_message_node_add_child (m->node, "c", NULL);
+	lm_message_node_set_attribute (node, "ver", "v&1");
+	lm_message_node_add_child (node, "x", "y");
+	lm_message_node_add_child (m->node, "status", "here");
+
+	clone = lm_message_clone_shallow (m);
+	g_assert_cmpint (lm_message_get_type (clone), ==, 
+			 LM_MESSAGE_TYPE_PRESENCE);
+	g_assert (clone->node->children == m->node->children);
+
+	/* Shared nodes are written from what was kept the first time */
+	lm_message_node_set_attribute (clone->node, "to", "c@d");
+	str = lm_message_node_to_string (clone->node);
+	g_assert_cmpstr (str, ==, 
+			 "<presence id=\"1\" to=\"c@d\"><c ver=\"v&amp;1\">"
+			 "<x>y</x></c><status>here</status></presence>");
+	g_free (str);
+
+	/* Searching doesn't copy anything, only the path to what is
+	 * found and may be changed is */
+	g_assert (lm_message_node_find_child (clone->node, "y") == NULL);
+	g_assert (clone->node->children == m->node->children);
+
+	node = lm_message_node_find_child (clone->node, "status");
+	g_assert (node != NULL && node->parent == clone->node);
+	g_assert (clone->node->children != m->node->children);
+	g_assert (clone->node->children->children == 
+		  m->node->children->children);
+
+	/* Asking for a shared child copies it first */
+	node = lm_message_node_find_child (clone->node, "x");
+	g_assert (node != NULL);
+	g_assert (clone->node->children->children != 
+		  m->node->children->children);
+	lm_message_node_set_value (node, "z");
+	lm_message_node_add_child (clone->node, "priority", "1");
+
+	str = lm_message_node_to_string (m->node);
+	g_assert_cmpstr (str, ==, 
+			 "<presence id=\"1\" to=\"a@b\"><c ver=\"v&amp;1\">"
+			 "<x>y</x></c><status>here</status></presence>");
+	g_free (str);
+	lm_message_unref (m);
+
+	str = lm_message_node_to_string (clone->node);
+	g_assert_cmpstr (str, ==, 
+			 "<presence id=\"1\" to=\"c@d\"><c ver=\"v&amp;1\">"
+			 "<x>z</x></c><status>here</status>"
+			 "<priority>1</priority></presence>");
+	g_free (str);
+	lm_message_unref (clone);
+}
+
+/* Copies that outlive the message they were made from */
+static void
+test_clone_outlives_original ()
+{
+	LmMessage     *m;
+	LmMessage     *clone;
+	LmMessage     *clone2;
+	LmMessageNode *node;
+	LmMessageNode *l;
+	gchar         *str;
+
+	m = lm_message_new ("a@b", LM_MESSAGE_TYPE_MESSAGE);
+	node = lm_message_node_add_child (m->node, "c", NULL);
+	node = lm_message_node_add_child (node, "d", NULL);
+	lm_message_node_add_child (node, "e", "1");
+	lm_message_node_add_child (m->node, "body", "hi");
+
+	/* A copy of a copy that had only its top level copied, its 
+	 * children are shared with both of the others */
+	clone = lm_message_clone_shallow (m);
+	clone2 = lm_message_clone_shallow (clone);
+	g_assert (lm_message_node_get_children (clone->node) != NULL);
+	lm_message_unref (m);
+	lm_message_unref (clone);
+
+	/* The parents of the shared nodes are still there to be read */
+	for (l = clone2->node->children; l; l = l->next) {
+		for (node = l; node; node = node->children) {
+			if (node->parent) {
+				g_assert (node->parent->name != NULL);
+			}
+		}
+	}
+
+	/* Changes go through copies of the nodes, whose parents are in 
+	 * @clone2 */
+	node = lm_message_node_find_child (clone2->node, "e");
+	g_assert (node != NULL);
+	g_assert (node->parent->parent->parent == clone2->node);
+	lm_message_node_set_value (node, "2");
+	lm_message_node_set_attribute (node->parent, "x", "y");
+
+	for (l = lm_message_node_get_children (clone2->node); l; l = l->next) {
+		g_assert (l->parent == clone2->node);
+	}
+
+	str = lm_message_node_to_string (clone2->node->children);
+	g_assert_cmpstr (str, ==, "<c><d x=\"y\"><e>2</e></d></c>");
+	g_free (str);
+	node = lm_message_node_get_child (clone2->node, "body");
+	g_assert_cmpstr (lm_message_node_get_value (node), ==, "hi");
+	lm_message_unref (clone2);
+}
+
+static void
+test_static_strings ()
+{
+	static const gchar ns[] = "urn:example:ping";
+	static const gchar text[] = "ping";
+	LmMessage         *m;
+	LmMessage         *clone;
+	LmMessageNode     *node;
+	gchar             *str;
+
+	m = lm_message_new ("a@b", LM_MESSAGE_TYPE_IQ);
+	node = lm_message_node_add_child_static (m->node, "ping", text);
+	lm_message_node_set_attribute_static (node, "xmlns", ns);
+	lm_message_node_set_attribute_static (node, "x-seq", text);
+
+	/* Only referenced, not copied */
+	g_assert (lm_message_node_get_value (node) == text);
+	g_assert (lm_message_node_get_attribute (node, "xmlns") == ns);
+
+	clone = lm_message_clone_shallow (m);
+	lm_message_node_set_attribute_static (clone->node, "xmlns", ns);
+	lm_message_unref (m);
+
+	/* Replacing a static value with a copied one and back */
+	node = lm_message_node_get_child (clone->node, "ping");
+	lm_message_node_set_attribute (node, "x-seq", "2");
+	lm_message_node_set_value (node, "pong");
+	lm_message_node_set_value_static (node, text);
+
+	str = lm_message_node_to_string (clone->node);
+	g_assert (g_str_has_suffix (str, "xmlns=\"urn:example:ping\">"
+				    "<ping xmlns=\"urn:example:ping\" "
+				    "x-seq=\"2\">ping</ping></iq>"));
+	g_free (str);
+	lm_message_unref (clone);
+}
+
+static void
+test_alloc_stats ()
+{
+	LmAllocStats  messages;
+	LmAllocStats  nodes;
+	LmAllocStats  stats;
+	LmMessage    *m;
+
+	lm_alloc_get_stats (LM_ALLOC_MESSAGE, &messages);
+	lm_alloc_get_stats (LM_ALLOC_NODE, &nodes);
+
+	m = lm_message_new ("a@b", LM_MESSAGE_TYPE_MESSAGE);
+	lm_message_node_add_child (m->node, "body", "x");
+
+	lm_alloc_get_stats (LM_ALLOC_MESSAGE, &stats);
+	g_assert_cmpuint (stats.n_live, ==, messages.n_live + 1);
+	g_assert_cmpuint (stats.n_allocated, ==, messages.n_allocated + 1);
+	lm_alloc_get_stats (LM_ALLOC_NODE, &stats);
+	g_assert_cmpuint (stats.n_live, ==, nodes.n_live + 2);
+	g_assert_cmpuint (stats.bytes_live, ==, 
+			  nodes.bytes_live + 2 * sizeof (LmMessageNode));
+
+	lm_message_unref (m);
+
+	lm_alloc_get_stats (LM_ALLOC_MESSAGE, &stats);
+	g_assert_cmpuint (stats.n_live, ==, messages.n_live);
+	lm_alloc_get_stats (LM_ALLOC_NODE, &stats);
+	g_assert_cmpuint (stats.n_live, ==, nodes.n_live);
+	g_assert_cmpuint (stats.bytes_live, ==, nodes.bytes_live);
+}
+
+static gpointer
+counting_alloc (gsize size, gpointer context)
+{
+	gsize *bytes = context;
+
+	*bytes += size;
+
+	return g_malloc (size);
+}
+
+static void
+counting_free (gpointer mem, gsize size, gpointer context)
+{
+	gsize *bytes = context;
+
+	*bytes -= size;
+
+	g_free (mem);
+}
+
+static void
+test_allocator ()
+{
+	LmAllocator  allocator = { counting_alloc, NULL, counting_free, NULL };
+	LmAllocStats before;
+	LmAllocStats after;
+	LmParser    *parser;
+	LmMessage   *m = NULL;
+	gsize        bytes = 0;
+
+	allocator.context = &bytes;
+	lm_alloc_get_stats (LM_ALLOC_MESSAGE, &before);
+
+	parser = lm_parser_new (last_message_cb, &m, NULL);
+	lm_parser_set_allocator (parser, &allocator);
+	g_assert (lm_parser_parse (parser, 
+				   "<stream:stream><message to='a@b'>"
+				   "<body>x</body></message>"));
+	lm_parser_free (parser);
+
+	/* The message and its nodes live in memory of the allocator */
+	g_assert (m != NULL);
+	g_assert (bytes > 0);
+	lm_alloc_get_stats (LM_ALLOC_MESSAGE, &after);
+	g_assert_cmpuint (after.n_live, ==, before.n_live);
+	g_assert_cmpstr (lm_message_node_get_value (
+				 lm_message_node_get_child (m->node, "body")),
+			 ==, "x");
+
+	lm_message_unref (m);
+	g_assert_cmpuint (bytes, ==, 0);
+}
+
+typedef struct {
+	gsize bytes;
+	gsize limit;
+} AllocLimit;
+
+static gpointer
+limited_alloc (gsize size, gpointer context)
+{
+	AllocLimit *limit = context;
+
+	if (limit->bytes + size > limit->limit) {
+		return NULL;
+	}
+	limit->bytes += size;
+
+	return g_malloc (size);
+}
+
+static void
+limited_free (gpointer mem, gsize size, gpointer context)
+{
+	AllocLimit *limit = context;
+
+	limit->bytes -= size;
+
+	g_free (mem);
+}
+
+static void
+test_allocator_limit ()
+{
+	LmAllocator  allocator = { limited_alloc, NULL, limited_free, NULL };
+	AllocLimit   limit = { 0, 0 };
+	LmParser    *parser;
+	GString     *xml;
+	gboolean     parsed_all = FALSE;
+	gint         i;
+
+	allocator.context = &limit;
+
+	xml = g_string_new ("<message to='a@b' from='c@d/e' id='x1'>");
+	for (i = 0; i < 50; i++) {
+		g_string_append_printf (xml, "<item n%d='%d'>text %d</item>", 
+					i, i, i);
+	}
+	g_string_append (xml, "</message>");
+
+	/* Running out anywhere fails the stanza as a limit, not as bad
+	 * data, and leaves nothing of it behind. Short reads make the
+	 * parser buffer the tokens cut by them. */
+	for (limit.limit = 0; !parsed_all; limit.limit += 256) {
+		LmMessage *m = NULL;
+		gboolean   ok;
+		gsize      chunk = limit.limit % 512 == 0 ? xml->len : 7;
+		gsize      j;
+
+		parser = lm_parser_new (last_message_cb, &m, NULL);
+		lm_parser_set_allocator (parser, &allocator);
+		lm_parser_set_keep_raw (parser, limit.limit % 512 == 0);
+
+		ok = lm_parser_parse (parser, "<stream:stream>");
+		for (j = 0; ok && j < xml->len; j += chunk) {
+			ok = lm_parser_parse_len (parser, xml->str + j, 
+						  MIN (chunk, xml->len - j));
+		}
+		g_assert (ok || lm_parser_hit_limit (parser));
+		lm_parser_free (parser);
+
+		if (ok) {
+			gchar *str;
+			gsize  bytes;
+
+			g_assert_cmpint (lm_message_get_type (m), ==, 
+					 LM_MESSAGE_TYPE_MESSAGE);
+			parsed_all = TRUE;
+
+			/* Written again, the root keeps its serialized form,
+			 * which is counted with the stanza */
+			str = lm_message_node_to_string (m->node);
+			g_free (str);
+			bytes = limit.bytes;
+			limit.limit = G_MAXSIZE;
+			str = lm_message_node_to_string (m->node);
+			g_free (str);
+			g_assert_cmpuint (limit.bytes, >, bytes);
+		}
+		if (m) {
+			lm_message_unref (m);
+		}
+
+		g_assert_cmpuint (limit.bytes, ==, 0);
+	}
+
+	parser = lm_parser_new (NULL, NULL, NULL);
+	g_assert (!lm_parser_parse (parser, "<a></b>"));
+	g_assert (!lm_parser_hit_limit (parser));
+	lm_parser_free (parser);
+
+	g_string_free (xml, TRUE);
+}
+
+/* Parses @xml on a fresh stream in pieces of @chunk bytes */
+static gboolean
+parse_stanza_in_chunks (LmParser   *parser, 
+			LmMessage **m, 
+			GString    *xml,
+			gsize       chunk)
+{
+	gsize i;
+
+	lm_parser_reset (parser);
+	g_assert (lm_parser_parse (parser, "<stream:stream>"));
+	lm_message_unref (*m);
+	*m = NULL;
+
+	for (i = 0; i < xml->len; i += chunk) {
+		if (!lm_parser_parse_len (parser, xml->str + i,
+					  MIN (chunk, xml->len - i))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+test_max_stanza_size ()
+{
+	LmParser  *parser;
+	LmMessage *m = NULL;
+	GString   *xml;
+	gint       i;
+
+	xml = g_string_new ("<message to='a@b'><body>");
+	for (i = 0; i < 100; i++) {
+		g_string_append (xml, "0123456789");
+	}
+	g_string_append (xml, "</body></message>");
+
+	parser = lm_parser_new (last_message_cb, &m, NULL);
+	g_assert_cmpuint (lm_parser_get_max_stanza_size (parser), ==, 0);
+	lm_parser_set_max_stanza_size (parser, xml->len);
+
+	/* Right at the limit, also when it comes in pieces */
+	g_assert (parse_stanza_in_chunks (parser, &m, xml, xml->len));
+	g_assert_cmpint (lm_message_get_type (m), ==, LM_MESSAGE_TYPE_MESSAGE);
+	g_assert (parse_stanza_in_chunks (parser, &m, xml, 3));
+	g_assert_cmpint (lm_message_get_type (m), ==, LM_MESSAGE_TYPE_MESSAGE);
+
+	/* One byte more is too much, wherever the stanza is cut */
+	g_string_insert_len (xml, xml->len - strlen ("</body></message>"), 
+			     "x", 1);
+	g_assert (!parse_stanza_in_chunks (parser, &m, xml, xml->len));
+	g_assert (lm_parser_hit_limit (parser));
+	g_assert (m == NULL);
+	g_assert (!parse_stanza_in_chunks (parser, &m, xml, 100));
+	g_assert (lm_parser_hit_limit (parser));
+	g_assert (m == NULL);
+
+	/* A tag that never ends is cut off too */
+	g_string_assign (xml, "<message a='");
+	for (i = 0; i < 200; i++) {
+		g_string_append (xml, "0123456789");
+	}
+	g_assert (!parse_stanza_in_chunks (parser, &m, xml, 10));
+	g_assert (lm_parser_hit_limit (parser));
+
+	/* The stream doesn't count against the limit, only stanzas do */
+	g_string_truncate (xml, 0);
+	for (i = 0; i < 200; i++) {
+		g_string_append (xml, "<presence/>  ");
+	}
+	g_assert (parse_stanza_in_chunks (parser, &m, xml, 64));
+	g_assert_cmpint (lm_message_get_type (m), ==, 
+			 LM_MESSAGE_TYPE_PRESENCE);
+
+	lm_message_unref (m);
+	lm_parser_free (parser);
+	g_string_free (xml, TRUE);
+}
+
+static void
+test_wire_cache ()
+{
+	LmMessage     *m;
+	LmMessage     *clone;
+	LmMessageNode *node;
+	gchar         *str;
+	gchar         *big;
+	gint           i;
+
+	m = lm_message_new (NULL, LM_MESSAGE_TYPE_PRESENCE);
+	lm_message_node_set_attribute (m->node, "id", "1");
+	node = lm_message_node_add_child (m->node, "c", NULL);
+	node = lm_message_node_add_child (node, "x", "a<b");
+
+	/* Kept from the second time on, every setter drops it */
+	for (i = 0; i < 3; i++) {
+		str = lm_message_node_to_string (m->node);
+		g_assert_cmpstr (str, ==, 
+				 "<presence id=\"1\"><c><x>a&lt;b</x></c></presence>");
+		g_free (str);
+	}
+
+	/* Only by the node the write started from and its children */
+	g_assert (m->node->wire != NULL && node->parent->wire != NULL);
+	g_assert (node->wire == NULL);
+
+	lm_message_node_set_value (node, "b");
+	str = lm_message_node_to_string (m->node);
+	g_assert_cmpstr (str, ==, "<presence id=\"1\"><c><x>b</x></c></presence>");
+	g_free (str);
+
+	lm_message_node_set_raw_mode (node, TRUE);
+	lm_message_node_set_value (node, "<y/>");
+	str = lm_message_node_to_string (m->node);
+	g_free (str);
+	lm_message_node_add_child (node->parent, "z", NULL);
+	str = lm_message_node_to_string (m->node);
+	g_assert_cmpstr (str, ==, 
+			 "<presence id=\"1\"><c><x><y/></x><z/></c></presence>");
+	g_free (str);
+
+	/* Shared children keep theirs for the next copy, the nodes below
+	 * them don't */
+	clone = lm_message_clone_shallow (m);
+	str = lm_message_node_to_string (clone->node);
+	g_free (str);
+	g_assert (clone->node->wire == NULL);
+	g_assert (node->parent->wire != NULL && node->wire == NULL);
+	lm_message_unref (clone);
+
+	/* Nor is anything large */
+	big = g_strnfill (20000, 'a');
+	lm_message_node_set_value (node, big);
+	for (i = 0; i < 2; i++) {
+		str = lm_message_node_to_string (m->node);
+		g_free (str);
+	}
+	g_assert (m->node->wire == NULL);
+	g_free (big);
+
+	lm_message_unref (m);
+}
+
+static void
+test_append_children ()
+{
+	LmMessage     *m;
+	LmMessage     *clone;
+	LmMessageNode *l;
+	gchar          name[16];
+	gint           i;
+
+	m = lm_message_new (NULL, LM_MESSAGE_TYPE_MESSAGE);
+	for (i = 0; i < 1000; i++) {
+		g_snprintf (name, sizeof (name), "c%d", i);
+		lm_message_node_add_child (m->node, name, NULL);
+	}
+
+	/* Appending to a clone gives it its own list first */
+	clone = lm_message_clone_shallow (m);
+	lm_message_node_add_child (clone->node, "last", NULL);
+
+	for (i = 0, l = m->node->children; l; l = l->next, i++) {
+		g_snprintf (name, sizeof (name), "c%d", i);
+		g_assert_cmpstr (l->name, ==, name);
+		g_assert (l->parent == m->node);
+		g_assert (l->prev == NULL || l->prev->next == l);
+	}
+	g_assert_cmpint (i, ==, 1000);
+
+	for (i = 0, l = clone->node->children; l->next; l = l->next, i++) {
+		g_snprintf (name, sizeof (name), "c%d", i);
+		g_assert_cmpstr (l->name, ==, name);
+	}
+	g_assert_cmpint (i, ==, 1000);
+	g_assert_cmpstr (l->name, ==, "last");
+
+	lm_message_unref (clone);
+	lm_message_unref (m);
+}
+
+static void
+test_deep_tree ()
+{
+	const gint     depth = 100000;
+	LmParser      *parser;
+	LmMessage     *m = NULL;
+	LmMessage     *clone;
+	GString       *xml;
+	gchar         *str;
+	gint           i;
+
+	xml = g_string_new ("<message>");
+	for (i = 0; i < depth; i++) {
+		g_string_append (xml, "<a>");
+	}
+	g_string_append (xml, "<b/>");
+	for (i = 0; i < depth; i++) {
+		g_string_append (xml, "</a>");
+	}
+	g_string_append (xml, "</message>");
+
+	parser = lm_parser_new (last_message_cb, &m, NULL);
+	g_assert (lm_parser_parse (parser, "<stream:stream>"));
+	g_assert (lm_parser_parse (parser, xml->str));
+	lm_parser_free (parser);
+	g_assert (m != NULL);
+
+	/* None of these may recurse once per level */
+	g_assert (lm_message_node_find_child (m->node, "b") != NULL);
+	g_assert (lm_message_node_find_child (m->node, "c") == NULL);
+
+	clone = lm_message_clone_shallow (m);
+	for (i = 0; i < 2; i++) {
+		str = lm_message_node_to_string (m->node);
+		g_assert_cmpstr (str, ==, xml->str);
+		g_free (str);
+
+		str = lm_message_node_to_string (clone->node);
+		g_assert_cmpstr (str, ==, xml->str);
+		g_free (str);
+	}
+
+	lm_message_unref (m);
+	lm_message_unref (clone);
+	g_string_free (xml, TRUE);
+}
+
+static LmParserFilterResult
+filter_cb (LmParser     *parser,
+	   const gchar  *name,
+	   const gchar  *xmlns,
+	   const gchar **attribute_names,
+	   const gchar **attribute_values,
+	   gpointer      user_data)
+{
+	guint i;
+
+	if (strcmp (name, "presence") == 0) {
+		return LM_PARSER_FILTER_RAW;
+	}
+
+	for (i = 0; attribute_names[i]; i++) {
+		if (strcmp (attribute_names[i], "type") == 0 &&
+		    strcmp (attribute_values[i], "group&chat") == 0) {
+			return LM_PARSER_FILTER_DROP;
+		}
+	}
+
+	if (xmlns && strcmp (xmlns, "urn:drop") == 0) {
+		return LM_PARSER_FILTER_DROP;
+	}
+
+	return LM_PARSER_FILTER_KEEP;
+}
+
+static void
+raw_cb (LmParser *parser, const gchar *stanza, gsize len, gpointer user_data)
+{
+	GSList **messages = user_data;
+
+	*messages = g_slist_append (*messages, g_strndup (stanza, len));
+}
+
+static void
+test_filter ()
+{
+	static const gchar *document = 
+		"<stream:stream>"
+		"<message type='group&amp;chat'><body>dropped</body></message>"
+		"<presence from='a@b'><status>raw &amp; kept</status></presence>"
+		"<iq xmlns='urn:drop'/>"
+		"<message type='chat'><body>kept</body></message>"
+		"<presence/>";
+	LmParser *parser;
+	GSList   *messages = NULL;
+	guint     i;
+
+	for (i = 0; i < G_N_ELEMENTS (chunk_sizes); i++) {
+		gsize len = strlen (document);
+		gsize chunk_size = chunk_sizes[i] ? chunk_sizes[i] : len;
+		gsize pos;
+
+		messages = NULL;
+		parser = lm_parser_new (collect_message_cb, &messages, NULL);
+		lm_parser_set_filter (parser, filter_cb, raw_cb, &messages);
+
+		for (pos = 0; pos < len; pos += chunk_size) {
+			g_assert (lm_parser_parse_len (parser, document + pos,
+						       MIN (chunk_size, len - pos)));
+		}
+		lm_parser_free (parser);
+
+		g_assert_cmpint (g_slist_length (messages), ==, 4);
+		g_assert_cmpstr (g_slist_nth_data (messages, 1), ==,
+				 "<presence from='a@b'><status>raw &amp; kept"
+				 "</status></presence>");
+		g_assert (strstr (g_slist_nth_data (messages, 2), "kept") != NULL);
+		g_assert_cmpstr (g_slist_nth_data (messages, 3), ==, 
+				 "<presence/>");
+
+		free_messages (messages);
+	}
+
+	messages = NULL;
+
+	/* Dropped stanzas are still checked */
+	parser = lm_parser_new (collect_message_cb, &messages, NULL);
+	lm_parser_set_filter (parser, filter_cb, raw_cb, &messages);
+	g_assert (!lm_parser_parse (parser, 
+				    "<stream:stream><iq xmlns='urn:drop'>"
+				    "<a></b></iq>"));
+	lm_parser_free (parser);
+
+	free_messages (messages);
+}
+
+/* Tokens that end in a later chunk, with '>' and parts of their 
+ * terminators inside them */
+static void
+test_split_tokens ()
+{
+	static const gchar *document =
+		"<stream:stream>"
+		"<message a='x>y\"z' b=\"'>>\"><!-- a > b -- -> -->"
+		"<body><![CDATA[a > b ]] ]> c]]>&amp;&#x263a;</body>"
+		"<?pi a > b ? >?></message>";
+	GSList   *expected;
+	gchar    *big;
+	GString  *body;
+	guint     i;
+
+	g_assert (lm_parse_in_chunks (document, 0, FALSE, &expected));
+	g_assert_cmpint (g_slist_length (expected), ==, 2);
+
+	for (i = 0; i < G_N_ELEMENTS (chunk_sizes); i++) {
+		GSList *messages;
+		GSList *l, *e;
+
+		g_assert (lm_parse_in_chunks (document, chunk_sizes[i], FALSE,
+					      &messages));
+		g_assert_cmpint (g_slist_length (messages), ==, 2);
+		for (l = messages, e = expected; l; l = l->next, e = e->next) {
+			g_assert_cmpstr (l->data, ==, e->data);
+		}
+		free_messages (messages);
+	}
+	free_messages (expected);
+
+	/* A long CDATA section coming in small reads */
+	body = g_string_new ("<stream:stream><message><body><![CDATA[");
+	for (i = 0; i < 100000; i++) {
+		g_string_append (body, "a>]");
+	}
+	g_string_append (body, "]]></body></message>");
+	big = g_string_free (body, FALSE);
+
+	g_assert (lm_parse_in_chunks (big, 7, FALSE, &expected));
+	g_assert_cmpint (g_slist_length (expected), ==, 2);
+	free_messages (expected);
+	g_free (big);
+}
+
+/* Only the tokens cut by the end of a chunk are copied to be parsed 
+ * with the next one, the rest is tokenized where it is */
+static void
+test_pending_copies ()
+{
+	static const gsize odd_sizes[] = { 61, 997, 4093 };
+	GString  *stream;
+	GSList   *expected;
+	gchar    *big;
+	gsize     n_copied;
+	guint     i;
+
+	stream = g_string_new ("<stream:stream>");
+	for (i = 0; i < 500; i++) {
+		g_string_append_printf (stream, 
+					"<message to='a@b/c' id='id%u'>"
+					"<body>hello &amp; world %u</body>"
+					"<!-- c -->"
+					"</message>", i, i);
+	}
+
+	g_assert (lm_parse_in_chunks (stream->str, 0, FALSE, &expected));
+
+	for (i = 0; i < G_N_ELEMENTS (odd_sizes); i++) {
+		LmParser *parser;
+		GSList   *messages = NULL;
+		GSList   *l, *e;
+		gsize     pos;
+		gsize     n_chunks = 0;
+
+		parser = lm_parser_new (collect_message_cb, &messages, NULL);
+		for (pos = 0; pos < stream->len; pos += odd_sizes[i]) {
+			g_assert (lm_parser_parse_len (parser, stream->str + pos,
+						       MIN (odd_sizes[i], 
+							    stream->len - pos)));
+			n_chunks++;
+		}
+		n_copied = _lm_parser_get_n_copied (parser);
+		lm_parser_free (parser);
+
+		/* No token in the stream is longer than 40 bytes, a few
+		 * more are taken to tell what a short one is */
+		g_assert_cmpuint (n_copied, <=, n_chunks * 50);
+		g_assert_cmpuint (n_copied, <, stream->len / 2);
+
+		g_assert_cmpint (g_slist_length (messages), ==, 
+				 g_slist_length (expected));
+		for (l = messages, e = expected; l; l = l->next, e = e->next) {
+			g_assert_cmpstr (l->data, ==, e->data);
+		}
+		free_messages (messages);
+	}
+
+	free_messages (expected);
+	g_string_free (stream, TRUE);
+
+	/* A token spanning many chunks is copied about once */
+	stream = g_string_new ("<stream:stream><message><body><![CDATA[");
+	for (i = 0; i < 10000; i++) {
+		g_string_append (stream, "a>]");
+	}
+	g_string_append (stream, "]]></body></message>");
+	big = g_string_free (stream, FALSE);
+
+	for (i = 0; i < G_N_ELEMENTS (odd_sizes); i++) {
+		LmParser *parser;
+		GSList   *messages = NULL;
+		gsize     len = strlen (big);
+		gsize     pos;
+
+		parser = lm_parser_new (collect_message_cb, &messages, NULL);
+		for (pos = 0; pos < len; pos += odd_sizes[i]) {
+			g_assert (lm_parser_parse_len (parser, big + pos,
+						       MIN (odd_sizes[i], 
+							    len - pos)));
+		}
+		n_copied = _lm_parser_get_n_copied (parser);
+		lm_parser_free (parser);
+
+		g_assert_cmpuint (n_copied, <=, 30000 + 2 * odd_sizes[i]);
+		g_assert_cmpint (g_slist_length (messages), ==, 2);
+		free_messages (messages);
+	}
+
+	g_free (big);
+}
+
+static void
+test_long_spans ()
+{
+	static const struct {
+		const gchar *raw;
+		const gchar *text;
+		const gchar *attribute;
+	} specials[] = {
+		{ "&amp;", "&", "&" },
+		{ "&#x263a;", "\xe2\x98\xba", "\xe2\x98\xba" },
+		{ "\r\n", "\n", " " },
+		{ "\t", "\t", " " },
+		{ "\xc3\xa9", "\xc3\xa9", "\xc3\xa9" },
+		{ "\xc3(", NULL, NULL },
+		{ "\xed\xa0\x80", NULL, NULL }
+	};
+	guint i;
+	guint offset;
+
+	/* Put each special sequence at every position relative to the 
+	 * blocks the scanner looks at */
+	for (i = 0; i < G_N_ELEMENTS (specials); i++) {
+		for (offset = 0; offset < 70; offset++) {
+			LmParser  *parser;
+			LmMessage *m = NULL;
+			gchar     *pad;
+			gchar     *document;
+			gchar     *expected;
+			gboolean   result;
+
+			pad = g_strnfill (offset, 'x');
+			document = g_strdup_printf ("<stream:stream>"
+						    "<message a='%s%s%s'>"
+						    "<body>%s%s%s</body>"
+						    "</message>",
+						    pad, specials[i].raw, pad,
+						    pad, specials[i].raw, pad);
+
+			parser = lm_parser_new (last_message_cb, &m, NULL);
+			result = lm_parser_parse (parser, document);
+			lm_parser_free (parser);
+
+			if (!specials[i].text) {
+				g_assert (!result);
+			} else {
+				LmMessageNode *body;
+
+				g_assert (result);
+				g_assert (m != NULL);
+
+				expected = g_strconcat (pad, specials[i].attribute,
+							pad, NULL);
+				g_assert_cmpstr (lm_message_node_get_attribute (m->node, "a"), 
+						 ==, expected);
+				g_free (expected);
+
+				body = lm_message_node_get_child (m->node, "body");
+				expected = g_strconcat (pad, specials[i].text, 
+							pad, NULL);
+				g_assert_cmpstr (body->value, ==, expected);
+				g_free (expected);
+			}
+
+			if (m) {
+				lm_message_unref (m);
+			}
+			g_free (document);
+			g_free (pad);
+		}
+	}
+}
+
+static void
+test_reset ()
+{
+	LmParser *parser;
+	GSList   *messages = NULL;
+
+	parser = lm_parser_new (collect_message_cb, &messages, NULL);
+
+	/* A stream cut in the middle of a stanza */
+	g_assert (lm_parser_parse (parser, 
+				   "<stream:stream><message><body>Hel"));
+	lm_parser_reset (parser);
+
+	g_assert (lm_parser_parse (parser, 
+				   "<stream:stream><message><body>lo</body>"
+				   "</message>"));
+	lm_parser_free (parser);
+
+	g_assert_cmpint (g_slist_length (messages), ==, 3);
+	g_assert_cmpstr (g_slist_nth_data (messages, 2), ==, 
+			 "<message><body>lo</body></message>");
+
+	free_messages (messages);
+}
+
+static void
+test_attribute_order ()
+{
+	LmParser  *parser;
+	LmMessage *m = NULL;
+	gchar     *str;
+	gchar     *name;
+	guint      i;
+
+	parser = lm_parser_new (last_message_cb, &m, NULL);
+	g_assert (lm_parser_parse (parser, 
+				   "<stream:stream><message to='a@b' "
+				   "from='c@d' id='1' type='chat' x='y'/>"));
+	lm_parser_free (parser);
+
+	/* Replacing keeps the place, new ones go last and need more 
+	 * room than the parser gave the node */
+	lm_message_node_set_attribute (m->node, "id", "2");
+	lm_message_node_set_attribute (m->node, "x", "<y&'\">");
+	for (i = 0; i < 10; i++) {
+		name = g_strdup_printf ("extra%u", i);
+		lm_message_node_set_attribute (m->node, name, name);
+		g_free (name);
+	}
+
+	str = lm_message_node_to_string (m->node);
+	g_assert (g_str_has_prefix (str, 
+				    "<message to=\"a@b\" from=\"c@d\" id=\"2\" "
+				    "type=\"chat\" x=\"&lt;y&amp;&apos;&quot;&gt;\" "
+				    "extra0=\"extra0\" "));
+	g_assert (g_str_has_suffix (str, "extra8=\"extra8\" extra9=\"extra9\"/>"));
+	g_free (str);
+
+	g_assert_cmpstr (lm_message_node_get_attribute (m->node, "extra9"), ==,
+			 "extra9");
+	g_assert (lm_message_node_get_attribute (m->node, "extra") == NULL);
+
+	/* Markup past the first vector and a control character */
+	lm_message_node_set_value (m->node, 
+				   "0123456789abcdef0123456789abcdef0123<a>\x01\tb");
+	str = lm_message_node_to_string (m->node);
+	g_assert (g_str_has_suffix (str, 
+				    ">0123456789abcdef0123456789abcdef0123"
+				    "&lt;a&gt;&#x1;\tb</message>"));
+	g_free (str);
+
+	lm_message_unref (m);
+}
+
+static void
+test_generated_ids ()
+{
+	GHashTable *seen;
+	gint        i;
+
+	seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	for (i = 0; i < 1000; i++) {
+		LmMessage   *m;
+		const gchar *id;
+
+		m = lm_message_new (NULL, LM_MESSAGE_TYPE_IQ);
+		id = lm_message_node_get_attribute (m->node, "id");
+
+		g_assert (id != NULL);
+		g_assert (strlen (id) <= 10);
+		g_assert (g_hash_table_lookup (seen, id) == NULL);
+		g_hash_table_insert (seen, g_strdup (id), GINT_TO_POINTER (1));
+
+		lm_message_unref (m);
+	}
+
+	g_hash_table_destroy (seen);
+}
+
+static void
+test_large_body ()
+{
+	LmParser      *parser;
+	LmMessageNode *body = NULL;
+	GString       *document;
+	GString       *expected;
+	gsize          i;
+
+	/* Entity references and line breaks end up cut at every possible
+	 * place by the 1 KB reads */
+	document = g_string_new ("<stream:stream><message><body>");
+	expected = g_string_new (NULL);
+	for (i = 0; i < 20000; i++) {
+		g_string_append (document, "QUJD&amp;\r\n\xc3\xa4");
+		g_string_append (expected, "QUJD&\n\xc3\xa4");
+	}
+	g_string_append (document, "</body></message>");
+
+	parser = lm_parser_new (keep_child_cb, &body, NULL);
+	for (i = 0; i < document->len; i += 1024) {
+		g_assert (lm_parser_parse_len (parser, document->str + i,
+					       MIN (1024, document->len - i)));
+	}
+	lm_parser_free (parser);
+
+	g_assert (body != NULL);
+	g_assert_cmpstr (lm_message_node_get_value (body), ==, expected->str);
+
+	lm_message_node_unref (body);
+	g_string_free (document, TRUE);
+	g_string_free (expected, TRUE);
+}
+
+static void
+test_escape ()
+{
+	LmMessage     *m;
+	LmMessageNode *body;
+	GString       *value;
+	GString       *expected;
+	gchar         *str;
+	gint           i;
+
+	/* Long enough to take the vectorized scan as well */
+	value = g_string_new (NULL);
+	expected = g_string_new ("<body a=\"");
+	for (i = 0; i < 3; i++) {
+		g_string_append (value, "\xc2\x80\xc2\x9f\xc2\x85\xc2\xa0\x7f<");
+		g_string_append (value, "0123456789012345678901234567890123456789");
+	}
+	for (i = 0; i < 2; i++) {
+		gint j;
+
+		for (j = 0; j < 3; j++) {
+			g_string_append (expected, "&#x80;&#x9f;\xc2\x85"
+					 "\xc2\xa0&#x7f;&lt;");
+			g_string_append (expected, 
+					 "0123456789012345678901234567890123456789");
+		}
+		g_string_append (expected, i == 0 ? "\">" : "</body>");
+	}
+
+	m = lm_message_new (NULL, LM_MESSAGE_TYPE_MESSAGE);
+	body = lm_message_node_add_child (m->node, "body", value->str);
+	lm_message_node_set_attribute (body, "a", value->str);
+
+	str = lm_message_node_to_string (body);
+	g_assert_cmpstr (str, ==, expected->str);
+	g_free (str);
+
+	lm_message_unref (m);
+	g_string_free (value, TRUE);
+	g_string_free (expected, TRUE);
+}
+
 int 
 main (int argc, char **argv)
 {
@@ -118,6 +1716,38 @@ main (int argc, char **argv)
 	
 	g_test_add_func ("/parser/valid_suite", test_valid_suite);
 	g_test_add_func ("/parser/invalid/suite", test_invalid_suite);
+	g_test_add_func ("/parser/differential/suite", 
+			 test_differential_suite);
+	g_test_add_func ("/parser/differential/constructs", 
+			 test_differential_constructs);
+	g_test_add_func ("/parser/embedded_nul", test_embedded_nul);
+	g_test_add_func ("/parser/node_outlives_stanza", 
+			 test_node_outlives_stanza);
+	g_test_add_func ("/parser/message_types", test_message_types);
+	g_test_add_func ("/parser/generated_ids", test_generated_ids);
+	g_test_add_func ("/parser/large_body", test_large_body);
+	g_test_add_func ("/parser/lazy", test_lazy);
+	g_test_add_func ("/parser/keep_raw", test_keep_raw);
+	g_test_add_func ("/parser/node_path", test_node_path);
+	g_test_add_func ("/parser/stanza_template", test_stanza_template);
+	g_test_add_func ("/parser/clone_shallow", test_clone_shallow);
+	g_test_add_func ("/parser/clone_outlives_original", 
+			 test_clone_outlives_original);
+	g_test_add_func ("/parser/static_strings", test_static_strings);
+	g_test_add_func ("/parser/alloc_stats", test_alloc_stats);
+	g_test_add_func ("/parser/allocator", test_allocator);
+	g_test_add_func ("/parser/allocator_limit", test_allocator_limit);
+	g_test_add_func ("/parser/max_stanza_size", test_max_stanza_size);
+	g_test_add_func ("/parser/wire_cache", test_wire_cache);
+	g_test_add_func ("/parser/escape", test_escape);
+	g_test_add_func ("/parser/append_children", test_append_children);
+	g_test_add_func ("/parser/deep_tree", test_deep_tree);
+	g_test_add_func ("/parser/filter", test_filter);
+	g_test_add_func ("/parser/long_spans", test_long_spans);
+	g_test_add_func ("/parser/split_tokens", test_split_tokens);
+	g_test_add_func ("/parser/pending_copies", test_pending_copies);
+	g_test_add_func ("/parser/reset", test_reset);
+	g_test_add_func ("/parser/attribute_order", test_attribute_order);
 
 	return g_test_run ();
 }
@@ -0,0 +1,163 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+
+#include "loudmouth/lm-reply-table.h"
+
+/* Generated ids whose numbers share the top 12 bits after the
+ * Fibonacci hashing of LmReplyTable, so they pile up around the same
+ * slot at every size up to 4096 slots */
+#define REPLY_TABLE_N_KEYS 200
+
+static void
+reply_table_clustered_ids (gchar ids[][16])
+{
+	guint32 key;
+	guint   n = 0;
+
+	for (key = 1; n < REPLY_TABLE_N_KEYS; key++) {
+		if (((guint32) (key * 2654435769U) >> 20) == 0x9e3) {
+			g_snprintf (ids[n++], 16, "lm%x", key);
+		}
+	}
+}
+
+static void
+reply_table_count_destroy (gpointer value)
+{
+	(* (gint *) value)++;
+}
+
+static void
+test_reply_table ()
+{
+	LmReplyTable *table;
+	gchar         ids[REPLY_TABLE_N_KEYS][16];
+	gchar         foreign[REPLY_TABLE_N_KEYS / 4][16];
+	gint          destroyed[REPLY_TABLE_N_KEYS];
+	gint          replaced = 0;
+	gboolean      stolen[REPLY_TABLE_N_KEYS];
+	gint          i;
+	gint          j;
+
+	reply_table_clustered_ids (ids);
+	for (i = 0; i < REPLY_TABLE_N_KEYS / 4; i++) {
+		/* Look like generated ids but aren't, they go to the
+		 * string table */
+		g_snprintf (foreign[i], 16, i % 2 ? "lm0%x" : "id-%d", i);
+	}
+	memset (destroyed, 0, sizeof (destroyed));
+	memset (stolen, 0, sizeof (stolen));
+
+	table = lm_reply_table_new (reply_table_count_destroy);
+	g_assert (lm_reply_table_lookup (table, ids[0]) == NULL);
+	g_assert (lm_reply_table_steal (table, ids[0]) == NULL);
+	g_assert (lm_reply_table_steal (table, foreign[0]) == NULL);
+
+	/* Grows through all sizes up to 512 slots */
+	for (i = 0; i < REPLY_TABLE_N_KEYS; i++) {
+		lm_reply_table_insert (table, ids[i], &destroyed[i]);
+		if (i % 4 == 0) {
+			lm_reply_table_insert (table, foreign[i / 4], 
+					       &destroyed[i]);
+		}
+
+		for (j = 0; j <= i; j++) {
+			g_assert (lm_reply_table_lookup (table, ids[j]) == 
+				  &destroyed[j]);
+		}
+	}
+	g_assert_cmpuint (lm_reply_table_size (table), ==, 
+			  REPLY_TABLE_N_KEYS + REPLY_TABLE_N_KEYS / 4);
+
+	/* Replacing destroys the old value only */
+	lm_reply_table_insert (table, ids[7], &replaced);
+	lm_reply_table_insert (table, foreign[3], &replaced);
+	g_assert_cmpint (destroyed[7], ==, 1);
+	g_assert_cmpint (destroyed[12], ==, 1);
+	destroyed[7] = destroyed[12] = 0;
+	g_assert (lm_reply_table_lookup (table, ids[7]) == &replaced);
+	g_assert (lm_reply_table_lookup (table, foreign[3]) == &replaced);
+	g_assert (lm_reply_table_steal (table, ids[7]) == &replaced);
+	g_assert (lm_reply_table_steal (table, foreign[3]) == &replaced);
+	stolen[7] = TRUE;
+	lm_reply_table_insert (table, foreign[3], &destroyed[12]);
+
+	/* Stealing from the middle of the cluster shifts the entries 
+	 * after the hole back, shrinking the table on the way */
+	for (i = 1; i < REPLY_TABLE_N_KEYS * 3; i += 3) {
+		gint k = i % REPLY_TABLE_N_KEYS;
+
+		if (stolen[k]) {
+			continue;
+		}
+
+		g_assert (lm_reply_table_steal (table, ids[k]) == 
+			  &destroyed[k]);
+		g_assert (lm_reply_table_steal (table, ids[k]) == NULL);
+		g_assert (lm_reply_table_lookup (table, ids[k]) == NULL);
+		stolen[k] = TRUE;
+
+		for (j = 0; j < REPLY_TABLE_N_KEYS; j++) {
+			g_assert (lm_reply_table_lookup (table, ids[j]) ==
+				  (stolen[j] ? NULL : &destroyed[j]));
+		}
+
+		/* Room again, insert one back now and then */
+		if (k % 5 == 0) {
+			lm_reply_table_insert (table, ids[k], &destroyed[k]);
+			stolen[k] = FALSE;
+		}
+	}
+
+	for (i = 0; i < REPLY_TABLE_N_KEYS / 4; i++) {
+		g_assert (lm_reply_table_lookup (table, foreign[i]) == 
+			  &destroyed[i * 4]);
+	}
+	for (i = 0; i < REPLY_TABLE_N_KEYS; i++) {
+		g_assert_cmpint (destroyed[i], ==, 0);
+	}
+
+	/* Whatever is left is destroyed with the table */
+	j = 0;
+	for (i = 0; i < REPLY_TABLE_N_KEYS; i++) {
+		if (!stolen[i]) {
+			j++;
+		}
+	}
+	g_assert_cmpuint (lm_reply_table_size (table), ==, 
+			  j + REPLY_TABLE_N_KEYS / 4);
+	lm_reply_table_free (table);
+	for (i = 0; i < REPLY_TABLE_N_KEYS; i++) {
+		g_assert_cmpint (destroyed[i], ==, 
+				 (stolen[i] ? 0 : 1) + (i % 4 == 0 ? 1 : 0));
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+	
+	g_test_add_func ("/reply_table/clustered_ids", test_reply_table);
+
+	return g_test_run ();
+}
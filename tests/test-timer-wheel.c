@@ -0,0 +1,227 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+/*
+ * Copyright (C) 2008 Imendio AB
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+
+#include "loudmouth/lm-timer-wheel.h"
+
+typedef struct {
+	LmTimer       timer;
+	LmTimerWheel *wheel;
+	guint64       fired_at;
+	gint          n_fired;
+	/* Done from the callback */
+	LmTimer      *cancel;
+	LmTimer      *add;
+	guint64       add_ticks;
+} TestTimer;
+
+static void
+test_timer_fired_cb (LmTimer *timer, gpointer user_data)
+{
+	TestTimer *t = (TestTimer *) timer;
+
+	g_assert (!lm_timer_wheel_is_pending (timer));
+	g_assert_cmpuint (lm_timer_wheel_get_now (t->wheel), ==, 
+			  timer->expires);
+
+	t->fired_at = lm_timer_wheel_get_now (t->wheel);
+	t->n_fired++;
+
+	if (t->cancel) {
+		lm_timer_wheel_cancel (t->wheel, t->cancel);
+	}
+	if (t->add) {
+		lm_timer_wheel_add (t->wheel, t->add, t->add_ticks);
+	}
+}
+
+static void
+test_timer_wheel_levels ()
+{
+	/* Around where each level of the wheel ends */
+	static const guint64  ticks[] = { 1, 2, 63, 64, 65, 127, 128,
+					  4095, 4096, 4097, 8192,
+					  262143, 262144, 262145, 300000 };
+	TestTimer             timers[G_N_ELEMENTS (ticks)];
+	LmTimerWheel         *wheel;
+	guint64               start;
+	guint64               now;
+	guint                 round;
+	guint                 i;
+
+	wheel = lm_timer_wheel_new ();
+
+	/* From tick 0, then from a tick that isn't aligned with any level,
+	 * advancing in one go and then in uneven steps */
+	for (round = 0; round < 2; round++) {
+		start = round == 0 ? 0 : 1000003;
+		lm_timer_wheel_advance (wheel, start, test_timer_fired_cb, NULL);
+		g_assert_cmpuint (lm_timer_wheel_get_now (wheel), ==, start);
+
+		memset (timers, 0, sizeof (timers));
+		for (i = 0; i < G_N_ELEMENTS (ticks); i++) {
+			timers[i].wheel = wheel;
+			lm_timer_wheel_add (wheel, &timers[i].timer, ticks[i]);
+			g_assert (lm_timer_wheel_is_pending (&timers[i].timer));
+		}
+		g_assert_cmpuint (lm_timer_wheel_get_n_timers (wheel), ==, 
+				  G_N_ELEMENTS (ticks));
+
+		if (round == 0) {
+			lm_timer_wheel_advance (wheel, start + 300000,
+						test_timer_fired_cb, NULL);
+		} else {
+			for (now = start; now < start + 300000; now += 997) {
+				lm_timer_wheel_advance (wheel, now, 
+							test_timer_fired_cb, 
+							NULL);
+
+				for (i = 0; i < G_N_ELEMENTS (ticks); i++) {
+					g_assert_cmpint (timers[i].n_fired, ==,
+							 start + ticks[i] <= now);
+				}
+			}
+			lm_timer_wheel_advance (wheel, start + 300000,
+						test_timer_fired_cb, NULL);
+		}
+
+		for (i = 0; i < G_N_ELEMENTS (ticks); i++) {
+			g_assert_cmpint (timers[i].n_fired, ==, 1);
+			g_assert_cmpuint (timers[i].fired_at, ==, 
+					  start + ticks[i]);
+		}
+		g_assert_cmpuint (lm_timer_wheel_get_n_timers (wheel), ==, 0);
+	}
+
+	/* Going back is ignored */
+	lm_timer_wheel_advance (wheel, 5, test_timer_fired_cb, NULL);
+	g_assert_cmpuint (lm_timer_wheel_get_now (wheel), ==, 
+			  1000003 + 300000);
+
+	lm_timer_wheel_free (wheel);
+}
+
+static void
+test_timer_wheel_callbacks ()
+{
+	LmTimerWheel *wheel;
+	TestTimer     a, b, c, d;
+
+	wheel = lm_timer_wheel_new ();
+	memset (&a, 0, sizeof (a));
+	memset (&b, 0, sizeof (b));
+	memset (&c, 0, sizeof (c));
+	memset (&d, 0, sizeof (d));
+	a.wheel = b.wheel = c.wheel = d.wheel = wheel;
+
+	/* @a is due with @b in the same slot and cancels it, re-adds 
+	 * itself and cancels @d, which is further out */
+	a.cancel = &b.timer;
+	a.add = &a.timer;
+	a.add_ticks = 10;
+	lm_timer_wheel_add (wheel, &a.timer, 70);
+	lm_timer_wheel_add (wheel, &b.timer, 70);
+	lm_timer_wheel_add (wheel, &d.timer, 5000);
+	b.cancel = &d.timer;
+
+	lm_timer_wheel_advance (wheel, 70, test_timer_fired_cb, NULL);
+	g_assert_cmpint (a.n_fired, ==, 1);
+	g_assert_cmpint (b.n_fired, ==, 0);
+	g_assert (!lm_timer_wheel_is_pending (&b.timer));
+	g_assert (lm_timer_wheel_is_pending (&a.timer));
+	g_assert (lm_timer_wheel_is_pending (&d.timer));
+	g_assert_cmpuint (lm_timer_wheel_get_n_timers (wheel), ==, 2);
+
+	/* Now @a adds @c, as soon as possible, and stops re-adding */
+	a.cancel = &d.timer;
+	a.add = &c.timer;
+	a.add_ticks = 0;
+	lm_timer_wheel_advance (wheel, 79, test_timer_fired_cb, NULL);
+	g_assert_cmpint (a.n_fired, ==, 1);
+	lm_timer_wheel_advance (wheel, 6000, test_timer_fired_cb, NULL);
+	g_assert_cmpint (a.n_fired, ==, 2);
+	g_assert_cmpuint (a.fired_at, ==, 80);
+	g_assert_cmpint (c.n_fired, ==, 1);
+	g_assert_cmpuint (c.fired_at, ==, 81);
+	g_assert_cmpint (d.n_fired, ==, 0);
+	g_assert_cmpuint (lm_timer_wheel_get_n_timers (wheel), ==, 0);
+
+	/* Cancelling twice and adding a pending timer again are fine */
+	lm_timer_wheel_cancel (wheel, &d.timer);
+	lm_timer_wheel_add (wheel, &d.timer, 3);
+	lm_timer_wheel_add (wheel, &d.timer, 300);
+	g_assert_cmpuint (lm_timer_wheel_get_n_timers (wheel), ==, 1);
+	lm_timer_wheel_advance (wheel, 6299, test_timer_fired_cb, NULL);
+	g_assert_cmpint (d.n_fired, ==, 0);
+	lm_timer_wheel_advance (wheel, 6300, test_timer_fired_cb, NULL);
+	g_assert_cmpint (d.n_fired, ==, 1);
+
+	lm_timer_wheel_free (wheel);
+}
+
+static void
+test_timer_wheel_far_future ()
+{
+	/* Past what the top level reaches, 2^24 ticks */
+	const guint64  far = (G_GUINT64_CONSTANT (1) << 24) + 1000;
+	LmTimerWheel  *wheel;
+	TestTimer      a, b;
+
+	wheel = lm_timer_wheel_new ();
+	memset (&a, 0, sizeof (a));
+	memset (&b, 0, sizeof (b));
+	a.wheel = b.wheel = wheel;
+
+	lm_timer_wheel_advance (wheel, 12345, test_timer_fired_cb, NULL);
+	lm_timer_wheel_add (wheel, &a.timer, far);
+	lm_timer_wheel_add (wheel, &b.timer, G_MAXUINT64 / 2);
+
+	/* Parked in the last slot it reaches, then moved on */
+	lm_timer_wheel_advance (wheel, 12345 + far - 1, 
+				test_timer_fired_cb, NULL);
+	g_assert_cmpint (a.n_fired, ==, 0);
+	g_assert (lm_timer_wheel_is_pending (&a.timer));
+
+	lm_timer_wheel_advance (wheel, 12345 + far, test_timer_fired_cb, NULL);
+	g_assert_cmpint (a.n_fired, ==, 1);
+	g_assert_cmpuint (a.fired_at, ==, 12345 + far);
+
+	g_assert_cmpint (b.n_fired, ==, 0);
+	g_assert (lm_timer_wheel_is_pending (&b.timer));
+	lm_timer_wheel_cancel (wheel, &b.timer);
+	g_assert_cmpuint (lm_timer_wheel_get_n_timers (wheel), ==, 0);
+
+	lm_timer_wheel_free (wheel);
+}
+
+int
+main (int argc, char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+	
+	g_test_add_func ("/timer_wheel/levels", test_timer_wheel_levels);
+	g_test_add_func ("/timer_wheel/callbacks", 
+			 test_timer_wheel_callbacks);
+	g_test_add_func ("/timer_wheel/far_future", 
+			 test_timer_wheel_far_future);
+
+	return g_test_run ();
+}